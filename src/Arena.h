@@ -0,0 +1,85 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+// Bump allocator for the scratch memory a thread needs while rendering a tile.
+// Allocations are taken one after the other from a single block and are all
+// released together by Reset, so they cost a few instructions and never touch
+// the heap. If a tile needs more than the block holds, the rest comes from the
+// heap and the next Reset replaces the block by one large enough for all of
+// it. After the first frames the block fits every tile and no more heap
+// allocations happen. Only types that need no constructor or destructor, such
+// as ints, floats, vectors and Intersections, can be allocated.
+
+#include <vector>
+#include <cstddef>
+
+class Arena
+{
+public:
+	Arena()
+		: block(0), capacity(0), used(0), needed(0)
+	{
+	}
+
+	~Arena()
+	{
+		Release();
+		delete[] block;
+	}
+
+	// Memory for n elements of type T, which stays valid until the next Reset
+	template<class T>
+	T* Allocate( size_t n )
+	{
+		size_t size = n * sizeof(T);
+		size_t offset = (used + ALIGNMENT - 1) / ALIGNMENT * ALIGNMENT;
+		needed = (needed + ALIGNMENT - 1) / ALIGNMENT * ALIGNMENT + size;
+		if( offset + size <= capacity )
+		{
+			used = offset + size;
+			return (T*) (block + offset);
+		}
+
+		//too large for the block, the next Reset makes it large enough
+		char* memory = new char[size];
+		overflow.push_back( memory );
+		return (T*) memory;
+	}
+
+	// Releases everything allocated since the last Reset
+	void Reset()
+	{
+		Release();
+		if( needed > capacity )
+		{
+			delete[] block;
+			capacity = needed;
+			block = new char[capacity];
+		}
+		used = 0;
+		needed = 0;
+	}
+
+private:
+	// Allocations are aligned like those of new, which is enough for any type
+	// without an alignas of its own
+	static const size_t ALIGNMENT = alignof(std::max_align_t);
+
+	char* block;
+	size_t capacity;
+	size_t used;
+	size_t needed;
+	std::vector<char*> overflow;
+
+	void Release()
+	{
+		for( size_t i = 0; i < overflow.size(); i++ )
+			delete[] overflow[i];
+		overflow.clear();
+	}
+
+	Arena( const Arena& );
+	Arena& operator=( const Arena& );
+};
+
+#endif
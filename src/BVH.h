@@ -0,0 +1,390 @@
+#ifndef BVH_H
+#define BVH_H
+
+// Bounding volume hierarchy built with the surface area heuristic (SAH). The
+// same builder is used for the triangles of a Mesh (bottom level) and for
+// the Objects of the scene (top level), it only needs a box per primitive.
+// Primitives that move can be followed by refitting the bounds of the nodes,
+// or by building the hierarchy again with the faster builder of LBVH.h.
+
+#include <glm/glm.hpp>
+#include <vector>
+#include <algorithm>
+#include <cmath>
+#include "SceneArray.h"
+#include "ThreadPool.h"
+
+// Number of buckets the primitive centroids are binned into when evaluating
+// the SAH along an axis.
+const int BVH_NUM_BINS = 16;
+
+// Leaves never contain more primitives than this.
+const int BVH_MAX_LEAF_SIZE = 8;
+
+// Below this depth the SAH is used, deeper nodes are split at the median so
+// the tree depth (and the traversal stack) stays bounded on degenerate input.
+const int BVH_MAX_SAH_DEPTH = 64;
+
+// Size of the stack used when traversing a hierarchy.
+const int BVH_STACK_SIZE = 128;
+
+// Relative costs of traversing a node and of intersecting a group of
+// BVH_LEAF_GROUP_SIZE primitives. Triangles are tested eight at a time (see
+// TriangleStore.h) and such a test costs about as much as four ray-box tests.
+const float BVH_TRAVERSAL_COST = 1.0f;
+const float BVH_INTERSECTION_COST = 4.0f;
+const int BVH_LEAF_GROUP_SIZE = 8;
+
+// A node of the hierarchy. Interior nodes have count == 0 and their two
+// children are stored at nodes[first] and nodes[first+1]. Leaves reference
+// the primitives indices[first] ... indices[first+count-1].
+struct BVHNode
+{
+	glm::vec3 Pmin;
+	glm::vec3 Pmax;
+	int first;
+	int count;
+};
+
+// Surface area of an axis aligned box
+float BoxArea( glm::vec3 Pmin, glm::vec3 Pmax )
+{
+	glm::vec3 d = Pmax - Pmin;
+	return 2.0f * (d.x * d.y + d.y * d.z + d.z * d.x);
+}
+
+// Reciprocal of a ray direction for the slab test. Components that are zero
+// are replaced by a tiny value so the reciprocal stays finite.
+glm::vec3 InverseDirection( glm::vec3 dir )
+{
+	const float tiny = 1e-20f;
+	for( int i = 0; i < 3; i++ )
+	{
+		if( std::fabs(dir[i]) < tiny )
+			dir[i] = dir[i] < 0 ? -tiny : tiny;
+	}
+	return glm::vec3( 1.0f/dir.x, 1.0f/dir.y, 1.0f/dir.z );
+}
+
+// Slab test between a ray and an axis aligned box. Returns true if the ray
+// enters the box before maxDistance, the entry distance is put in entry.
+bool BoxIntersection( glm::vec3 start, glm::vec3 invDir, glm::vec3 Pmin, glm::vec3 Pmax, float maxDistance, float& entry )
+{
+	float tx1 = (Pmin.x - start.x) * invDir.x;
+	float tx2 = (Pmax.x - start.x) * invDir.x;
+	float tmin = std::min(tx1, tx2);
+	float tmax = std::max(tx1, tx2);
+
+	float ty1 = (Pmin.y - start.y) * invDir.y;
+	float ty2 = (Pmax.y - start.y) * invDir.y;
+	tmin = std::max(tmin, std::min(ty1, ty2));
+	tmax = std::min(tmax, std::max(ty1, ty2));
+
+	float tz1 = (Pmin.z - start.z) * invDir.z;
+	float tz2 = (Pmax.z - start.z) * invDir.z;
+	tmin = std::max(tmin, std::min(tz1, tz2));
+	tmax = std::min(tmax, std::max(tz1, tz2));
+
+	entry = tmin;
+	return tmax >= tmin && tmax >= 0 && tmin <= maxDistance;
+}
+
+class BVH
+{
+public:
+	SceneArray<BVHNode> nodes;
+	SceneArray<int> indices;
+
+	// Builds the hierarchy over primitives whose bounding boxes are given by
+	// boxMin[i] and boxMax[i].
+	void Build( const std::vector<glm::vec3>& boxMin, const std::vector<glm::vec3>& boxMax )
+	{
+		nodes.clear();
+		indices.resize( boxMin.size() );
+		for( size_t i = 0; i < indices.size(); i++ )
+			indices[i] = i;
+
+		if( boxMin.empty() )
+			return;
+
+		centroids.resize( boxMin.size() );
+		for( size_t i = 0; i < boxMin.size(); i++ )
+			centroids[i] = 0.5f * (boxMin[i] + boxMax[i]);
+
+		nodes.reserve( 2 * boxMin.size() );
+		BVHNode root;
+		root.first = 0;
+		root.count = boxMin.size();
+		nodes.push_back( root );
+
+		//nodes still to be processed together with their depth
+		std::vector< std::pair<int,int> > todo;
+		todo.push_back( std::make_pair(0, 0) );
+
+		while( !todo.empty() )
+		{
+			int nodeIndex = todo.back().first;
+			int depth = todo.back().second;
+			todo.pop_back();
+
+			int first = nodes[nodeIndex].first;
+			int count = nodes[nodeIndex].count;
+			ComputeBounds( first, count, boxMin, boxMax, nodes[nodeIndex] );
+
+			int mid = Split( nodes[nodeIndex], depth, boxMin, boxMax );
+			if( mid < 0 )
+				continue;
+
+			//turn the node into an interior node with two children
+			BVHNode left, right;
+			left.first = first;
+			left.count = mid - first;
+			right.first = mid;
+			right.count = first + count - mid;
+
+			int childIndex = nodes.size();
+			nodes.push_back( left );
+			nodes.push_back( right );
+			nodes[nodeIndex].first = childIndex;
+			nodes[nodeIndex].count = 0;
+
+			todo.push_back( std::make_pair(childIndex, depth + 1) );
+			todo.push_back( std::make_pair(childIndex + 1, depth + 1) );
+		}
+
+		centroids.clear();
+	}
+
+	// Recomputes the bounds of every node after the primitives moved, keeping
+	// the structure of the hierarchy. box(i, Pmin, Pmax) puts the new bounding
+	// box of primitive i in Pmin and Pmax. The subtrees below the first few
+	// levels are refitted in parallel, then the nodes above them.
+	template<class PrimitiveBox>
+	void Refit( const PrimitiveBox& box, ThreadPool& pool )
+	{
+		if( nodes.empty() )
+			return;
+
+		//split the tree breadth first until there is a subtree for every task,
+		//the interior nodes above the subtrees are kept parents first
+		std::vector<int> roots( 1, 0 );
+		std::vector<int> above;
+		while( (int) roots.size() < 4 * pool.NumThreads() )
+		{
+			std::vector<int> next;
+			bool split = false;
+			for( size_t r = 0; r < roots.size(); r++ )
+			{
+				const BVHNode& node = nodes[roots[r]];
+				if( node.count > 0 )
+				{
+					next.push_back( roots[r] );
+					continue;
+				}
+				above.push_back( roots[r] );
+				next.push_back( node.first );
+				next.push_back( node.first + 1 );
+				split = true;
+			}
+			roots.swap( next );
+			if( !split )
+				break;
+		}
+
+		pool.ParallelFor( roots.size(), [&]( int r, int thread )
+		{
+			RefitNode( roots[r], box );
+		} );
+
+		for( int i = (int) above.size() - 1; i >= 0; i-- )
+			MergeChildren( nodes[above[i]] );
+	}
+
+private:
+	std::vector<glm::vec3> centroids;
+
+	template<class PrimitiveBox>
+	void RefitNode( int nodeIndex, const PrimitiveBox& box )
+	{
+		BVHNode& node = nodes[nodeIndex];
+		if( node.count == 0 )
+		{
+			RefitNode( node.first, box );
+			RefitNode( node.first + 1, box );
+			MergeChildren( node );
+			return;
+		}
+
+		box( indices[node.first], node.Pmin, node.Pmax );
+		for( int i = node.first + 1; i < node.first + node.count; i++ )
+		{
+			glm::vec3 Pmin, Pmax;
+			box( indices[i], Pmin, Pmax );
+			node.Pmin = glm::min( node.Pmin, Pmin );
+			node.Pmax = glm::max( node.Pmax, Pmax );
+		}
+	}
+
+	void MergeChildren( BVHNode& node )
+	{
+		const BVHNode& left = nodes[node.first];
+		const BVHNode& right = nodes[node.first + 1];
+		node.Pmin = glm::min( left.Pmin, right.Pmin );
+		node.Pmax = glm::max( left.Pmax, right.Pmax );
+	}
+
+	void ComputeBounds( int first, int count, const std::vector<glm::vec3>& boxMin, const std::vector<glm::vec3>& boxMax, BVHNode& node )
+	{
+		node.Pmin = boxMin[indices[first]];
+		node.Pmax = boxMax[indices[first]];
+		for( int i = first + 1; i < first + count; i++ )
+		{
+			node.Pmin = glm::min( node.Pmin, boxMin[indices[i]] );
+			node.Pmax = glm::max( node.Pmax, boxMax[indices[i]] );
+		}
+	}
+
+	// Partitions the primitives of the node and returns the index of the
+	// first primitive of the right child, or -1 if the node should be a leaf.
+	int Split( const BVHNode& node, int depth, const std::vector<glm::vec3>& boxMin, const std::vector<glm::vec3>& boxMax )
+	{
+		int first = node.first;
+		int count = node.count;
+		if( count <= 1 )
+			return -1;
+
+		//bounds of the centroids, which are what gets binned
+		glm::vec3 cmin = centroids[indices[first]];
+		glm::vec3 cmax = cmin;
+		for( int i = first + 1; i < first + count; i++ )
+		{
+			cmin = glm::min( cmin, centroids[indices[i]] );
+			cmax = glm::max( cmax, centroids[indices[i]] );
+		}
+
+		int* begin = &indices[0] + first;
+		int* end = begin + count;
+
+		if( depth >= BVH_MAX_SAH_DEPTH )
+			return MedianSplit( begin, end, cmin, cmax );
+
+		float bestCost = BVH_INTERSECTION_COST * Groups( count );
+		int bestAxis = -1;
+		int bestBin = 0;
+
+		for( int axis = 0; axis < 3; axis++ )
+		{
+			float extent = cmax[axis] - cmin[axis];
+			if( extent <= 0 )
+				continue;
+
+			int binCount[BVH_NUM_BINS] = {0};
+			glm::vec3 binMin[BVH_NUM_BINS];
+			glm::vec3 binMax[BVH_NUM_BINS];
+
+			float scale = BVH_NUM_BINS / extent;
+			for( int i = first; i < first + count; i++ )
+			{
+				int b = Bin( centroids[indices[i]][axis], cmin[axis], scale );
+				if( binCount[b] == 0 )
+				{
+					binMin[b] = boxMin[indices[i]];
+					binMax[b] = boxMax[indices[i]];
+				}
+				else
+				{
+					binMin[b] = glm::min( binMin[b], boxMin[indices[i]] );
+					binMax[b] = glm::max( binMax[b], boxMax[indices[i]] );
+				}
+				binCount[b]++;
+			}
+
+			//sweep from the right to get the area and count of every right side
+			float rightArea[BVH_NUM_BINS];
+			int rightCount[BVH_NUM_BINS];
+			glm::vec3 rmin, rmax;
+			int n = 0;
+			for( int b = BVH_NUM_BINS - 1; b > 0; b-- )
+			{
+				if( binCount[b] > 0 )
+				{
+					rmin = n == 0 ? binMin[b] : glm::min( rmin, binMin[b] );
+					rmax = n == 0 ? binMax[b] : glm::max( rmax, binMax[b] );
+					n += binCount[b];
+				}
+				rightCount[b] = n;
+				rightArea[b] = n > 0 ? BoxArea( rmin, rmax ) : 0;
+			}
+
+			//sweep from the left and evaluate the cost of splitting after every bin
+			glm::vec3 lmin, lmax;
+			n = 0;
+			for( int b = 0; b < BVH_NUM_BINS - 1; b++ )
+			{
+				if( binCount[b] > 0 )
+				{
+					lmin = n == 0 ? binMin[b] : glm::min( lmin, binMin[b] );
+					lmax = n == 0 ? binMax[b] : glm::max( lmax, binMax[b] );
+					n += binCount[b];
+				}
+				if( n == 0 || rightCount[b+1] == 0 )
+					continue;
+
+				float cost = BVH_TRAVERSAL_COST + BVH_INTERSECTION_COST *
+					(Groups( n ) * BoxArea( lmin, lmax ) + Groups( rightCount[b+1] ) * rightArea[b+1]) / BoxArea( node.Pmin, node.Pmax );
+				if( cost < bestCost )
+				{
+					bestCost = cost;
+					bestAxis = axis;
+					bestBin = b;
+				}
+			}
+		}
+
+		if( bestAxis < 0 )
+		{
+			//splitting does not pay off, unless the leaf would be too large
+			if( count <= BVH_MAX_LEAF_SIZE )
+				return -1;
+			return MedianSplit( begin, end, cmin, cmax );
+		}
+
+		float scale = BVH_NUM_BINS / (cmax[bestAxis] - cmin[bestAxis]);
+		float offset = cmin[bestAxis];
+		int* mid = std::partition( begin, end, [&]( int i ) {
+			return Bin( centroids[i][bestAxis], offset, scale ) <= bestBin;
+		});
+		return first + (mid - begin);
+	}
+
+	// Number of groups the primitives of a leaf are intersected in
+	float Groups( int count )
+	{
+		return (count + BVH_LEAF_GROUP_SIZE - 1) / BVH_LEAF_GROUP_SIZE;
+	}
+
+	int Bin( float c, float offset, float scale )
+	{
+		int b = (int) ((c - offset) * scale);
+		return std::min( std::max( b, 0 ), BVH_NUM_BINS - 1 );
+	}
+
+	// Splits the primitives in two halves along the longest centroid axis
+	int MedianSplit( int* begin, int* end, glm::vec3 cmin, glm::vec3 cmax )
+	{
+		glm::vec3 extent = cmax - cmin;
+		int axis = 0;
+		if( extent.y > extent[axis] )
+			axis = 1;
+		if( extent.z > extent[axis] )
+			axis = 2;
+
+		int* mid = begin + (end - begin) / 2;
+		std::nth_element( begin, mid, end, [&]( int a, int b ) {
+			return centroids[a][axis] < centroids[b][axis];
+		});
+		return mid - &indices[0];
+	}
+};
+
+#endif
@@ -0,0 +1,91 @@
+#ifndef FRAME_GOVERNOR_H
+#define FRAME_GOVERNOR_H
+
+// Keeps the render time of interactive frames within a budget by rendering
+// them at a lower quality. The qualities form a ladder of levels: level 0 is
+// the full resolution with all antialiasing samples, the next level drops to
+// one sample per pixel, and the levels after it lower the resolution in
+// steps of an eighth of the width and height, down to a quarter of them.
+//
+// After every frame the governor is given its render time. A frame over
+// budget moves down the ladder, as far as the resolution needed to fit the
+// budget, assuming the time is proportional to the number of pixels. A frame
+// well under budget moves up one level, but only if the next level is
+// expected to fit as well, so that the quality does not flip between two
+// levels every frame.
+
+#include <algorithm>
+#include <cmath>
+
+class FrameGovernor
+{
+public:
+	// budget is the render time aimed at in milliseconds, samples the
+	// antialiasing samples of a full quality frame
+	FrameGovernor( float budget, int samples )
+		: budget( budget ), samples( samples ), level( 0 )
+	{
+		//without antialiasing there is no level with fewer samples
+		firstScaleLevel = samples > 1 ? 1 : 0;
+		numLevels = firstScaleLevel + (SCALE_STEPS - MIN_SCALE_STEPS) + 1;
+	}
+
+	// Fraction of the width and height of the image to render at
+	float Scale() const
+	{
+		return ScaleOf( level );
+	}
+
+	// Antialiasing samples per pixel to render with
+	int Samples() const
+	{
+		return level == 0 ? samples : 1;
+	}
+
+	// Takes the render time in milliseconds of a frame rendered at the
+	// current level and chooses the level of the next frame
+	void FrameRendered( float time )
+	{
+		if( time > budget * OVER_BUDGET )
+		{
+			if( level < firstScaleLevel )
+			{
+				level++;
+				return;
+			}
+
+			//the largest scale whose pixels fit into the budget
+			float scale = ScaleOf( level ) * sqrtf( budget / time );
+			while( level + 1 < numLevels && ScaleOf( level ) > scale )
+				level++;
+		}
+		else if( level > 0 && time < budget * UNDER_BUDGET )
+		{
+			//the samples of a pixel cost about as much as its first one each
+			float ratio = level <= firstScaleLevel ? samples : ScaleOf( level - 1 ) / ScaleOf( level );
+			float expected = level <= firstScaleLevel ? time * ratio : time * ratio * ratio;
+			if( expected < budget )
+				level--;
+		}
+	}
+
+private:
+	static const int SCALE_STEPS = 8;
+	static const int MIN_SCALE_STEPS = 2;
+	static constexpr float OVER_BUDGET = 1.1f;
+	static constexpr float UNDER_BUDGET = 0.7f;
+
+	float budget;
+	int samples;
+	int level;
+	int firstScaleLevel;
+	int numLevels;
+
+	float ScaleOf( int level ) const
+	{
+		int steps = SCALE_STEPS - std::max( level - firstScaleLevel, 0 );
+		return float( steps ) / SCALE_STEPS;
+	}
+};
+
+#endif
@@ -0,0 +1,494 @@
+#ifndef GEOMETRY_PAGER_H
+#define GEOMETRY_PAGER_H
+
+// Out-of-core rendering of meshes too large to keep in memory. The meshes are
+// laid out in pages (see LayoutMeshPages) and stored in the scene cache,
+// which is memory mapped. The pager keeps track of which pages are resident
+// and loads a page by reading all of it at once. When more than the budget
+// is resident, the pages used least recently are given back to the operating
+// system, which drops them from memory and reads them from the file again if
+// they are used later.
+//
+// Giving back a page never changes what the memory holds, only whether it is
+// in memory, so a thread may still read a page that another thread gives
+// back. This is why only meshes that refer into the mapped cache can be
+// paged, and why the cache is never written to: a mesh that is about to be
+// changed is detached and copied out of it first.
+//
+// The budget is a target rather than a limit. A thread that still reads a page
+// another thread gives back reads it in again, and that memory is only given
+// back when the renderer trims the pages at the end of the frame (see Trim).
+//
+// The nodes of the hierarchies above the pages stay in memory, outside the
+// budget, as do the tables of the pages. A ray that
+// reaches the root of a treelet whose page is not resident is deferred by the
+// renderer, which traces the rays waiting for a page together once it is
+// loaded (see Renderer.h).
+
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <algorithm>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include "TestModel.h"
+
+// Triangles a page is made of at most, unless a single leaf has more
+const int MESH_PAGE_TRIANGLES = 4096;
+
+// Lays the mesh out for paging in pages of at most pageTriangles triangles.
+// The hierarchy is cut into treelets, the largest subtrees with at most
+// pageTriangles triangles, and runs of consecutive treelets make the pages.
+// The nodes above the treelets come first, followed by the nodes inside the
+// pages, page after page. The faces are sorted in the same order, so that the
+// indices of the hierarchy count up, and the vertices in the order the faces
+// first use them. The triangle blocks are built again, which keeps them in
+// the order of the faces.
+void LayoutMeshPages( Mesh& mesh, int pageTriangles )
+{
+	BVH& bvh = mesh.bvh;
+	int numNodes = bvh.nodes.size();
+	if( numNodes == 0 )
+		return;
+
+	//triangles below every node, the children of a node come after it
+	std::vector<int> below( numNodes );
+	for( int n = numNodes - 1; n >= 0; n-- )
+	{
+		const BVHNode& node = bvh.nodes[n];
+		below[n] = node.count > 0 ? node.count : below[node.first] + below[node.first + 1];
+	}
+
+	//the nodes above the treelets keep their pairs of children together, the
+	//roots of the treelets are found depth first, in the order of their triangles
+	std::vector<BVHNode> nodes( numNodes );
+	std::vector<int> newIndex( numNodes, -1 );
+	std::vector<int> roots;
+	std::vector<int> stack( 1, 0 );
+	newIndex[0] = 0;
+	int numTop = 1;
+	while( !stack.empty() )
+	{
+		int n = stack.back();
+		stack.pop_back();
+		BVHNode node = bvh.nodes[n];
+		if( node.count > 0 || below[n] <= pageTriangles )
+		{
+			roots.push_back( n );
+			continue;
+		}
+
+		newIndex[node.first] = numTop;
+		newIndex[node.first + 1] = numTop + 1;
+		numTop += 2;
+		stack.push_back( node.first + 1 );
+		stack.push_back( node.first );
+		node.first = newIndex[node.first];
+		nodes[newIndex[n]] = node;
+	}
+
+	//the treelets of a page follow each other, the nodes, triangles and blocks
+	//of every page are numbered in the order they are found in
+	std::vector<MeshPage> pages;
+	std::vector<int> rootPage( numTop, -1 );
+	std::vector<int> order;
+	order.reserve( bvh.indices.size() );
+	int numNodesSoFar = numTop;
+	int numBlocks = 0;
+	for( size_t r = 0; r < roots.size(); r++ )
+	{
+		if( pages.empty() || (int) order.size() - pages.back().firstTriangle + below[roots[r]] > pageTriangles )
+		{
+			if( !pages.empty() )
+			{
+				pages.back().endNode = numNodesSoFar;
+				pages.back().endTriangle = order.size();
+				pages.back().endBlock = numBlocks;
+			}
+			MeshPage page;
+			page.firstNode = numNodesSoFar;
+			page.firstTriangle = order.size();
+			page.firstBlock = numBlocks;
+			pages.push_back( page );
+		}
+		rootPage[newIndex[roots[r]]] = pages.size() - 1;
+
+		stack.assign( 1, roots[r] );
+		while( !stack.empty() )
+		{
+			int n = stack.back();
+			stack.pop_back();
+			BVHNode node = bvh.nodes[n];
+			if( node.count > 0 )
+			{
+				for( int i = 0; i < node.count; i++ )
+					order.push_back( bvh.indices[node.first + i] );
+				node.first = order.size() - node.count;
+				numBlocks += (node.count + TRIANGLE_BLOCK_SIZE - 1) / TRIANGLE_BLOCK_SIZE;
+			}
+			else
+			{
+				newIndex[node.first] = numNodesSoFar;
+				newIndex[node.first + 1] = numNodesSoFar + 1;
+				numNodesSoFar += 2;
+				stack.push_back( node.first + 1 );
+				stack.push_back( node.first );
+				node.first = newIndex[node.first];
+			}
+			nodes[newIndex[n]] = node;
+		}
+	}
+	pages.back().endNode = numNodesSoFar;
+	pages.back().endTriangle = order.size();
+	pages.back().endBlock = numBlocks;
+
+	//the faces in the order of the pages, with the vertices numbered again in
+	//the order they are first used
+	int numVertices = mesh.NumVertices();
+	std::vector<int> vertexIndex( numVertices, -1 );
+	std::vector<int> vertexOrder;
+	vertexOrder.reserve( numVertices );
+	std::vector<MeshFace> faces( order.size() );
+	for( size_t p = 0; p < pages.size(); p++ )
+	{
+		pages[p].firstVertex = vertexOrder.size();
+		for( int i = pages[p].firstTriangle; i < pages[p].endTriangle; i++ )
+		{
+			faces[i] = mesh.faces[order[i]];
+			for( int k = 0; k < 3; k++ )
+			{
+				int& v = vertexIndex[faces[i].v[k]];
+				if( v < 0 )
+				{
+					v = vertexOrder.size();
+					vertexOrder.push_back( faces[i].v[k] );
+				}
+				faces[i].v[k] = v;
+			}
+		}
+		pages[p].endVertex = vertexOrder.size();
+	}
+
+	if( mesh.compact )
+	{
+		std::vector<QuantizedVertex> vertices( vertexOrder.size() );
+		for( size_t v = 0; v < vertexOrder.size(); v++ )
+			vertices[v] = mesh.quantizedVertices[vertexOrder[v]];
+		mesh.quantizedVertices = SceneArray<QuantizedVertex>( vertices );
+	}
+	else
+	{
+		std::vector<glm::vec3> vertices( vertexOrder.size() );
+		for( size_t v = 0; v < vertexOrder.size(); v++ )
+			vertices[v] = mesh.vertices[vertexOrder[v]];
+		mesh.vertices = SceneArray<glm::vec3>( vertices );
+	}
+
+	mesh.faces = SceneArray<MeshFace>( faces );
+	for( size_t i = 0; i < order.size(); i++ )
+		order[i] = i;
+	bvh.indices = SceneArray<int>( order );
+	bvh.nodes = SceneArray<BVHNode>( nodes );
+	if( !mesh.compact )
+		mesh.store.Build( mesh, bvh );
+	mesh.pages = SceneArray<MeshPage>( pages );
+	mesh.rootPage = SceneArray<int>( rootPage );
+}
+
+class GeometryPager
+{
+public:
+	GeometryPager()
+		: numPages( 0 ), budget( 0 ), residentBytes( 0 ), clock( 0 ), numLoads( 0 ), numEvictions( 0 )
+	{
+	}
+
+	// Pages the meshes of the objects that are laid out in pages and refer
+	// into the mapped scene cache, keeping about budget bytes of them in
+	// memory. Pages are loaded when they are first used.
+	void Attach( std::vector<Object>& objects, size_t budget )
+	{
+		std::lock_guard<std::mutex> lock( mutex );
+		Reset();
+		this->budget = budget;
+
+		std::vector<Mesh*> meshes;
+		for( size_t j = 0; j < objects.size(); j++ )
+		{
+			Mesh* mesh = objects[j].mesh.get();
+			if( !mesh->pages.empty() && mesh->faces.IsReference() &&
+				std::find( meshes.begin(), meshes.end(), mesh ) == meshes.end() )
+			{
+				mesh->firstPage = numPages;
+				numPages += mesh->pages.size();
+				meshes.push_back( mesh );
+			}
+		}
+
+		pages.reset( new Page[numPages] );
+		for( size_t m = 0; m < meshes.size(); m++ )
+		{
+			const Mesh& mesh = *meshes[m];
+			for( size_t p = 0; p < mesh.pages.size(); p++ )
+			{
+				const MeshPage& meshPage = mesh.pages[p];
+				Page& page = pages[mesh.firstPage + p];
+				page.numRanges = 0;
+				page.bytes = 0;
+				AddRange( page, mesh.bvh.nodes, meshPage.firstNode, meshPage.endNode );
+				AddRange( page, mesh.bvh.indices, meshPage.firstTriangle, meshPage.endTriangle );
+				AddRange( page, mesh.faces, meshPage.firstTriangle, meshPage.endTriangle );
+				if( !mesh.store.blocks.empty() )
+				{
+					AddRange( page, mesh.store.blocks, meshPage.firstBlock, meshPage.endBlock );
+					AddRange( page, mesh.store.leafBlock, meshPage.firstNode, meshPage.endNode );
+				}
+				if( mesh.compact )
+					AddRange( page, mesh.quantizedVertices, meshPage.firstVertex, meshPage.endVertex );
+				else
+					AddRange( page, mesh.vertices, meshPage.firstVertex, meshPage.endVertex );
+				page.resident = false;
+				page.lastUse = 0;
+				page.attached = true;
+			}
+		}
+	}
+
+	// Stops paging the mesh, before it is changed, and copies its arrays out
+	// of the cache
+	void Detach( Mesh& mesh )
+	{
+		std::lock_guard<std::mutex> lock( mutex );
+		if( mesh.firstPage < 0 )
+			return;
+
+		for( size_t p = 0; p < mesh.pages.size(); p++ )
+		{
+			Page& page = pages[mesh.firstPage + p];
+			if( page.resident )
+				residentBytes -= page.bytes;
+			page.attached = false;
+		}
+
+		int first = mesh.firstPage;
+		int end = first + mesh.pages.size();
+		residentPages.erase( std::remove_if( residentPages.begin(), residentPages.end(), [&]( int page )
+		{
+			return page >= first && page < end;
+		} ), residentPages.end() );
+		mesh.firstPage = -1;
+		mesh.pages.clear();
+		mesh.rootPage.clear();
+		mesh.Own();
+	}
+
+	// Stops paging any mesh, before the scene they belong to is dropped
+	void Clear()
+	{
+		std::lock_guard<std::mutex> lock( mutex );
+		Reset();
+	}
+
+	bool Resident( int page ) const
+	{
+		return pages[page].resident.load( std::memory_order_relaxed );
+	}
+
+	// Marks a resident page as used now
+	void Use( int page )
+	{
+		uint32_t now = clock.load( std::memory_order_relaxed );
+		if( pages[page].lastUse.load( std::memory_order_relaxed ) != now )
+			pages[page].lastUse.store( now, std::memory_order_relaxed );
+	}
+
+	// Reads the page into memory unless it is resident, and gives back the
+	// least recently used pages while more than the budget is resident.
+	// Returns whether the page had to be read.
+	bool Load( int page )
+	{
+		std::lock_guard<std::mutex> lock( mutex );
+		Page& loaded = pages[page];
+		uint32_t now = ++clock;
+		loaded.lastUse.store( now, std::memory_order_relaxed );
+		if( loaded.resident || !loaded.attached )
+			return false;
+
+		for( int r = 0; r < loaded.numRanges; r++ )
+		{
+			madvise( PageStart( loaded.ranges[r].data ), PageEnd( loaded.ranges[r].data + loaded.ranges[r].size ) -
+				PageStart( loaded.ranges[r].data ), MADV_WILLNEED );
+			volatile char sum = 0;
+			for( size_t offset = 0; offset < loaded.ranges[r].size; offset += OS_PAGE_SIZE )
+				sum += loaded.ranges[r].data[offset];
+		}
+		loaded.resident = true;
+		residentBytes += loaded.bytes;
+		residentPages.push_back( page );
+		numLoads++;
+
+		while( residentBytes > budget && residentPages.size() > 1 )
+		{
+			size_t oldest = 0;
+			for( size_t k = 1; k < residentPages.size(); k++ )
+			{
+				if( pages[residentPages[k]].lastUse.load( std::memory_order_relaxed ) <
+					pages[residentPages[oldest]].lastUse.load( std::memory_order_relaxed ) )
+					oldest = k;
+			}
+			Evict( residentPages[oldest] );
+			residentPages[oldest] = residentPages.back();
+			residentPages.pop_back();
+		}
+		return true;
+	}
+
+	// Gives back the memory of the pages that are not resident. Threads that
+	// were still reading a page when it was given back read it in again, which
+	// stays in memory without being counted until it is given back here. The
+	// pages follow each other in the arrays of their mesh, so the memory of
+	// consecutive pages is given back together.
+	void Trim()
+	{
+		std::lock_guard<std::mutex> lock( mutex );
+		Range pending[MAX_RANGES];
+		int numPending = 0;
+		for( int p = 0; p <= numPages; p++ )
+		{
+			const Page* page = p < numPages && pages[p].attached && !pages[p].resident ? &pages[p] : 0;
+			bool extends = page && page->numRanges == numPending;
+			for( int r = 0; extends && r < numPending; r++ )
+				extends = pending[r].data + pending[r].size == page->ranges[r].data;
+
+			if( !extends )
+			{
+				for( int r = 0; r < numPending; r++ )
+					GiveBack( pending[r] );
+				numPending = 0;
+				if( !page )
+					continue;
+				numPending = page->numRanges;
+				for( int r = 0; r < numPending; r++ )
+					pending[r] = page->ranges[r];
+			}
+			else
+			{
+				for( int r = 0; r < numPending; r++ )
+					pending[r].size += page->ranges[r].size;
+			}
+		}
+	}
+
+	int NumPages() const
+	{
+		return numPages;
+	}
+
+	size_t ResidentBytes() const
+	{
+		return residentBytes;
+	}
+
+	long NumLoads() const
+	{
+		return numLoads;
+	}
+
+	long NumEvictions() const
+	{
+		return numEvictions;
+	}
+
+private:
+	static const size_t OS_PAGE_SIZE = 4096;
+	static const int MAX_RANGES = 6;
+
+	// Part of a page in one of the arrays of its mesh
+	struct Range
+	{
+		char* data;
+		size_t size;
+	};
+
+	struct Page
+	{
+		Range ranges[MAX_RANGES];
+		int numRanges;
+		size_t bytes;
+		std::atomic<bool> resident;
+		std::atomic<uint32_t> lastUse;
+
+		// Whether the mesh of the page is still paged, see Detach
+		bool attached;
+	};
+
+	std::unique_ptr<Page[]> pages;
+	int numPages;
+	size_t budget;
+	size_t residentBytes;
+	std::atomic<uint32_t> clock;
+	long numLoads;
+	long numEvictions;
+
+	// The pages that are resident, in no particular order
+	std::vector<int> residentPages;
+	std::mutex mutex;
+
+	template<class T>
+	void AddRange( Page& page, const SceneArray<T>& array, int first, int end )
+	{
+		if( end <= first )
+			return;
+		Range& range = page.ranges[page.numRanges++];
+		range.data = (char*) &array[first];
+		range.size = (end - first) * sizeof(T);
+		page.bytes += range.size;
+	}
+
+	static char* PageStart( char* p )
+	{
+		return (char*) ((uintptr_t) p & ~(OS_PAGE_SIZE - 1));
+	}
+
+	static char* PageEnd( char* p )
+	{
+		return PageStart( p + OS_PAGE_SIZE - 1 );
+	}
+
+	// Gives the memory of a page back, together with the memory pages it
+	// shares with the arrays around it, which are read again when they are
+	// used. Giving back only the memory pages within the page is not enough,
+	// as the operating system maps a memory page together with its neighbours
+	// when one of them is read.
+	void Evict( int page )
+	{
+		Page& evicted = pages[page];
+		for( int r = 0; r < evicted.numRanges; r++ )
+			GiveBack( evicted.ranges[r] );
+		evicted.resident = false;
+		residentBytes -= evicted.bytes;
+		numEvictions++;
+	}
+
+	// Gives back the memory pages a range lies in, see Evict
+	static void GiveBack( const Range& range )
+	{
+		char* start = PageStart( range.data );
+		char* end = PageEnd( range.data + range.size );
+		madvise( start, end - start, MADV_DONTNEED );
+	}
+
+	void Reset()
+	{
+		pages.reset();
+		numPages = 0;
+		residentBytes = 0;
+		residentPages.clear();
+		numLoads = 0;
+		numEvictions = 0;
+	}
+};
+
+#endif
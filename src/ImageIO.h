@@ -0,0 +1,250 @@
+#ifndef IMAGE_IO_H
+#define IMAGE_IO_H
+
+// Writing of rendered images, given as linear RGB floats in row major order,
+// to PPM, PNG and OpenEXR files. No libraries are needed: the PNG files use
+// uncompressed deflate blocks and the EXR files uncompressed scanlines.
+
+#include <glm/glm.hpp>
+#include <vector>
+#include <string>
+#include <cstdio>
+#include <cstring>
+#include <algorithm>
+#include <stdint.h>
+#include "ToneMap.h"
+
+// Tone maps one row of pixels to 8 bit channels, 3 bytes per pixel
+void RowToBytes( const glm::vec3* pixels, int width, const ToneMapping& mapping, std::vector<uint32_t>& packed,
+	unsigned char* rgb )
+{
+	packed.resize( width );
+	ToneMapRow( pixels, width, &packed[0], mapping, RGB_FORMAT );
+	for( int x = 0; x < width; x++ )
+	{
+		rgb[3 * x] = packed[x] & 0xFF;
+		rgb[3 * x + 1] = (packed[x] >> 8) & 0xFF;
+		rgb[3 * x + 2] = (packed[x] >> 16) & 0xFF;
+	}
+}
+
+bool WritePPM( const char* filename, int width, int height, const glm::vec3* pixels, const ToneMapping& mapping )
+{
+	FILE* file = fopen( filename, "wb" );
+	if( !file )
+		return false;
+
+	fprintf( file, "P6\n%d %d\n255\n", width, height );
+	std::vector<unsigned char> row( 3 * width );
+	std::vector<uint32_t> packed;
+	for( int y = 0; y < height; y++ )
+	{
+		RowToBytes( pixels + y * width, width, mapping, packed, &row[0] );
+		fwrite( &row[0], 1, row.size(), file );
+	}
+	return fclose( file ) == 0;
+}
+
+uint32_t Crc32( const unsigned char* data, size_t size, uint32_t crc = 0 )
+{
+	static uint32_t table[256];
+	static bool tableReady = false;
+	if( !tableReady )
+	{
+		for( uint32_t i = 0; i < 256; i++ )
+		{
+			uint32_t c = i;
+			for( int k = 0; k < 8; k++ )
+				c = c & 1 ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+			table[i] = c;
+		}
+		tableReady = true;
+	}
+
+	crc = ~crc;
+	for( size_t i = 0; i < size; i++ )
+		crc = table[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+	return ~crc;
+}
+
+void PutBigEndian32( std::vector<unsigned char>& out, uint32_t value )
+{
+	out.push_back( value >> 24 );
+	out.push_back( value >> 16 );
+	out.push_back( value >> 8 );
+	out.push_back( value );
+}
+
+// Appends a PNG chunk (length, type, data and CRC) to out
+void PutPNGChunk( std::vector<unsigned char>& out, const char* type, const std::vector<unsigned char>& data )
+{
+	PutBigEndian32( out, data.size() );
+	size_t start = out.size();
+	out.insert( out.end(), type, type + 4 );
+	out.insert( out.end(), data.begin(), data.end() );
+	PutBigEndian32( out, Crc32( &out[start], out.size() - start ) );
+}
+
+bool WritePNG( const char* filename, int width, int height, const glm::vec3* pixels, const ToneMapping& mapping )
+{
+	//raw image data, every row starts with filter type 0 (none)
+	std::vector<unsigned char> raw( (3 * width + 1) * height );
+	std::vector<uint32_t> packed;
+	for( int y = 0; y < height; y++ )
+	{
+		unsigned char* row = &raw[(3 * width + 1) * y];
+		row[0] = 0;
+		RowToBytes( pixels + y * width, width, mapping, packed, row + 1 );
+	}
+
+	//zlib stream made of stored (uncompressed) deflate blocks
+	std::vector<unsigned char> zlib;
+	zlib.push_back( 0x78 );
+	zlib.push_back( 0x01 );
+	size_t offset = 0;
+	do
+	{
+		size_t length = std::min( raw.size() - offset, (size_t) 65535 );
+		bool last = offset + length == raw.size();
+		zlib.push_back( last ? 1 : 0 );
+		zlib.push_back( length & 0xFF );
+		zlib.push_back( length >> 8 );
+		zlib.push_back( ~length & 0xFF );
+		zlib.push_back( (~length >> 8) & 0xFF );
+		zlib.insert( zlib.end(), raw.begin() + offset, raw.begin() + offset + length );
+		offset += length;
+	}
+	while( offset < raw.size() );
+
+	uint32_t a = 1, b = 0;
+	for( size_t i = 0; i < raw.size(); i++ )
+	{
+		a = (a + raw[i]) % 65521;
+		b = (b + a) % 65521;
+	}
+	PutBigEndian32( zlib, (b << 16) | a );
+
+	std::vector<unsigned char> header;
+	PutBigEndian32( header, width );
+	PutBigEndian32( header, height );
+	header.push_back( 8 );	//bit depth
+	header.push_back( 2 );	//color type RGB
+	header.push_back( 0 );	//compression
+	header.push_back( 0 );	//filter
+	header.push_back( 0 );	//interlace
+
+	const unsigned char signature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n' };
+	std::vector<unsigned char> png( signature, signature + 8 );
+	PutPNGChunk( png, "IHDR", header );
+	PutPNGChunk( png, "IDAT", zlib );
+	PutPNGChunk( png, "IEND", std::vector<unsigned char>() );
+
+	FILE* file = fopen( filename, "wb" );
+	if( !file )
+		return false;
+	fwrite( &png[0], 1, png.size(), file );
+	return fclose( file ) == 0;
+}
+
+// Appends little endian data of any type to out
+template<class T>
+void PutLittleEndian( std::vector<unsigned char>& out, T value )
+{
+	for( size_t i = 0; i < sizeof(T); i++ )
+	{
+		uint64_t bits = 0;
+		memcpy( &bits, &value, sizeof(T) );
+		out.push_back( (bits >> (8 * i)) & 0xFF );
+	}
+}
+
+// Appends an attribute of the EXR header: name, type, size and value
+void PutEXRAttribute( std::vector<unsigned char>& out, const char* name, const char* type, const std::vector<unsigned char>& value )
+{
+	out.insert( out.end(), name, name + strlen(name) + 1 );
+	out.insert( out.end(), type, type + strlen(type) + 1 );
+	PutLittleEndian<int32_t>( out, value.size() );
+	out.insert( out.end(), value.begin(), value.end() );
+}
+
+// Writes the image as 32 bit float RGB, keeping its full dynamic range
+bool WriteEXR( const char* filename, int width, int height, const glm::vec3* pixels )
+{
+	std::vector<unsigned char> exr;
+	PutLittleEndian<uint32_t>( exr, 20000630 );	//magic number
+	PutLittleEndian<uint32_t>( exr, 2 );		//version 2, scanline image
+
+	//channels have to be listed in alphabetical order
+	std::vector<unsigned char> channels;
+	const char* names[3] = { "B", "G", "R" };
+	for( int c = 0; c < 3; c++ )
+	{
+		channels.push_back( names[c][0] );
+		channels.push_back( 0 );
+		PutLittleEndian<int32_t>( channels, 2 );	//FLOAT
+		PutLittleEndian<int32_t>( channels, 0 );	//pLinear and reserved
+		PutLittleEndian<int32_t>( channels, 1 );	//x sampling
+		PutLittleEndian<int32_t>( channels, 1 );	//y sampling
+	}
+	channels.push_back( 0 );
+
+	std::vector<unsigned char> window;
+	PutLittleEndian<int32_t>( window, 0 );
+	PutLittleEndian<int32_t>( window, 0 );
+	PutLittleEndian<int32_t>( window, width - 1 );
+	PutLittleEndian<int32_t>( window, height - 1 );
+
+	std::vector<unsigned char> one, center;
+	PutLittleEndian<float>( one, 1.0f );
+	PutLittleEndian<float>( center, 0.0f );
+	PutLittleEndian<float>( center, 0.0f );
+
+	PutEXRAttribute( exr, "channels", "chlist", channels );
+	PutEXRAttribute( exr, "compression", "compression", std::vector<unsigned char>( 1, 0 ) );
+	PutEXRAttribute( exr, "dataWindow", "box2i", window );
+	PutEXRAttribute( exr, "displayWindow", "box2i", window );
+	PutEXRAttribute( exr, "lineOrder", "lineOrder", std::vector<unsigned char>( 1, 0 ) );
+	PutEXRAttribute( exr, "pixelAspectRatio", "float", one );
+	PutEXRAttribute( exr, "screenWindowCenter", "v2f", center );
+	PutEXRAttribute( exr, "screenWindowWidth", "float", one );
+	exr.push_back( 0 );
+
+	//table with the offset of every scanline, followed by the scanlines
+	uint64_t lineSize = 8 + 3 * 4 * (uint64_t) width;
+	uint64_t firstLine = exr.size() + 8 * (uint64_t) height;
+	for( int y = 0; y < height; y++ )
+		PutLittleEndian<uint64_t>( exr, firstLine + y * lineSize );
+
+	for( int y = 0; y < height; y++ )
+	{
+		PutLittleEndian<int32_t>( exr, y );
+		PutLittleEndian<int32_t>( exr, 3 * 4 * width );
+		for( int c = 2; c >= 0; c-- )
+			for( int x = 0; x < width; x++ )
+				PutLittleEndian<float>( exr, pixels[y * width + x][c] );
+	}
+
+	FILE* file = fopen( filename, "wb" );
+	if( !file )
+		return false;
+	fwrite( &exr[0], 1, exr.size(), file );
+	return fclose( file ) == 0;
+}
+
+// Writes the image in the format given by the extension of the filename,
+// .ppm, .png or .exr. The 8 bit formats are tone mapped with mapping, EXR
+// files keep the linear radiance.
+bool WriteImage( const std::string& filename, int width, int height, const glm::vec3* pixels,
+	const ToneMapping& mapping = ToneMapping() )
+{
+	std::string extension = filename.substr( filename.find_last_of( '.' ) + 1 );
+	if( extension == "ppm" )
+		return WritePPM( filename.c_str(), width, height, pixels, mapping );
+	if( extension == "png" )
+		return WritePNG( filename.c_str(), width, height, pixels, mapping );
+	if( extension == "exr" )
+		return WriteEXR( filename.c_str(), width, height, pixels );
+	return false;
+}
+
+#endif
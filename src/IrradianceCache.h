@@ -0,0 +1,324 @@
+#ifndef IRRADIANCE_CACHE_H
+#define IRRADIANCE_CACHE_H
+
+// Irradiance caching, which computes the diffuse indirect light at a sparse
+// set of points and interpolates it everywhere else (Ward, Rubinstein and
+// Clear 1988). A record holds the indirect light arriving at a point,
+// estimated from rays over the hemisphere above it, together with its
+// gradients over rotation and translation (Ward and Heckbert 1992) and the
+// harmonic mean distance of the surfaces the rays hit. That distance tells
+// how quickly the light can change around the point: a record in the middle
+// of a wall is valid far around it, one in a corner only close to it.
+//
+// A point takes the indirect light of every record whose weight
+//
+//   w = 1 / (|P - Pi| / Ri + sqrt(1 - N . Ni))
+//
+// is above 1 / error, extrapolated from the record to the point by the
+// gradients and averaged by weight. Points that no record covers need a new
+// record of their own. The records are kept in an octree over the scene, each
+// in the nodes about the size of the sphere it is valid in, so that a lookup
+// only looks at the nodes on the path from the root to the point.
+//
+// The light is kept as the average incoming radiance over the hemisphere,
+// weighted by the cosine, which is the irradiance divided by pi. That is the
+// quantity the renderer multiplies the colour of a surface by.
+
+#include <glm/glm.hpp>
+#include <vector>
+#include <algorithm>
+#include <cmath>
+#include <stdint.h>
+#include <cstring>
+
+// Strata of the hemisphere sampled for a record, by angle from the normal
+// and around it. About pi times as many around it as from the normal give
+// strata of similar shape
+const int HEMISPHERE_ROWS = 12;
+const int HEMISPHERE_COLUMNS = 38;
+
+struct IrradianceRecord
+{
+	glm::vec3 position;
+	glm::vec3 normal;
+	glm::vec3 irradiance;
+
+	// Harmonic mean distance of the surfaces seen from the record, clamped
+	float radius;
+
+	// Gradients of the red, green and blue irradiance, in the columns, over
+	// rotation of the normal and over translation of the position
+	glm::mat3 rotationalGradient;
+	glm::mat3 translationalGradient;
+};
+
+// Adds the irradiance record extrapolates to the point with the given normal
+// to sum, times its weight, and the weight to weightSum, if the weight is
+// above 1 / error. Records in front of the point are left out, as something
+// may lie between them
+inline void GatherIrradianceRecord( const IrradianceRecord& record, glm::vec3 position, glm::vec3 normal, float error,
+	glm::vec3& sum, float& weightSum )
+{
+	glm::vec3 offset = position - record.position;
+	float distance = glm::length( offset );
+	if( distance >= error * record.radius )
+		return;
+	if( glm::dot( offset, normal + record.normal ) < -0.02f * record.radius )
+		return;
+
+	float weight = 1 / ( distance / record.radius + sqrtf( std::max( 1 - glm::dot( normal, record.normal ), 0.0f ) ) + 1e-6f );
+	if( weight <= 1 / error )
+		return;
+
+	glm::vec3 irradiance = record.irradiance + glm::cross( record.normal, normal ) * record.rotationalGradient +
+		offset * record.translationalGradient;
+	sum += weight * glm::max( irradiance, glm::vec3( 0 ) );
+	weightSum += weight;
+}
+
+// Scrambles an integer into 32 random looking bits
+inline uint32_t HashBits( uint32_t x )
+{
+	x ^= x >> 16;
+	x *= 0x7feb352du;
+	x ^= x >> 15;
+	x *= 0x846ca68bu;
+	x ^= x >> 16;
+	return x;
+}
+
+// Computes the irradiance record of a point. radiance( dir, distance ) gives
+// the radiance arriving at the point from the unit direction dir and puts the
+// distance of the surface it comes from in distance, the largest float if
+// there is none. The radius of the record is clamped to minRadius and
+// maxRadius
+template<class RadianceFunction>
+IrradianceRecord ComputeIrradianceRecord( glm::vec3 position, glm::vec3 normal, float minRadius, float maxRadius,
+	RadianceFunction radiance )
+{
+	const int M = HEMISPHERE_ROWS;
+	const int N = HEMISPHERE_COLUMNS;
+	const float PI = 3.14159265f;
+
+	//orthonormal frame around the normal
+	glm::vec3 tangent = fabsf( normal.x ) > 0.5f ? glm::vec3( 0, 1, 0 ) : glm::vec3( 1, 0, 0 );
+	tangent = glm::normalize( glm::cross( tangent, normal ) );
+	glm::vec3 bitangent = glm::cross( normal, tangent );
+
+	//the strata are jittered the same way for the same point, whichever thread computes it
+	uint32_t bits[3];
+	memcpy( bits, &position, sizeof( bits ) );
+	uint32_t seed = HashBits( bits[0] ^ HashBits( bits[1] ^ HashBits( bits[2] ) ) );
+
+	//stratified over the projected solid angle, so that every sample counts the same. Row j
+	//lies between the angles asin(sqrt(j / M)) and asin(sqrt((j + 1) / M)) from the normal
+	glm::vec3 L[M][N];
+	float R[M][N];
+	glm::vec3 mean( 0 );
+	float inverseDistances = 0;
+
+	IrradianceRecord record;
+	record.position = position;
+	record.normal = normal;
+	record.rotationalGradient = glm::mat3( 0 );
+	record.translationalGradient = glm::mat3( 0 );
+
+	for( int j = 0; j < M; j++ )
+	{
+		for( int k = 0; k < N; k++ )
+		{
+			uint32_t h = HashBits( seed + j * N + k );
+			float s2 = ( j + ( h & 0xffff ) / 65536.0f ) / M;
+			float sinTheta = sqrtf( s2 );
+			float cosTheta = sqrtf( 1 - s2 );
+			float phi = 2 * PI * ( k + ( h >> 16 ) / 65536.0f ) / N;
+			glm::vec3 dir = ( cosf( phi ) * tangent + sinf( phi ) * bitangent ) * sinTheta + cosTheta * normal;
+			L[j][k] = radiance( dir, R[j][k] );
+			mean += L[j][k];
+			inverseDistances += 1 / R[j][k];
+
+			//turning the normal towards phi + pi / 2 turns it away from dir
+			glm::vec3 v = -sinf( phi ) * tangent + cosf( phi ) * bitangent;
+			float tanTheta = sinTheta / std::max( cosTheta, 1e-3f );
+			for( int c = 0; c < 3; c++ )
+				record.rotationalGradient[c] -= tanTheta * L[j][k][c] * v;
+		}
+	}
+	record.irradiance = mean / (float) ( M * N );
+	record.rotationalGradient /= (float) ( M * N );
+
+	//the changes of the light between neighbouring strata, over the walls between them
+	for( int k = 0; k < N; k++ )
+	{
+		float phi = 2 * PI * ( k + 0.5f ) / N;
+		float phiWall = 2 * PI * k / N;
+		glm::vec3 u = cosf( phi ) * tangent + sinf( phi ) * bitangent;
+		glm::vec3 v = -sinf( phiWall ) * tangent + cosf( phiWall ) * bitangent;
+		int previous = ( k + N - 1 ) % N;
+
+		for( int j = 0; j < M; j++ )
+		{
+			if( j > 0 )
+			{
+				float s2 = (float) j / M;
+				float wall = 2 * PI / N * sqrtf( s2 ) * ( 1 - s2 ) / std::min( R[j - 1][k], R[j][k] );
+				glm::vec3 difference = L[j][k] - L[j - 1][k];
+				for( int c = 0; c < 3; c++ )
+					record.translationalGradient[c] += wall * difference[c] * u;
+			}
+
+			float wall = ( sqrtf( 1 - (float) j / M ) - sqrtf( 1 - (float) ( j + 1 ) / M ) ) /
+				( sqrtf( ( j + 0.5f ) / M ) * std::min( R[j][k], R[j][previous] ) );
+			glm::vec3 difference = L[j][k] - L[j][previous];
+			for( int c = 0; c < 3; c++ )
+				record.translationalGradient[c] += wall * difference[c] * v;
+		}
+	}
+	record.translationalGradient /= PI;
+
+	//the light cannot change by more than all of it within the radius
+	float radius = inverseDistances > 0 ? M * N / inverseDistances : maxRadius;
+	for( int c = 0; c < 3; c++ )
+	{
+		float change = glm::length( record.translationalGradient[c] );
+		if( change * radius > record.irradiance[c] )
+			radius = record.irradiance[c] / change;
+	}
+	record.radius = glm::clamp( radius, minRadius, maxRadius );
+
+	//a record whose radius was raised to minRadius extrapolates less steeply over it
+	float limit = record.radius / std::max( radius, 1e-12f );
+	if( limit > 1 )
+		record.translationalGradient /= limit;
+	return record;
+}
+
+class IrradianceCache
+{
+public:
+	IrradianceCache()
+		: error( 0 )
+	{
+	}
+
+	// Drops all records and keeps the new ones in an octree over the box
+	// from low to high, valid within error (see GatherIrradianceRecord)
+	void Reset( glm::vec3 low, glm::vec3 high, float error )
+	{
+		records.clear();
+		nodes.assign( 1, Node() );
+		this->low = low;
+		this->high = high;
+		this->error = error;
+	}
+
+	void Add( const IrradianceRecord& record )
+	{
+		int index = records.size();
+		records.push_back( record );
+		float reach = error * record.radius;
+		Insert( 0, low, high, 0, index, record.position - glm::vec3( reach ), record.position + glm::vec3( reach ) );
+	}
+
+	// Adds the records that cover the point with the given normal to sum and
+	// weightSum, see GatherIrradianceRecord
+	void Gather( glm::vec3 position, glm::vec3 normal, glm::vec3& sum, float& weightSum ) const
+	{
+		if( nodes.empty() )
+			return;
+
+		int node = 0;
+		glm::vec3 nodeLow = low;
+		glm::vec3 nodeHigh = high;
+		while( true )
+		{
+			const std::vector<int>& indices = nodes[node].records;
+			for( size_t i = 0; i < indices.size(); i++ )
+				GatherIrradianceRecord( records[indices[i]], position, normal, error, sum, weightSum );
+
+			if( nodes[node].firstChild < 0 || glm::any( glm::lessThan( position, nodeLow ) ) ||
+				glm::any( glm::greaterThan( position, nodeHigh ) ) )
+				return;
+
+			glm::vec3 centre = 0.5f * ( nodeLow + nodeHigh );
+			int child = 0;
+			for( int a = 0; a < 3; a++ )
+			{
+				if( position[a] > centre[a] )
+				{
+					child |= 1 << a;
+					nodeLow[a] = centre[a];
+				}
+				else
+					nodeHigh[a] = centre[a];
+			}
+			node = nodes[node].firstChild + child;
+		}
+	}
+
+	size_t NumRecords() const
+	{
+		return records.size();
+	}
+
+private:
+	// Below this depth records are kept in the nodes they reach
+	static const int MAX_DEPTH = 16;
+
+	// A node has either no children or eight, which are stored together
+	struct Node
+	{
+		int firstChild;
+		std::vector<int> records;
+
+		Node()
+			: firstChild( -1 )
+		{
+		}
+	};
+
+	std::vector<IrradianceRecord> records;
+	std::vector<Node> nodes;
+	glm::vec3 low;
+	glm::vec3 high;
+	float error;
+
+	// Puts record index into the nodes below node, which spans nodeLow to
+	// nodeHigh, that overlap the box from recordLow to recordHigh, as deep as
+	// the children are still larger than the box
+	void Insert( int node, glm::vec3 nodeLow, glm::vec3 nodeHigh, int depth, int index, glm::vec3 recordLow, glm::vec3 recordHigh )
+	{
+		glm::vec3 childSize = 0.5f * ( nodeHigh - nodeLow );
+		glm::vec3 recordSize = recordHigh - recordLow;
+		if( depth == MAX_DEPTH || glm::any( glm::lessThan( childSize, recordSize ) ) )
+		{
+			nodes[node].records.push_back( index );
+			return;
+		}
+
+		if( nodes[node].firstChild < 0 )
+		{
+			nodes[node].firstChild = nodes.size();
+			nodes.resize( nodes.size() + 8 );
+		}
+
+		glm::vec3 centre = nodeLow + childSize;
+		for( int child = 0; child < 8; child++ )
+		{
+			glm::vec3 childLow = nodeLow;
+			glm::vec3 childHigh = centre;
+			for( int a = 0; a < 3; a++ )
+			{
+				if( child & ( 1 << a ) )
+				{
+					childLow[a] = centre[a];
+					childHigh[a] = nodeHigh[a];
+				}
+			}
+			if( glm::all( glm::lessThanEqual( childLow, recordHigh ) ) && glm::all( glm::lessThanEqual( recordLow, childHigh ) ) )
+				Insert( nodes[node].firstChild + child, childLow, childHigh, depth + 1, index, recordLow, recordHigh );
+		}
+	}
+};
+
+#endif
@@ -0,0 +1,369 @@
+#ifndef LBVH_H
+#define LBVH_H
+
+// Linear bounding volume hierarchy (LBVH) builder, for geometry that changes
+// every frame. The primitives are sorted along a Morton curve through the
+// centres of their boxes, and every node is split where the highest bit of
+// the Morton codes of its primitives changes, which is a plane of a regular
+// grid over the scene. The trees are not as good as those of the SAH builder
+// (BVH::Build), but they are built many times faster and in parallel:
+//
+// - the Morton codes are computed and sorted with a radix sort by all threads,
+// - the top levels of the tree are split until there is a subtree for every
+//   task,
+// - the subtrees are built in parallel, each into nodes of its own, which are
+//   then put one after the other behind the top levels.
+//
+// The result has the layout of BVH::Build, the two children of a node being
+// next to each other and after their parent, so it is traversed, refitted
+// and cached like any other hierarchy. The builder keeps its memory between
+// builds, so building a hierarchy of the same size again allocates nothing.
+
+#include <glm/glm.hpp>
+#include <vector>
+#include <algorithm>
+#include <cmath>
+#include <stdint.h>
+#include "BVH.h"
+#include "ThreadPool.h"
+
+class LBVHBuilder
+{
+public:
+	// Builds bvh over count primitives. box(i, Pmin, Pmax) puts the bounding
+	// box of primitive i in Pmin and Pmax, and is called from all threads.
+	template<class PrimitiveBox>
+	void Build( BVH& bvh, int count, const PrimitiveBox& box, ThreadPool& pool )
+	{
+		bvh.nodes.clear();
+		bvh.indices.resize( count );
+		if( count == 0 )
+			return;
+
+		numChunks = std::min( 4 * pool.NumThreads(), count );
+		ComputeCodes( count, box, pool );
+		SortCodes( count, pool );
+		pool.ParallelFor( numChunks, [&]( int chunk, int thread )
+		{
+			for( int i = ChunkBegin( chunk, count ); i < ChunkBegin( chunk + 1, count ); i++ )
+				bvh.indices[i] = values[i];
+		} );
+
+		BuildTop( count, pool );
+		pool.ParallelFor( subtrees.size(), [&]( int t, int thread )
+		{
+			BuildSubtree( t, bvh, box );
+		} );
+		JoinSubtrees( bvh, pool );
+	}
+
+private:
+	static const int RADIX_BITS = 10;
+	static const int RADIX_SIZE = 1 << RADIX_BITS;
+
+	// Morton codes of the primitives and the indices of the primitives, sorted
+	// by code once SortCodes is done
+	std::vector<uint32_t> codes;
+	std::vector<int> values;
+	std::vector<uint32_t> codesTemp;
+	std::vector<int> valuesTemp;
+	std::vector<glm::vec3> centroids;
+
+	// Number of parts the primitives are split into for the parallel passes,
+	// and the centroid bounds and digit counts of every part
+	int numChunks;
+	std::vector<glm::vec3> chunkMin;
+	std::vector<glm::vec3> chunkMax;
+	std::vector<int> chunkCount;
+
+	// Nodes above the subtrees, the nodes of the tree the subtrees are built
+	// from, and the nodes below them of every subtree. nextSubtrees holds the
+	// subtrees of the next level while the top levels are split
+	std::vector<BVHNode> top;
+	std::vector<int> subtrees;
+	std::vector<int> nextSubtrees;
+	std::vector< std::vector<BVHNode> > subtreeNodes;
+	std::vector<int> subtreeOffset;
+
+	int ChunkBegin( int chunk, int count ) const
+	{
+		return (long) count * chunk / numChunks;
+	}
+
+	// Spreads the lowest 10 bits of x out to every third bit
+	static uint32_t SpreadBits( uint32_t x )
+	{
+		x &= 0x3FF;
+		x = (x | x << 16) & 0x030000FF;
+		x = (x | x << 8) & 0x0300F00F;
+		x = (x | x << 4) & 0x030C30C3;
+		x = (x | x << 2) & 0x09249249;
+		return x;
+	}
+
+	template<class PrimitiveBox>
+	void ComputeCodes( int count, const PrimitiveBox& box, ThreadPool& pool )
+	{
+		codes.resize( count );
+		values.resize( count );
+		codesTemp.resize( count );
+		valuesTemp.resize( count );
+		centroids.resize( count );
+		chunkMin.resize( numChunks );
+		chunkMax.resize( numChunks );
+
+		//bounds of the centroids, the codes use a grid of 1024^3 cells over them
+		pool.ParallelFor( numChunks, [&]( int chunk, int thread )
+		{
+			glm::vec3 cmin( INFINITY ), cmax( -INFINITY );
+			for( int i = ChunkBegin( chunk, count ); i < ChunkBegin( chunk + 1, count ); i++ )
+			{
+				glm::vec3 Pmin, Pmax;
+				box( i, Pmin, Pmax );
+				centroids[i] = 0.5f * (Pmin + Pmax);
+				cmin = glm::min( cmin, centroids[i] );
+				cmax = glm::max( cmax, centroids[i] );
+			}
+			chunkMin[chunk] = cmin;
+			chunkMax[chunk] = cmax;
+		} );
+
+		glm::vec3 cmin = chunkMin[0], cmax = chunkMax[0];
+		for( int chunk = 1; chunk < numChunks; chunk++ )
+		{
+			cmin = glm::min( cmin, chunkMin[chunk] );
+			cmax = glm::max( cmax, chunkMax[chunk] );
+		}
+		glm::vec3 scale = 1023.0f / glm::max( cmax - cmin, glm::vec3( 1e-20f ) );
+
+		pool.ParallelFor( numChunks, [&]( int chunk, int thread )
+		{
+			for( int i = ChunkBegin( chunk, count ); i < ChunkBegin( chunk + 1, count ); i++ )
+			{
+				glm::vec3 cell = (centroids[i] - cmin) * scale;
+				codes[i] = SpreadBits( (uint32_t) cell.x ) << 2 | SpreadBits( (uint32_t) cell.y ) << 1 | SpreadBits( (uint32_t) cell.z );
+				values[i] = i;
+			}
+		} );
+	}
+
+	// Radix sort of the 30 bit codes and their primitives, by digits of
+	// RADIX_BITS. Every part of the primitives counts its digits, from which
+	// every part knows where its primitives go, and then moves them there.
+	// Digits that are the same in all codes are skipped.
+	void SortCodes( int count, ThreadPool& pool )
+	{
+		chunkCount.resize( numChunks * RADIX_SIZE );
+		for( int shift = 0; shift < 30; shift += RADIX_BITS )
+		{
+			pool.ParallelFor( numChunks, [&]( int chunk, int thread )
+			{
+				int* digits = &chunkCount[chunk * RADIX_SIZE];
+				std::fill( digits, digits + RADIX_SIZE, 0 );
+				for( int i = ChunkBegin( chunk, count ); i < ChunkBegin( chunk + 1, count ); i++ )
+					digits[(codes[i] >> shift) & (RADIX_SIZE - 1)]++;
+			} );
+
+			//the place of every digit of every part, the parts of a digit one after the other
+			int position = 0;
+			bool same = false;
+			for( int digit = 0; digit < RADIX_SIZE; digit++ )
+			{
+				int start = position;
+				for( int chunk = 0; chunk < numChunks; chunk++ )
+				{
+					int n = chunkCount[chunk * RADIX_SIZE + digit];
+					chunkCount[chunk * RADIX_SIZE + digit] = position;
+					position += n;
+				}
+				same = same || position - start == count;
+			}
+			if( same )
+				continue;
+
+			pool.ParallelFor( numChunks, [&]( int chunk, int thread )
+			{
+				int* digits = &chunkCount[chunk * RADIX_SIZE];
+				for( int i = ChunkBegin( chunk, count ); i < ChunkBegin( chunk + 1, count ); i++ )
+				{
+					int place = digits[(codes[i] >> shift) & (RADIX_SIZE - 1)]++;
+					codesTemp[place] = codes[i];
+					valuesTemp[place] = values[i];
+				}
+			} );
+			codes.swap( codesTemp );
+			values.swap( valuesTemp );
+		}
+	}
+
+	// Index of the first primitive of the right child of the primitives
+	// [first, first + count), or -1 if they make a leaf
+	int Split( int first, int count ) const
+	{
+		if( count <= BVH_MAX_LEAF_SIZE )
+			return -1;
+
+		uint32_t a = codes[first];
+		uint32_t b = codes[first + count - 1];
+		if( a == b )
+			return first + count / 2;
+
+		//the right child starts at the first code with the highest differing bit set
+		int bit = 31 - __builtin_clz( a ^ b );
+		uint32_t split = b >> bit << bit;
+		return std::lower_bound( codes.begin() + first, codes.begin() + first + count, split ) - codes.begin();
+	}
+
+	// Splits the top of the tree breadth first until there is a subtree for
+	// every task or nothing is left to split
+	void BuildTop( int count, ThreadPool& pool )
+	{
+		top.clear();
+		BVHNode root;
+		root.first = 0;
+		root.count = count;
+		top.push_back( root );
+		subtrees.assign( 1, 0 );
+
+		while( (int) subtrees.size() < 4 * pool.NumThreads() )
+		{
+			nextSubtrees.clear();
+			for( size_t s = 0; s < subtrees.size(); s++ )
+			{
+				BVHNode node = top[subtrees[s]];
+				int mid = Split( node.first, node.count );
+				if( mid < 0 )
+				{
+					nextSubtrees.push_back( subtrees[s] );
+					continue;
+				}
+
+				BVHNode left, right;
+				left.first = node.first;
+				left.count = mid - node.first;
+				right.first = mid;
+				right.count = node.first + node.count - mid;
+
+				int childIndex = top.size();
+				top.push_back( left );
+				top.push_back( right );
+				top[subtrees[s]].first = childIndex;
+				top[subtrees[s]].count = 0;
+				nextSubtrees.push_back( childIndex );
+				nextSubtrees.push_back( childIndex + 1 );
+			}
+			if( nextSubtrees.size() == subtrees.size() )
+				break;
+			subtrees.swap( nextSubtrees );
+		}
+		subtreeNodes.resize( subtrees.size() );
+	}
+
+	// Builds the nodes below the root of subtree t, with indices relative to
+	// the first of them, and computes the bounds of the subtree
+	template<class PrimitiveBox>
+	void BuildSubtree( int t, const BVH& bvh, const PrimitiveBox& box )
+	{
+		std::vector<BVHNode>& nodes = subtreeNodes[t];
+		nodes.clear();
+		BVHNode& root = top[subtrees[t]];
+
+		//the root is built as node -1 of the subtree and copied back at the end
+		BVHNode subtreeRoot = root;
+		int todo[BVH_STACK_SIZE];
+		int numTodo = 0;
+		todo[numTodo++] = -1;
+		while( numTodo > 0 )
+		{
+			int nodeIndex = todo[--numTodo];
+			BVHNode& node = nodeIndex < 0 ? subtreeRoot : nodes[nodeIndex];
+			int mid = Split( node.first, node.count );
+			if( mid < 0 )
+				continue;
+
+			BVHNode left, right;
+			left.first = node.first;
+			left.count = mid - node.first;
+			right.first = mid;
+			right.count = node.first + node.count - mid;
+			node.first = nodes.size();
+			node.count = 0;
+
+			//node is not used after this, push_back may move it
+			int childIndex = nodes.size();
+			nodes.push_back( left );
+			nodes.push_back( right );
+			todo[numTodo++] = childIndex;
+			todo[numTodo++] = childIndex + 1;
+		}
+
+		//bounds bottom up, the children of a node come after it
+		for( int i = (int) nodes.size() - 1; i >= -1; i-- )
+		{
+			BVHNode& node = i < 0 ? subtreeRoot : nodes[i];
+			if( node.count > 0 )
+				LeafBounds( node, bvh, box );
+			else
+			{
+				node.Pmin = glm::min( nodes[node.first].Pmin, nodes[node.first + 1].Pmin );
+				node.Pmax = glm::max( nodes[node.first].Pmax, nodes[node.first + 1].Pmax );
+			}
+		}
+		root = subtreeRoot;
+	}
+
+	template<class PrimitiveBox>
+	void LeafBounds( BVHNode& node, const BVH& bvh, const PrimitiveBox& box )
+	{
+		box( bvh.indices[node.first], node.Pmin, node.Pmax );
+		for( int i = node.first + 1; i < node.first + node.count; i++ )
+		{
+			glm::vec3 Pmin, Pmax;
+			box( bvh.indices[i], Pmin, Pmax );
+			node.Pmin = glm::min( node.Pmin, Pmin );
+			node.Pmax = glm::max( node.Pmax, Pmax );
+		}
+	}
+
+	// Puts the nodes of the subtrees behind the top levels, moving the
+	// children of their nodes with them, and computes the bounds of the top
+	void JoinSubtrees( BVH& bvh, ThreadPool& pool )
+	{
+		subtreeOffset.resize( subtrees.size() );
+		int numNodes = top.size();
+		for( size_t t = 0; t < subtrees.size(); t++ )
+		{
+			subtreeOffset[t] = numNodes;
+			numNodes += subtreeNodes[t].size();
+			BVHNode& root = top[subtrees[t]];
+			if( root.count == 0 )
+				root.first += subtreeOffset[t];
+		}
+
+		for( int i = (int) top.size() - 1; i >= 0; i-- )
+		{
+			BVHNode& node = top[i];
+			if( node.count == 0 && node.first < (int) top.size() )
+			{
+				node.Pmin = glm::min( top[node.first].Pmin, top[node.first + 1].Pmin );
+				node.Pmax = glm::max( top[node.first].Pmax, top[node.first + 1].Pmax );
+			}
+		}
+
+		bvh.nodes.resize( numNodes );
+		std::copy( top.begin(), top.end(), &bvh.nodes[0] );
+		pool.ParallelFor( subtrees.size(), [&]( int t, int thread )
+		{
+			const std::vector<BVHNode>& nodes = subtreeNodes[t];
+			BVHNode* out = &bvh.nodes[subtreeOffset[t]];
+			for( size_t i = 0; i < nodes.size(); i++ )
+			{
+				out[i] = nodes[i];
+				if( nodes[i].count == 0 )
+					out[i].first += subtreeOffset[t];
+			}
+		} );
+	}
+};
+
+#endif
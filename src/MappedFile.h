@@ -0,0 +1,72 @@
+#ifndef MAPPED_FILE_H
+#define MAPPED_FILE_H
+
+// Memory mapping of a whole file. The mapping is private: when it is opened
+// for writing, changes are made to copies of the pages and never reach the
+// file.
+
+#include <string>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+class MappedFile
+{
+public:
+	char* data;
+	size_t size;
+
+	MappedFile()
+		: data(0), size(0)
+	{
+	}
+
+	~MappedFile()
+	{
+		Close();
+	}
+
+	// readAhead starts reading all of the file in the background
+	bool Open( const std::string& filename, bool writable = false, bool readAhead = true )
+	{
+		Close();
+
+		int fd = open( filename.c_str(), O_RDONLY );
+		if( fd < 0 )
+			return false;
+
+		struct stat info;
+		if( fstat( fd, &info ) != 0 || info.st_size == 0 )
+		{
+			close( fd );
+			return false;
+		}
+
+		void* p = mmap( 0, info.st_size, writable ? PROT_READ | PROT_WRITE : PROT_READ, MAP_PRIVATE, fd, 0 );
+		close( fd );
+		if( p == MAP_FAILED )
+			return false;
+
+		//all of the file is about to be read
+		if( readAhead )
+			madvise( p, info.st_size, MADV_WILLNEED );
+		data = (char*) p;
+		size = info.st_size;
+		return true;
+	}
+
+	void Close()
+	{
+		if( data )
+			munmap( data, size );
+		data = 0;
+		size = 0;
+	}
+
+private:
+	MappedFile( const MappedFile& );
+	MappedFile& operator=( const MappedFile& );
+};
+
+#endif
@@ -0,0 +1,697 @@
+#ifndef MESH_LOADER_H
+#define MESH_LOADER_H
+
+// Loading of triangle meshes from Wavefront OBJ and binary PLY files. The
+// file is memory mapped and split into chunks that the threads of a pool
+// parse at the same time. Numbers are parsed straight from the mapped file,
+// without copying lines or allocating memory per line.
+//
+// OBJ and PLY files have y pointing up and the vertices of front faces in
+// counter-clockwise order. The meshes are rotated by 180 degrees around the x
+// axis and their faces reversed to match the Cornell Box, which has y pointing
+// down and its front faces in clockwise order.
+
+#include <glm/glm.hpp>
+#include <vector>
+#include <string>
+#include <cstring>
+#include <cstdlib>
+#include <cmath>
+#include <algorithm>
+#include <stdint.h>
+#include "TestModel.h"
+#include "ThreadPool.h"
+#include "MappedFile.h"
+
+// Parsing of numbers in text that is not null terminated. They move p past
+// the number and return false if there is none.
+
+inline void SkipSpaces( const char*& p, const char* end )
+{
+	while( p < end && (*p == ' ' || *p == '\t' || *p == '\r') )
+		p++;
+}
+
+inline bool ParseInt( const char*& p, const char* end, long& value )
+{
+	SkipSpaces( p, end );
+	bool negative = p < end && *p == '-';
+	if( p < end && (*p == '-' || *p == '+') )
+		p++;
+	if( p == end || *p < '0' || *p > '9' )
+		return false;
+
+	value = 0;
+	while( p < end && *p >= '0' && *p <= '9' )
+		value = 10 * value + (*p++ - '0');
+	if( negative )
+		value = -value;
+	return true;
+}
+
+inline bool ParseFloat( const char*& p, const char* end, float& value )
+{
+	SkipSpaces( p, end );
+	bool negative = p < end && *p == '-';
+	if( p < end && (*p == '-' || *p == '+') )
+		p++;
+
+	double mantissa = 0;
+	int exponent = 0;
+	bool digits = false;
+	while( p < end && *p >= '0' && *p <= '9' )
+	{
+		mantissa = 10 * mantissa + (*p++ - '0');
+		digits = true;
+	}
+	if( p < end && *p == '.' )
+	{
+		p++;
+		while( p < end && *p >= '0' && *p <= '9' )
+		{
+			mantissa = 10 * mantissa + (*p++ - '0');
+			exponent--;
+			digits = true;
+		}
+	}
+	if( !digits )
+		return false;
+
+	if( p < end && (*p == 'e' || *p == 'E') )
+	{
+		long e;
+		const char* q = p + 1;
+		if( q < end && *q == '+' )
+			q++;
+		if( ParseInt( q, end, e ) )
+		{
+			exponent += e;
+			p = q;
+		}
+	}
+
+	value = (float) ((negative ? -mantissa : mantissa) * pow( 10.0, exponent ));
+	return true;
+}
+
+inline const char* NextLine( const char* p, const char* end )
+{
+	const char* newline = (const char*) memchr( p, '\n', end - p );
+	return newline ? newline + 1 : end;
+}
+
+// Appends the triangle with the given vertices unless it has no area. The
+// vertices are in the orientation of the file, see above.
+inline void AddMeshTriangle( std::vector<Triangle>& triangles, glm::vec3 v0, glm::vec3 v1, glm::vec3 v2, glm::vec3 color )
+{
+	v0 = glm::vec3( v0.x, -v0.y, -v0.z );
+	v1 = glm::vec3( v1.x, -v1.y, -v1.z );
+	v2 = glm::vec3( v2.x, -v2.y, -v2.z );
+	glm::vec3 normal = glm::cross( v1 - v0, v2 - v0 );
+	if( glm::dot( normal, normal ) > 0 )
+		triangles.push_back( Triangle( v0, v2, v1, color ) );
+}
+
+// Splits the data into about n chunks that start at the beginning of a line
+inline std::vector<const char*> SplitLines( const char* begin, const char* end, int n )
+{
+	std::vector<const char*> bounds( 1, begin );
+	for( int i = 1; i < n; i++ )
+	{
+		const char* p = begin + (end - begin) * i / n;
+		p = p > bounds.back() ? NextLine( p - 1, end ) : bounds.back();
+		bounds.push_back( p );
+	}
+	bounds.push_back( end );
+	return bounds;
+}
+
+// Number of chunks to split size bytes into for the threads of pool. There
+// are more chunks than threads to even out their work.
+inline int NumChunks( size_t size, ThreadPool& pool )
+{
+	const size_t MIN_CHUNK_SIZE = 1 << 20;
+	return (int) std::max( (size_t) 1, std::min( size / MIN_CHUNK_SIZE, (size_t) 8 * pool.NumThreads() ) );
+}
+
+// Loads the vertices and faces of an OBJ file. Faces with more than three
+// vertices are split into triangles, everything else is ignored.
+bool LoadOBJ( const MappedFile& file, std::vector<Triangle>& triangles, glm::vec3 color, ThreadPool& pool, std::string& error )
+{
+	const char* end = file.data + file.size;
+	std::vector<const char*> bounds = SplitLines( file.data, end, NumChunks( file.size, pool ) );
+	int numChunks = bounds.size() - 1;
+
+	//first the vertices of every chunk are counted, so that every chunk knows
+	//the index of its first vertex and can resolve relative indices
+	std::vector<long> vertexOffset( numChunks + 1, 0 );
+	pool.ParallelFor( numChunks, [&]( int c, int thread )
+	{
+		long count = 0;
+		for( const char* p = bounds[c]; p < bounds[c + 1]; p = NextLine( p, bounds[c + 1] ) )
+			if( p + 1 < bounds[c + 1] && p[0] == 'v' && (p[1] == ' ' || p[1] == '\t') )
+				count++;
+		vertexOffset[c + 1] = count;
+	} );
+	for( int c = 0; c < numChunks; c++ )
+		vertexOffset[c + 1] += vertexOffset[c];
+
+	//then the vertices are parsed into their place and the faces into indices
+	std::vector<glm::vec3> vertices( vertexOffset[numChunks] );
+	std::vector<std::vector<long> > faces( numChunks );
+	std::vector<long> badLine( numChunks, -1 );
+
+	pool.ParallelFor( numChunks, [&]( int c, int thread )
+	{
+		long vertex = vertexOffset[c];
+		std::vector<long>& indices = faces[c];
+		long line = 0;
+
+		for( const char* p = bounds[c]; p < bounds[c + 1]; p = NextLine( p, bounds[c + 1] ), line++ )
+		{
+			const char* q = p + 2;
+			if( p + 1 >= bounds[c + 1] || (p[1] != ' ' && p[1] != '\t') )
+				continue;
+
+			if( p[0] == 'v' )
+			{
+				glm::vec3& v = vertices[vertex++];
+				if( !ParseFloat( q, end, v.x ) || !ParseFloat( q, end, v.y ) || !ParseFloat( q, end, v.z ) )
+				{
+					badLine[c] = line;
+					return;
+				}
+			}
+			else if( p[0] == 'f' )
+			{
+				//fan of triangles around the first vertex of the face
+				long first = 0, previous = 0, index;
+				int n = 0;
+				while( ParseInt( q, end, index ) )
+				{
+					//vertex indices start at one, negative indices count back from the last vertex
+					index = index < 0 ? vertex + index : index - 1;
+					if( n == 0 )
+						first = index;
+					else if( n >= 2 )
+					{
+						indices.push_back( first );
+						indices.push_back( previous );
+						indices.push_back( index );
+					}
+					previous = index;
+					n++;
+
+					//skip the texture coordinate and normal indices
+					while( q < end && *q != ' ' && *q != '\t' && *q != '\r' && *q != '\n' )
+						q++;
+				}
+				if( n < 3 )
+				{
+					badLine[c] = line;
+					return;
+				}
+			}
+		}
+	} );
+
+	for( int c = 0; c < numChunks; c++ )
+	{
+		if( badLine[c] >= 0 )
+		{
+			long line = badLine[c] + 1;
+			for( const char* p = file.data; p < bounds[c]; p = NextLine( p, end ) )
+				line++;
+			error = "cannot parse line " + std::to_string( line );
+			return false;
+		}
+	}
+
+	//finally the triangles are made from the vertices
+	std::vector<std::vector<Triangle> > chunkTriangles( numChunks );
+	std::vector<char> badIndex( numChunks, 0 );
+	pool.ParallelFor( numChunks, [&]( int c, int thread )
+	{
+		const std::vector<long>& indices = faces[c];
+		chunkTriangles[c].reserve( indices.size() / 3 );
+		for( size_t i = 0; i < indices.size(); i += 3 )
+		{
+			if( std::min( indices[i], std::min( indices[i + 1], indices[i + 2] ) ) < 0 ||
+				std::max( indices[i], std::max( indices[i + 1], indices[i + 2] ) ) >= (long) vertices.size() )
+			{
+				badIndex[c] = 1;
+				return;
+			}
+			AddMeshTriangle( chunkTriangles[c], vertices[indices[i]], vertices[indices[i + 1]], vertices[indices[i + 2]], color );
+		}
+	} );
+
+	triangles.clear();
+	for( int c = 0; c < numChunks; c++ )
+	{
+		if( badIndex[c] )
+		{
+			error = "face with a vertex index out of range";
+			return false;
+		}
+		triangles.insert( triangles.end(), chunkTriangles[c].begin(), chunkTriangles[c].end() );
+	}
+	return true;
+}
+
+// A property of an element of a PLY file
+struct PLYProperty
+{
+	std::string name;
+	int size;			// size of the value, or of the values of a list
+	bool isFloat;
+	bool isSigned;
+	int countSize;		// size of the count of a list, 0 if the property is no list
+};
+
+struct PLYElement
+{
+	std::string name;
+	long count;
+	std::vector<PLYProperty> properties;
+};
+
+// Size and kind of a PLY type, returns false for unknown types
+inline bool PLYType( const std::string& type, int& size, bool& isFloat, bool& isSigned )
+{
+	const char* names[] = { "char", "int8", "uchar", "uint8", "short", "int16", "ushort", "uint16",
+		"int", "int32", "uint", "uint32", "float", "float32", "double", "float64" };
+	const int sizes[] = { 1, 1, 1, 1, 2, 2, 2, 2, 4, 4, 4, 4, 4, 4, 8, 8 };
+	for( int i = 0; i < 16; i++ )
+	{
+		if( type == names[i] )
+		{
+			size = sizes[i];
+			isFloat = i >= 12;
+			isSigned = i < 12 ? (i / 2) % 2 == 0 : true;
+			return true;
+		}
+	}
+	return false;
+}
+
+// Reads a binary PLY value of the given type as a double
+inline double ReadPLYValue( const char* p, int size, bool isFloat, bool isSigned, bool bigEndian )
+{
+	//the common types of little endian files are read directly
+	if( !bigEndian && size == 4 )
+	{
+		if( isFloat )
+		{
+			float f;
+			memcpy( &f, p, 4 );
+			return f;
+		}
+		int32_t i;
+		memcpy( &i, p, 4 );
+		return isSigned ? (double) i : (double) (uint32_t) i;
+	}
+
+	unsigned char bytes[8];
+	for( int i = 0; i < size; i++ )
+		bytes[i] = p[bigEndian ? size - 1 - i : i];
+
+	if( isFloat )
+	{
+		if( size == 4 )
+		{
+			float f;
+			memcpy( &f, bytes, 4 );
+			return f;
+		}
+		double d;
+		memcpy( &d, bytes, 8 );
+		return d;
+	}
+
+	uint64_t u = 0;
+	for( int i = size - 1; i >= 0; i-- )
+		u = (u << 8) | bytes[i];
+	if( isSigned && size < 8 && (u >> (8 * size - 1)) )
+		u |= ~(uint64_t) 0 << (8 * size);
+	return isSigned ? (double) (int64_t) u : (double) u;
+}
+
+// Loads the vertices and faces of a binary PLY file. The vertex colors, if
+// there are any, give the colors of the triangles.
+bool LoadPLY( const MappedFile& file, std::vector<Triangle>& triangles, glm::vec3 color, ThreadPool& pool, std::string& error )
+{
+	const char* end = file.data + file.size;
+	const char* p = file.data;
+
+	//the header is made of lines of text up to end_header
+	std::vector<PLYElement> elements;
+	bool bigEndian = false;
+	bool headerEnded = false;
+	while( p < end && !headerEnded )
+	{
+		const char* next = NextLine( p, end );
+		std::string line( p, next - p );
+		p = next;
+		while( !line.empty() && (line.back() == '\n' || line.back() == '\r') )
+			line.pop_back();
+
+		std::vector<std::string> words;
+		size_t start = 0;
+		while( start < line.size() )
+		{
+			size_t stop = line.find( ' ', start );
+			if( stop == std::string::npos )
+				stop = line.size();
+			if( stop > start )
+				words.push_back( line.substr( start, stop - start ) );
+			start = stop + 1;
+		}
+		if( words.empty() )
+			continue;
+
+		if( words[0] == "format" && words.size() >= 2 )
+		{
+			if( words[1] == "binary_big_endian" )
+				bigEndian = true;
+			else if( words[1] != "binary_little_endian" )
+			{
+				error = "only binary PLY files are supported";
+				return false;
+			}
+		}
+		else if( words[0] == "element" && words.size() >= 3 )
+		{
+			PLYElement element;
+			element.name = words[1];
+			element.count = atol( words[2].c_str() );
+			elements.push_back( element );
+		}
+		else if( words[0] == "property" && !elements.empty() )
+		{
+			PLYProperty property;
+			property.countSize = 0;
+			bool ok;
+			if( words.size() >= 5 && words[1] == "list" )
+			{
+				int countSize = 0;
+				bool countFloat, countSigned;
+				ok = PLYType( words[2], countSize, countFloat, countSigned ) && !countFloat &&
+					PLYType( words[3], property.size, property.isFloat, property.isSigned );
+				property.countSize = countSize;
+				property.name = words[4];
+			}
+			else
+			{
+				ok = words.size() >= 3 && PLYType( words[1], property.size, property.isFloat, property.isSigned );
+				property.name = words.size() >= 3 ? words[2] : "";
+			}
+			if( !ok )
+			{
+				error = "unknown property type: " + line;
+				return false;
+			}
+			elements.back().properties.push_back( property );
+		}
+		else if( words[0] == "end_header" )
+			headerEnded = true;
+	}
+
+	if( !headerEnded )
+	{
+		error = "the PLY header has no end";
+		return false;
+	}
+
+	std::vector<glm::vec3> vertices;
+	std::vector<glm::vec3> colors;
+	std::vector<std::vector<Triangle> > chunkTriangles;
+
+	for( size_t e = 0; e < elements.size(); e++ )
+	{
+		const PLYElement& element = elements[e];
+		const std::vector<PLYProperty>& properties = element.properties;
+
+		//offset of every property in the records, -1 after the first list
+		std::vector<int> offset( properties.size(), -1 );
+		int recordSize = 0;
+		bool fixedSize = true;
+		for( size_t i = 0; i < properties.size() && fixedSize; i++ )
+		{
+			offset[i] = recordSize;
+			if( properties[i].countSize > 0 )
+				fixedSize = false;
+			else
+				recordSize += properties[i].size;
+		}
+
+		if( element.name == "vertex" )
+		{
+			int position[3] = { -1, -1, -1 };
+			int channel[3] = { -1, -1, -1 };
+			const char* positionNames[3] = { "x", "y", "z" };
+			const char* channelNames[3] = { "red", "green", "blue" };
+			for( size_t i = 0; i < properties.size(); i++ )
+			{
+				for( int k = 0; k < 3; k++ )
+				{
+					if( properties[i].name == positionNames[k] )
+						position[k] = i;
+					if( properties[i].name == channelNames[k] )
+						channel[k] = i;
+				}
+			}
+			if( !fixedSize || position[0] < 0 || position[1] < 0 || position[2] < 0 )
+			{
+				error = "the vertices need x, y and z and no lists";
+				return false;
+			}
+			if( p + element.count * recordSize > end )
+			{
+				error = "the file ends before the last vertex";
+				return false;
+			}
+
+			bool hasColor = channel[0] >= 0 && channel[1] >= 0 && channel[2] >= 0;
+			vertices.resize( element.count );
+			if( hasColor )
+				colors.resize( element.count );
+
+			//the vertices have a fixed size and are split evenly between the chunks
+			const char* first = p;
+			int numChunks = NumChunks( element.count * recordSize, pool );
+			pool.ParallelFor( numChunks, [&]( int c, int thread )
+			{
+				long begin = element.count * c / numChunks;
+				long stop = element.count * (c + 1) / numChunks;
+				for( long v = begin; v < stop; v++ )
+				{
+					const char* record = first + v * recordSize;
+					for( int k = 0; k < 3; k++ )
+					{
+						const PLYProperty& property = properties[position[k]];
+						vertices[v][k] = ReadPLYValue( record + offset[position[k]], property.size, property.isFloat, property.isSigned, bigEndian );
+					}
+					if( hasColor )
+					{
+						for( int k = 0; k < 3; k++ )
+						{
+							const PLYProperty& property = properties[channel[k]];
+							double value = ReadPLYValue( record + offset[channel[k]], property.size, property.isFloat, property.isSigned, bigEndian );
+							colors[v][k] = property.isFloat ? value : value / 255;
+						}
+					}
+				}
+			} );
+			p += element.count * recordSize;
+		}
+		else if( element.name == "face" )
+		{
+			int list = -1;
+			for( size_t i = 0; i < properties.size(); i++ )
+				if( properties[i].countSize > 0 && (properties[i].name == "vertex_indices" || properties[i].name == "vertex_index") )
+					list = i;
+			if( list < 0 )
+			{
+				error = "the faces have no vertex indices";
+				return false;
+			}
+			const PLYProperty& indexProperty = properties[list];
+
+			//a face can only be found without reading the faces before it if all faces
+			//have the same number of vertices as the first and no other lists
+			bool uniform = p < end;
+			int faceSize = 0;
+			int countOffset = 0;
+			for( size_t i = 0; i < properties.size() && uniform; i++ )
+			{
+				if( (int) i < list )
+					countOffset += properties[i].size;
+				if( properties[i].countSize > 0 && (int) i != list )
+					uniform = false;
+				faceSize += properties[i].countSize > 0 ? properties[i].countSize : properties[i].size;
+			}
+			int numFaceVertices = 0;
+			if( uniform && p + countOffset + indexProperty.countSize <= end )
+			{
+				numFaceVertices = (int) ReadPLYValue( p + countOffset, indexProperty.countSize, false, false, bigEndian );
+				faceSize += numFaceVertices * indexProperty.size;
+			}
+			else
+				uniform = false;
+			//faces of the size of the first may not fit into the file when later faces are smaller, the
+			//faces are then read one after the other, which finds a file that is really too short
+			if( uniform && p + element.count * faceSize > end )
+				uniform = false;
+
+			//faces of a chunk are read from p until stop
+			auto readFaces = [&]( const char* q, long begin, long stop, std::vector<Triangle>& out, bool checkCount ) -> const char*
+			{
+				for( long f = begin; f < stop; f++ )
+				{
+					long first = 0, previous = 0;
+					for( size_t i = 0; i < properties.size(); i++ )
+					{
+						const PLYProperty& property = properties[i];
+						if( property.countSize == 0 )
+						{
+							q += property.size;
+							continue;
+						}
+						if( q + property.countSize > end )
+							return 0;
+						long n = (long) ReadPLYValue( q, property.countSize, false, false, bigEndian );
+						q += property.countSize;
+						if( q + n * property.size > end || (checkCount && n != numFaceVertices) )
+							return 0;
+						if( (int) i != list )
+						{
+							q += n * property.size;
+							continue;
+						}
+						for( long k = 0; k < n; k++, q += property.size )
+						{
+							long index = (long) ReadPLYValue( q, property.size, property.isFloat, property.isSigned, bigEndian );
+							if( index < 0 || index >= (long) vertices.size() )
+								return 0;
+							if( k == 0 )
+								first = index;
+							else if( k >= 2 )
+							{
+								glm::vec3 faceColor = colors.empty() ? color : (colors[first] + colors[previous] + colors[index]) / 3.0f;
+								AddMeshTriangle( out, vertices[first], vertices[previous], vertices[index], faceColor );
+							}
+							previous = index;
+						}
+					}
+				}
+				return q;
+			};
+
+			const char* first = p;
+			if( uniform )
+			{
+				int numChunks = NumChunks( element.count * faceSize, pool );
+				std::vector<std::vector<Triangle> > faces( numChunks );
+				std::vector<char> failed( numChunks, 0 );
+				pool.ParallelFor( numChunks, [&]( int c, int thread )
+				{
+					long begin = element.count * c / numChunks;
+					long stop = element.count * (c + 1) / numChunks;
+					faces[c].reserve( (stop - begin) * std::max( numFaceVertices - 2, 0 ) );
+					failed[c] = readFaces( first + begin * faceSize, begin, stop, faces[c], true ) == 0;
+				} );
+
+				uniform = true;
+				for( int c = 0; c < numChunks; c++ )
+					uniform = uniform && !failed[c];
+				if( uniform )
+				{
+					chunkTriangles.insert( chunkTriangles.end(), faces.begin(), faces.end() );
+					p += element.count * faceSize;
+				}
+			}
+
+			if( !uniform )
+			{
+				//read the faces one after the other
+				chunkTriangles.push_back( std::vector<Triangle>() );
+				p = readFaces( first, 0, element.count, chunkTriangles.back(), false );
+				if( !p )
+				{
+					error = "cannot read the faces";
+					return false;
+				}
+			}
+		}
+		else
+		{
+			//elements other than vertices and faces are skipped
+			if( !fixedSize )
+			{
+				error = "cannot skip element " + element.name;
+				return false;
+			}
+			p += element.count * recordSize;
+		}
+	}
+
+	triangles.clear();
+	for( size_t c = 0; c < chunkTriangles.size(); c++ )
+		triangles.insert( triangles.end(), chunkTriangles[c].begin(), chunkTriangles[c].end() );
+	return true;
+}
+
+// Loads the triangles of an OBJ or binary PLY file, depending on the extension
+// of its name. Triangles without colors get the given color. Returns false and
+// puts the reason in error if the file cannot be loaded.
+bool LoadMesh( const std::string& filename, std::vector<Triangle>& triangles, glm::vec3 color, ThreadPool& pool, std::string& error )
+{
+	MappedFile file;
+	if( !file.Open( filename ) )
+	{
+		error = "cannot open " + filename;
+		return false;
+	}
+
+	std::string extension = filename.substr( filename.find_last_of( '.' ) + 1 );
+	if( extension == "obj" )
+		return LoadOBJ( file, triangles, color, pool, error );
+	if( extension == "ply" )
+		return LoadPLY( file, triangles, color, pool, error );
+
+	error = "unknown mesh format: " + filename;
+	return false;
+}
+
+// Scales and moves the triangles uniformly so that they fit in the box from
+// Pmin to Pmax, centered in x and z and standing on the bottom of the box,
+// which is at Pmax.y as y points down.
+void FitTriangles( std::vector<Triangle>& triangles, glm::vec3 Pmin, glm::vec3 Pmax )
+{
+	if( triangles.empty() )
+		return;
+
+	glm::vec3 meshMin = triangles[0].v0;
+	glm::vec3 meshMax = triangles[0].v0;
+	for( size_t i = 0; i < triangles.size(); i++ )
+	{
+		meshMin = glm::min( meshMin, glm::min( triangles[i].v0, glm::min( triangles[i].v1, triangles[i].v2 ) ) );
+		meshMax = glm::max( meshMax, glm::max( triangles[i].v0, glm::max( triangles[i].v1, triangles[i].v2 ) ) );
+	}
+
+	glm::vec3 size = glm::max( meshMax - meshMin, glm::vec3( 1e-20f ) );
+	glm::vec3 ratio = (Pmax - Pmin) / size;
+	float scale = std::min( ratio.x, std::min( ratio.y, ratio.z ) );
+
+	glm::vec3 from( (meshMin.x + meshMax.x) / 2, meshMax.y, (meshMin.z + meshMax.z) / 2 );
+	glm::vec3 to( (Pmin.x + Pmax.x) / 2, Pmax.y, (Pmin.z + Pmax.z) / 2 );
+	for( size_t i = 0; i < triangles.size(); i++ )
+	{
+		triangles[i].v0 = to + scale * (triangles[i].v0 - from);
+		triangles[i].v1 = to + scale * (triangles[i].v1 - from);
+		triangles[i].v2 = to + scale * (triangles[i].v2 - from);
+	}
+}
+
+#endif
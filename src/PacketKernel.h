@@ -0,0 +1,307 @@
+// Packet traversal kernels, see RayPacket.h. This file has no include guard
+// because RayPacket.h includes it once for every instruction set, each time
+// inside its own namespace and with the instruction set enabled by a pragma.
+// That way the vector code of every kernel is generated for that instruction
+// set, including the templates it instantiates.
+
+template<int W>
+struct PacketLanes
+{
+	typedef float Float __attribute__((vector_size(W * sizeof(float))));
+	typedef int Mask __attribute__((vector_size(W * sizeof(int))));
+};
+
+template<class T>
+PACKET_INLINE void LoadLanes( T& r, const void* p )
+{
+	memcpy( &r, p, sizeof(r) );
+}
+
+template<class T>
+PACKET_INLINE void StoreLanes( void* p, const T& r )
+{
+	memcpy( p, &r, sizeof(r) );
+}
+
+template<int W>
+PACKET_INLINE bool AnyLane( const typename PacketLanes<W>::Mask& m )
+{
+	for( int i = 0; i < W; i++ )
+		if( m[i] )
+			return true;
+	return false;
+}
+
+
+// The rays of a packet loaded into vector registers
+template<int W>
+struct PacketRays
+{
+	typedef typename PacketLanes<W>::Float Float;
+	typedef typename PacketLanes<W>::Mask Mask;
+
+	Float startX, startY, startZ;
+	Float dirX, dirY, dirZ;
+	Float invDirX, invDirY, invDirZ;
+	Mask active;
+
+	// Closest intersection found so far
+	Float distance, u, v;
+	Mask objectIndex, triangleIndex;
+};
+
+// Slab test of all rays of the packet against a box, see BoxIntersection
+template<int W>
+PACKET_INLINE void PacketBoxIntersection( const PacketRays<W>& rays, glm::vec3 Pmin, glm::vec3 Pmax, typename PacketLanes<W>::Mask& hit )
+{
+	typedef typename PacketLanes<W>::Float Float;
+
+	Float tx1 = (Pmin.x - rays.startX) * rays.invDirX;
+	Float tx2 = (Pmax.x - rays.startX) * rays.invDirX;
+	Float tmin = MIN_LANES( tx1, tx2 );
+	Float tmax = MAX_LANES( tx1, tx2 );
+
+	Float ty1 = (Pmin.y - rays.startY) * rays.invDirY;
+	Float ty2 = (Pmax.y - rays.startY) * rays.invDirY;
+	tmin = MAX_LANES( tmin, MIN_LANES( ty1, ty2 ) );
+	tmax = MIN_LANES( tmax, MAX_LANES( ty1, ty2 ) );
+
+	Float tz1 = (Pmin.z - rays.startZ) * rays.invDirZ;
+	Float tz2 = (Pmax.z - rays.startZ) * rays.invDirZ;
+	tmin = MAX_LANES( tmin, MIN_LANES( tz1, tz2 ) );
+	tmax = MIN_LANES( tmax, MAX_LANES( tz1, tz2 ) );
+
+	hit = rays.active & (tmax >= tmin) & (tmax >= 0) & (tmin <= rays.distance);
+}
+
+// Möller-Trumbore test of all rays of the packet against the triangle in the
+// given lane of a block. Rays that hit it closer than their closest
+// intersection so far are updated.
+template<int W>
+PACKET_INLINE void PacketTriangleIntersection( PacketRays<W>& rays, const typename PacketLanes<W>::Mask& active,
+	glm::vec3 v0, glm::vec3 e1, glm::vec3 e2, int triangleIndex, int objectIndex, float epsilon, RayPacket& packet )
+{
+	typedef typename PacketLanes<W>::Float Float;
+	typedef typename PacketLanes<W>::Mask Mask;
+
+	Float px = rays.dirY * e2.z - rays.dirZ * e2.y;
+	Float py = rays.dirZ * e2.x - rays.dirX * e2.z;
+	Float pz = rays.dirX * e2.y - rays.dirY * e2.x;
+	Float invDet = 1.0f / (e1.x * px + e1.y * py + e1.z * pz);
+
+	Float bx = rays.startX - v0.x;
+	Float by = rays.startY - v0.y;
+	Float bz = rays.startZ - v0.z;
+	Float u = (bx * px + by * py + bz * pz) * invDet;
+
+	Float qx = by * e1.z - bz * e1.y;
+	Float qy = bz * e1.x - bx * e1.z;
+	Float qz = bx * e1.y - by * e1.x;
+	Float v = (rays.dirX * qx + rays.dirY * qy + rays.dirZ * qz) * invDet;
+	Float t = (e2.x * qx + e2.y * qy + e2.z * qz) * invDet;
+
+	Mask hit = active & (t > epsilon) & (u > -epsilon) & (u <= 1 + epsilon) & (v > -epsilon) & (u + v <= 1 + epsilon);
+
+	packet.numRayTrianglesTests += packet.width;
+	if( !AnyLane<W>( hit ) )
+		return;
+
+	for( int i = 0; i < W; i++ )
+		if( hit[i] )
+			packet.numRayTrianglesIntersections++;
+
+	Mask closer = hit & (t < rays.distance);
+	rays.distance = closer ? t : rays.distance;
+	rays.u = closer ? u : rays.u;
+	rays.v = closer ? v : rays.v;
+	rays.objectIndex = closer ? Mask() + objectIndex : rays.objectIndex;
+	rays.triangleIndex = closer ? Mask() + triangleIndex : rays.triangleIndex;
+}
+
+// Pushes the children of an interior node, the one nearest to the packet last
+// so that it is visited first. As the packet is coherent, the direction of
+// any of its rays gives the order.
+PACKET_INLINE void PushChildrenInOrder( const BVH& bvh, const BVHNode& node, glm::vec3 dir, int* stack, int& stackSize )
+{
+	const BVHNode& left = bvh.nodes[node.first];
+	const BVHNode& right = bvh.nodes[node.first + 1];
+	glm::vec3 separation = (right.Pmin + right.Pmax) - (left.Pmin + left.Pmax);
+	bool leftFirst = glm::dot( separation, dir ) >= 0;
+	stack[stackSize++] = leftFirst ? node.first + 1 : node.first;
+	stack[stackSize++] = leftFirst ? node.first : node.first + 1;
+}
+
+template<int W>
+PACKET_INLINE void TraceMeshPacket( PacketRays<W>& rays, const Mesh& mesh, int objectIndex, glm::vec3 dir, float epsilon, RayPacket& packet )
+{
+	typedef typename PacketLanes<W>::Mask Mask;
+
+	const BVH& bvh = mesh.bvh;
+	if( bvh.nodes.empty() )
+		return;
+
+	int stack[BVH_STACK_SIZE];
+	int stackSize = 0;
+	stack[stackSize++] = 0;
+
+	while( stackSize > 0 )
+	{
+		const BVHNode& node = bvh.nodes[stack[--stackSize]];
+		packet.numTraversalSteps += packet.width;
+
+		//the box is tested when the node is visited, so that it is tested against
+		//the closest intersections found up to that point
+		packet.numRayBoxTests += packet.width;
+		Mask hit;
+		PacketBoxIntersection<W>( rays, node.Pmin, node.Pmax, hit );
+		if( !AnyLane<W>( hit ) )
+			continue;
+
+		if( node.count > 0 && mesh.compact )
+		{
+			//the triangles of compact meshes are decoded one at a time
+			for( int l = 0; l < node.count; l++ )
+			{
+				int triangleIndex = bvh.indices[node.first + l];
+				glm::vec3 v0, v1, v2;
+				mesh.Positions( triangleIndex, v0, v1, v2 );
+				PacketTriangleIntersection<W>( rays, hit, v0, v1 - v0, v2 - v0, triangleIndex, objectIndex, epsilon, packet );
+			}
+			continue;
+		}
+
+		if( node.count > 0 )
+		{
+			const TriangleBlock* block = &mesh.store.blocks[mesh.store.leafBlock[&node - &bvh.nodes[0]]];
+			for( int l = 0; l < node.count; l++ )
+			{
+				if( l > 0 && l % TRIANGLE_BLOCK_SIZE == 0 )
+					block++;
+				int lane = l % TRIANGLE_BLOCK_SIZE;
+				glm::vec3 v0( block->v0x[lane], block->v0y[lane], block->v0z[lane] );
+				glm::vec3 e1( block->e1x[lane], block->e1y[lane], block->e1z[lane] );
+				glm::vec3 e2( block->e2x[lane], block->e2y[lane], block->e2z[lane] );
+				PacketTriangleIntersection<W>( rays, hit, v0, e1, e2, block->triangleIndex[lane], objectIndex, epsilon, packet );
+			}
+			continue;
+		}
+
+		PushChildrenInOrder( bvh, node, dir, stack, stackSize );
+	}
+}
+
+// Traces the packet against an instance, with its rays moved into the
+// coordinates of the mesh. The distances along the moved rays are those along
+// the rays, so the closest intersections carry over.
+template<int W>
+void TraceInstancePacket( PacketRays<W>& rays, const Object& object, int objectIndex, glm::vec3 dir, float epsilon, RayPacket& packet )
+{
+	PacketRays<W> moved = rays;
+	const glm::mat3& m = object.toObject;
+	const glm::vec3& offset = object.toObjectOffset;
+	moved.startX = m[0].x * rays.startX + m[1].x * rays.startY + m[2].x * rays.startZ + offset.x;
+	moved.startY = m[0].y * rays.startX + m[1].y * rays.startY + m[2].y * rays.startZ + offset.y;
+	moved.startZ = m[0].z * rays.startX + m[1].z * rays.startY + m[2].z * rays.startZ + offset.z;
+	moved.dirX = m[0].x * rays.dirX + m[1].x * rays.dirY + m[2].x * rays.dirZ;
+	moved.dirY = m[0].y * rays.dirX + m[1].y * rays.dirY + m[2].y * rays.dirZ;
+	moved.dirZ = m[0].z * rays.dirX + m[1].z * rays.dirY + m[2].z * rays.dirZ;
+	for( int i = 0; i < W; i++ )
+	{
+		glm::vec3 invDir = InverseDirection( glm::vec3( moved.dirX[i], moved.dirY[i], moved.dirZ[i] ) );
+		moved.invDirX[i] = invDir.x;
+		moved.invDirY[i] = invDir.y;
+		moved.invDirZ[i] = invDir.z;
+	}
+
+	TraceMeshPacket<W>( moved, *object.mesh, objectIndex, m * dir, epsilon, packet );
+
+	rays.distance = moved.distance;
+	rays.u = moved.u;
+	rays.v = moved.v;
+	rays.objectIndex = moved.objectIndex;
+	rays.triangleIndex = moved.triangleIndex;
+}
+
+// Finds the closest intersection of every ray in the packet. The packet has
+// to be coherent and its distances set to the maximum distance of each ray.
+template<int W>
+void TracePacketWidth( RayPacket& packet, const std::vector<Object>& objects, const BVH& objectsBVH, float epsilon )
+{
+	typedef typename PacketLanes<W>::Mask Mask;
+
+	PacketRays<W> rays;
+	//lanes past the width of the packet repeat the first ray, they are masked out
+	for( int i = packet.width; i < W; i++ )
+	{
+		packet.startX[i] = packet.startX[0];
+		packet.startY[i] = packet.startY[0];
+		packet.startZ[i] = packet.startZ[0];
+		packet.dirX[i] = packet.dirX[0];
+		packet.dirY[i] = packet.dirY[0];
+		packet.dirZ[i] = packet.dirZ[0];
+		packet.distance[i] = packet.distance[0];
+	}
+
+	LoadLanes( rays.startX, packet.startX );
+	LoadLanes( rays.startY, packet.startY );
+	LoadLanes( rays.startZ, packet.startZ );
+	LoadLanes( rays.dirX, packet.dirX );
+	LoadLanes( rays.dirY, packet.dirY );
+	LoadLanes( rays.dirZ, packet.dirZ );
+
+	glm::vec3 dir( packet.dirX[0], packet.dirY[0], packet.dirZ[0] );
+	for( int i = 0; i < W; i++ )
+	{
+		glm::vec3 invDir = InverseDirection( glm::vec3( rays.dirX[i], rays.dirY[i], rays.dirZ[i] ) );
+		rays.invDirX[i] = invDir.x;
+		rays.invDirY[i] = invDir.y;
+		rays.invDirZ[i] = invDir.z;
+		rays.active[i] = i < packet.width ? -1 : 0;
+	}
+
+	LoadLanes( rays.distance, packet.distance );
+	rays.u = rays.distance * 0;
+	rays.v = rays.u;
+	rays.objectIndex = Mask() - 1;
+	rays.triangleIndex = rays.objectIndex;
+
+	if( !objectsBVH.nodes.empty() )
+	{
+		int stack[BVH_STACK_SIZE];
+		int stackSize = 0;
+		stack[stackSize++] = 0;
+
+		while( stackSize > 0 )
+		{
+			const BVHNode& node = objectsBVH.nodes[stack[--stackSize]];
+			packet.numTraversalSteps += packet.width;
+
+			packet.numRayBoxTests += packet.width;
+			Mask hit;
+			PacketBoxIntersection<W>( rays, node.Pmin, node.Pmax, hit );
+			if( !AnyLane<W>( hit ) )
+				continue;
+
+			if( node.count > 0 )
+			{
+				for( int k = node.first; k < node.first + node.count; k++ )
+				{
+					int j = objectsBVH.indices[k];
+					if( objects[j].instanced )
+						TraceInstancePacket<W>( rays, objects[j], j, dir, epsilon, packet );
+					else
+						TraceMeshPacket<W>( rays, *objects[j].mesh, j, dir, epsilon, packet );
+				}
+				continue;
+			}
+
+			PushChildrenInOrder( objectsBVH, node, dir, stack, stackSize );
+		}
+	}
+
+	StoreLanes( packet.distance, rays.distance );
+	StoreLanes( packet.u, rays.u );
+	StoreLanes( packet.v, rays.v );
+	StoreLanes( packet.objectIndex, rays.objectIndex );
+	StoreLanes( packet.triangleIndex, rays.triangleIndex );
+}
@@ -0,0 +1,142 @@
+#ifndef RAY_PACKET_H
+#define RAY_PACKET_H
+
+// Traversal of packets of coherent rays through the two level BVH. All rays of
+// a packet are tested against a box or a triangle at once. The kernels are
+// written once with GCC vector extensions for any packet width and compiled
+// for SSE (4 rays), AVX2 (8 rays) and AVX-512 (16 rays). The widest one the
+// CPU supports is picked at runtime.
+
+#include <glm/glm.hpp>
+#include <vector>
+#include <cstring>
+#include "BVH.h"
+#include "TestModel.h"
+
+// The helpers of the kernels are always inlined into them
+#define PACKET_INLINE inline __attribute__((always_inline))
+
+#define MIN_LANES(a, b) ((a) < (b) ? (a) : (b))
+#define MAX_LANES(a, b) ((a) > (b) ? (a) : (b))
+
+const int MAX_PACKET_WIDTH = 16;
+
+// A packet of rays in structure of arrays layout of which the first width
+// lanes are used. After tracing, distance, u and v describe the closest
+// intersection of every ray and objectIndex is -1 for rays that hit nothing.
+struct RayPacket
+{
+	int width;
+
+	float startX[MAX_PACKET_WIDTH];
+	float startY[MAX_PACKET_WIDTH];
+	float startZ[MAX_PACKET_WIDTH];
+	float dirX[MAX_PACKET_WIDTH];
+	float dirY[MAX_PACKET_WIDTH];
+	float dirZ[MAX_PACKET_WIDTH];
+
+	float distance[MAX_PACKET_WIDTH];
+	float u[MAX_PACKET_WIDTH];
+	float v[MAX_PACKET_WIDTH];
+	int objectIndex[MAX_PACKET_WIDTH];
+	int triangleIndex[MAX_PACKET_WIDTH];
+
+	// Work done while tracing the packet, counted per ray
+	long numTraversalSteps;
+	long numRayBoxTests;
+	long numRayTrianglesTests;
+	long numRayTrianglesIntersections;
+};
+
+// Packets only pay off when all rays traverse the hierarchy in the same order,
+// which is the case when their directions lie in the same octant.
+bool PacketIsCoherent( const RayPacket& packet )
+{
+	for( int i = 1; i < packet.width; i++ )
+	{
+		if( (packet.dirX[i] < 0) != (packet.dirX[0] < 0) ||
+			(packet.dirY[i] < 0) != (packet.dirY[0] < 0) ||
+			(packet.dirZ[i] < 0) != (packet.dirZ[0] < 0) )
+			return false;
+	}
+	return true;
+}
+
+typedef void (*TracePacketFunction)( RayPacket&, const std::vector<Object>&, const BVH&, float );
+
+// Kernels for the supported packet widths
+namespace PacketBaseline
+{
+#include "PacketKernel.h"
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+#pragma GCC push_options
+#pragma GCC target("avx2,fma")
+namespace PacketAVX2
+{
+#include "PacketKernel.h"
+}
+#pragma GCC pop_options
+
+#pragma GCC push_options
+#pragma GCC target("avx512f,avx512dq,avx512vl,avx512bw,avx2,fma")
+namespace PacketAVX512
+{
+#include "PacketKernel.h"
+}
+#pragma GCC pop_options
+#endif
+
+void TracePacket4( RayPacket& packet, const std::vector<Object>& objects, const BVH& objectsBVH, float epsilon )
+{
+	PacketBaseline::TracePacketWidth<4>( packet, objects, objectsBVH, epsilon );
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+void TracePacket8( RayPacket& packet, const std::vector<Object>& objects, const BVH& objectsBVH, float epsilon )
+{
+	PacketAVX2::TracePacketWidth<8>( packet, objects, objectsBVH, epsilon );
+}
+
+void TracePacket16( RayPacket& packet, const std::vector<Object>& objects, const BVH& objectsBVH, float epsilon )
+{
+	PacketAVX512::TracePacketWidth<16>( packet, objects, objectsBVH, epsilon );
+}
+#endif
+
+// Widest packet the CPU running the program supports, 1 if packets cannot be
+// traced with SIMD instructions
+int SupportedPacketWidth()
+{
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_cpu_init();
+	if( __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512dq") &&
+		__builtin_cpu_supports("avx512vl") && __builtin_cpu_supports("avx512bw") )
+		return 16;
+	if( __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma") )
+		return 8;
+	if( __builtin_cpu_supports("sse2") )
+		return 4;
+	return 1;
+#elif defined(__ARM_NEON) || defined(__ALTIVEC__)
+	return 4;
+#else
+	return 1;
+#endif
+}
+
+// Kernel for the given packet width, which must be 4, 8 or 16 and supported
+// by the CPU
+TracePacketFunction PacketKernel( int width )
+{
+#if defined(__x86_64__) || defined(__i386__)
+	if( width == 16 )
+		return TracePacket16;
+	if( width == 8 )
+		return TracePacket8;
+#endif
+	return TracePacket4;
+}
+
+#endif
@@ -0,0 +1,1730 @@
+#ifndef RENDERER_H
+#define RENDERER_H
+
+//The ray tracer itself: the scene, camera and light and the rendering of images into the
+//framebuffer. It is shared by the interactive program and the benchmark.
+
+#include <iostream>
+#include <glm/glm.hpp>
+#include "TestModel.h"
+#include "BVH.h"
+#include "ThreadPool.h"
+#include "RayPacket.h"
+#include "Statistics.h"
+#include "MeshLoader.h"
+#include "SceneCache.h"
+#include "GeometryPager.h"
+#include "IrradianceCache.h"
+#include "Arena.h"
+#include <cstring>
+#include <cstdlib>
+#include "limits.h"
+
+using namespace std;
+using glm::vec3;
+using glm::mat3;
+using glm::mat4;
+
+//structure used to hold information about the intersection of a ray and a triangle
+struct Intersection
+{
+	vec3 position;
+	float distance;
+	int objectIndex;
+	int triangleIndex;
+};
+
+/* ----------------------------------------------------------------------------*/
+/* GLOBAL VARIABLES                                                            */
+
+const float PI = 3.1415926535897;
+
+//Screen information
+int screenWidth = 500;
+int screenHeight = 500;
+
+//The rendered image in linear RGB, row by row
+vector<vec3> framebuffer;
+
+//Box and triangle tests done for every pixel and the object its first sample hit (-1 for none),
+//only filled when the statistics are enabled
+vector<float> costBuffer;
+vector<int> objectBuffer;
+
+//Scene information, which refers into the scene cache when it was loaded from one. sceneVersion
+//is increased every time the scene changes
+string sceneCacheFile;
+MappedFile sceneCache;
+vector<Object> objects;
+BVH objectsBVH;
+int sceneVersion = 0;
+
+//Store the meshes of the scene compactly, with vertices quantized to 16 bits and no triangle
+//blocks, which takes about a third of the memory but makes the triangle tests slower
+bool compactMeshes = false;
+
+//Out-of-core rendering, when geometryBudget is not 0 the meshes are laid out in pages and rendered
+//from the scene cache with at most geometryBudget bytes of their pages in memory, see
+//GeometryPager.h. The tests of rays that reach a page that is not in memory are deferred into
+//deferredTests by the threads that defer them, and traced once the rays of a tile are done
+size_t geometryBudget = 0;
+GeometryPager pager;
+
+struct DeferredTest {
+	int ray;
+	int objectIndex;
+	int node;
+	int page;
+};
+thread_local vector<DeferredTest> threadDeferredTests;
+thread_local vector<DeferredTest>* deferredTests = 0;
+thread_local int deferredRay;
+
+//Camera information, the focal length is in pixels and set to the screen width
+float focalLength = 500;
+vec3 cameraPos(0,0,-3.001);
+mat3 cameraRot(vec3(1,0,0),vec3(0,1,0),vec3(0,0,1));
+float yaw = 0;
+
+//Light information
+vec3 lightPos(0, -0.5, -0.7);
+const vec3 lightColor = 14.f * vec3(1,1,1);
+const vec3 indirectLight = 0.5f * vec3(1,1,1);
+const float lightRadius = 0.03;
+
+//The number of samples taken in antialiasing
+//must be a square number
+int antiAliasingCells = 4;
+
+//Test of a ray against a block of triangles, picked for the CPU the program runs on
+BlockIntersectionFunction blockIntersection = BlockKernel();
+BlockOcclusionFunction blockOcclusion = BlockOcclusionKernel();
+CompactIntersectionFunction compactIntersection = CompactKernel();
+CompactOcclusionFunction compactOcclusion = CompactOcclusionKernel();
+
+//The block of triangles that blocked the last shadow ray of the thread, if it was blocked, which
+//the next shadow ray tests first as neighbouring shadow rays are mostly blocked by the same triangles.
+//In a compact mesh, which has no blocks, block is the node of the leaf instead. page is the page of
+//the block in a paged mesh and -1 otherwise. scene is the sceneVersion the block was found in, as
+//the blocks and leaves of a mesh change when it is moved or another scene is loaded
+struct Occluder {
+	int objectIndex;
+	int block;
+	int count;
+	int page;
+	int scene;
+};
+thread_local Occluder lastOccluder = {-1, 0, 0, -1, 0};
+
+//Floating point inaccuracy constant
+const float epsilon = 0.00001;
+
+//Statistics, statistics points to the copy of the current thread and the copies
+//of all threads are added into frameStatistics at the end of every frame
+vector<Statistics> threadStatistics;
+thread_local Statistics* statistics = 0;
+Statistics frameStatistics = Statistics();
+
+//Multithreading, the image is split into square tiles of TILE_SIZE pixels which
+//are shared out between the threads
+const int TILE_SIZE = 16;
+
+//Scratch memory of the thread for the tile it renders, see Arena.h
+thread_local Arena arena;
+int numThreads = thread::hardware_concurrency();
+ThreadPool* threadPool;
+
+//Set by another thread to stop the frame being rendered, the tiles not started yet are skipped
+//and the frame is left incomplete, see raytracing
+atomic<bool> cancelFrame(false);
+
+//SIMD ray packets, primary rays are traced packetWidth at a time with tracePacket
+//unless packetWidth is 1
+int packetWidth = SupportedPacketWidth();
+TracePacketFunction tracePacket;
+
+//raytracer features, chosen at run time. Rendering is done by variants of RenderPixels
+//specialized for them, see RenderPixelsKernel
+bool antiAliasing = true;
+bool softShadows = true;
+
+//Wavefront shading, the shadow rays of a tile are collected, sorted by direction and origin and
+//traced one after the other instead of each where its sample is shaded, see TraceShadowRays
+bool wavefront = false;
+
+//Number of points the light is sampled at for soft shadows, and their positions, which are
+//computed at the start of every frame
+const int NUM_LIGHT_POINTS = 6;
+vec3 lightPoints[NUM_LIGHT_POINTS];
+
+//Progressive rendering, while the camera and the light stand still every frame adds one
+//jittered sample per pixel, with one of the light points, to accumulation and framebuffer
+//shows the average of the numAccumulated samples so far. Moving the camera or the light
+//starts again, once maxAccumulated samples are reached nothing more is rendered
+bool progressive = false;
+const int maxAccumulated = 1024;
+vector<vec3> accumulation;
+int numAccumulated = 0;
+vec3 accumulatedCameraPos;
+float accumulatedYaw;
+vec3 accumulatedLightPos;
+int accumulatedScene;
+
+//Adaptive antialiasing, every pixel is first rendered with a single sample and only pixels
+//next to an edge get all antiAliasingCells samples. A pixel is next to an edge when the sample
+//of a neighbour hit another triangle or its luminance differs by more than adaptiveThreshold,
+//0 gives every pixel all samples
+float adaptiveThreshold = 0.02;
+vector<float> sampleLuminance;
+
+//G-buffer, the primary intersections of the samples of every pixel are kept between frames so
+//that a frame in which only the light moved shades them again without tracing primary rays.
+//centreHits holds the single sample of adaptive antialiasing for pixel p and gridHits the
+//antialiasing samples p * antiAliasingCells ... (p + 1) * antiAliasingCells - 1. gbufferState
+//tells which of them are filled for every pixel. Everything is dropped when the camera, the
+//image size or the scene changes
+const unsigned char CENTRE_HIT = 1;
+const unsigned char GRID_HITS = 2;
+vector<Intersection> centreHits;
+vector<Intersection> gridHits;
+vector<unsigned char> gbufferState;
+vec3 gbufferCameraPos;
+float gbufferYaw;
+mat3 gbufferCameraRot;
+int gbufferScene = -1;
+
+//Temporal reprojection, when only the camera moved since the last frame the centre sample of a
+//pixel takes its shading from the last frame if the point it hits was seen there on the same
+//triangle, as diffuse lighting is the same from every direction. The point is projected into the
+//camera of the last frame and the shaded centre sample of the pixel it lands on is reused. Every
+//pixel is shaded again at least every reprojectionPeriod frames so that errors do not build up,
+//0 turns reprojection off. Only frames whose pixels start with a centre sample reproject, those of
+//adaptive antialiasing or with a single sample per pixel, not progressive frames or frames that give
+//every pixel several samples. centreRadiance holds the shaded centre samples of the current frame
+//and is complete when radianceValid
+int reprojectionPeriod = 8;
+int frameNumber = 0;
+bool reprojecting = false;
+vector<vec3> centreRadiance;
+bool radianceValid = false;
+vec3 radianceLightPos;
+vector<Intersection> previousHits;
+vector<vec3> previousRadiance;
+vec3 previousCameraPos;
+mat3 previousCameraRot;
+
+//Irradiance caching, when irradianceError is not 0 the indirect light is not the constant
+//indirectLight but traced over the hemispheres of sparse points, kept in irradianceCache and
+//interpolated in between, see IrradianceCache.h. Smaller errors compute more records. The records
+//stay valid until the scene or the light changes. The threads put the records they compute into
+//their own lists in threadIrradianceRecords, which are added to the cache after every pass over
+//the tiles, and a tile only uses the records of the cache and the ones it computed itself
+float irradianceError = 0;
+IrradianceCache irradianceCache;
+vector<vector<IrradianceRecord>> threadIrradianceRecords;
+thread_local vector<IrradianceRecord>* newIrradianceRecords = 0;
+thread_local size_t firstTileRecord = 0;
+int irradianceScene = -1;
+vec3 irradianceLightPos;
+
+//Radius of the irradiance records at least and at most, in pixels at the point of the record in
+//the frame that computes it, divided by irradianceError so that records are used that many pixels
+//around them
+const float MIN_RECORD_PIXELS = 2;
+const float MAX_RECORD_PIXELS = 64;
+
+/* ----------------------------------------------------------------------------*/
+/* FUNCTIONS                                                                   */
+bool ClosestIntersection(vec3 start, vec3 dir, const vector<Object>& objects, Intersection& closestIntersection);
+void BuildObjectsBVH();
+void updateRotationMatrix();
+void ResizeRenderer(int width, int height);
+bool raytracing();
+
+//Prepare the renderer for the current settings, rendering with the threads of pool
+void InitializeRenderer(ThreadPool& pool) {
+	//round the packet width down to a width there is a kernel for
+	packetWidth = packetWidth >= 16 ? 16 : packetWidth >= 8 ? 8 : packetWidth >= 4 ? 4 : 1;
+	tracePacket = PacketKernel(packetWidth);
+
+	//out of core, shadow rays are traced as a stream so that their tests can be deferred
+	if(geometryBudget > 0) {
+		wavefront = true;
+	}
+
+	if(!antiAliasing) {
+		antiAliasingCells = 1;
+	}
+
+	threadPool = &pool;
+	threadStatistics.assign(pool.NumThreads(), Statistics());
+	threadIrradianceRecords.assign(pool.NumThreads(), vector<IrradianceRecord>());
+	irradianceScene = -1;
+
+	updateRotationMatrix();
+	ResizeRenderer(screenWidth, screenHeight);
+}
+
+//Render images of width x height pixels from now on. The field of view stays the same, and
+//everything kept from earlier frames is dropped as it no longer matches the pixels
+void ResizeRenderer(int width, int height) {
+	screenWidth = width;
+	screenHeight = height;
+	focalLength = screenWidth;
+	framebuffer.assign(screenWidth * screenHeight, vec3(0,0,0));
+	if(statisticsEnabled) {
+		costBuffer.assign(screenWidth * screenHeight, 0);
+		objectBuffer.assign(screenWidth * screenHeight, -1);
+	}
+	numAccumulated = 0;
+	sampleLuminance.assign(screenWidth * screenHeight, 0);
+	gbufferScene = -1;
+	radianceValid = false;
+}
+
+//Lets TraverseBVH and AnyHitTraverseBVH go into every node
+struct EnterAll {
+	bool operator()(int node) const {
+		return true;
+	}
+};
+
+//Visit the leaves of a BVH that the ray passes through before maxDistance, nearest child first.
+//The leaf function may lower maxDistance, which prunes the nodes behind it, and returns true
+//to stop the traversal early. Returns true if the traversal was stopped. The traversal starts
+//at node root and skips the nodes the enter function returns false for, see EnterNode
+template<class LeafFunction, class EnterFunction = EnterAll>
+bool TraverseBVH(const BVH& bvh, vec3 start, vec3 invDir, float& maxDistance, LeafFunction leafFunction,
+	EnterFunction enter = EnterAll(), int root = 0) {
+
+	if(bvh.nodes.empty()) {
+		return false;
+	}
+
+	//stack of nodes still to visit together with the distance at which the ray enters them
+	int stack[BVH_STACK_SIZE];
+	float stackDistance[BVH_STACK_SIZE];
+	int stackSize = 0;
+
+	float entry;
+	STATISTICS_COUNT(numRayBoxTests, 1);
+	if(BoxIntersection(start, invDir, bvh.nodes[root].Pmin, bvh.nodes[root].Pmax, maxDistance, entry)) {
+		stack[stackSize] = root;
+		stackDistance[stackSize] = entry;
+		stackSize++;
+	}
+
+	while(stackSize > 0) {
+		stackSize--;
+
+		//skip nodes that are further away than the closest intersection found so far
+		if(stackDistance[stackSize] > maxDistance || !enter(stack[stackSize])) {
+			continue;
+		}
+
+		const BVHNode& node = bvh.nodes[stack[stackSize]];
+		STATISTICS_COUNT(numTraversalSteps, 1);
+
+		if(node.count > 0) {
+			if(leafFunction(node)) {
+				return true;
+			}
+			continue;
+		}
+
+		const BVHNode& left = bvh.nodes[node.first];
+		const BVHNode& right = bvh.nodes[node.first + 1];
+
+		float leftEntry, rightEntry;
+		STATISTICS_COUNT(numRayBoxTests, 2);
+		bool hitLeft = BoxIntersection(start, invDir, left.Pmin, left.Pmax, maxDistance, leftEntry);
+		bool hitRight = BoxIntersection(start, invDir, right.Pmin, right.Pmax, maxDistance, rightEntry);
+
+		if(hitLeft && hitRight) {
+			//push the far child first so that the near child is visited next
+			bool leftFirst = leftEntry <= rightEntry;
+			stack[stackSize] = leftFirst ? node.first + 1 : node.first;
+			stackDistance[stackSize] = leftFirst ? rightEntry : leftEntry;
+			stackSize++;
+			stack[stackSize] = leftFirst ? node.first : node.first + 1;
+			stackDistance[stackSize] = leftFirst ? leftEntry : rightEntry;
+			stackSize++;
+		}
+		else if(hitLeft) {
+			stack[stackSize] = node.first;
+			stackDistance[stackSize] = leftEntry;
+			stackSize++;
+		}
+		else if(hitRight) {
+			stack[stackSize] = node.first + 1;
+			stackDistance[stackSize] = rightEntry;
+			stackSize++;
+		}
+	}
+	return false;
+}
+
+//Visit the leaves of a BVH that the ray passes through before maxDistance, in no particular
+//order, until the leaf function returns true. Returns true if it did. This is all a ray that
+//only has to find any hit needs, so children are neither sorted nor pruned by distance. root and
+//enter are the same as for TraverseBVH
+template<class LeafFunction, class EnterFunction = EnterAll>
+bool AnyHitTraverseBVH(const BVH& bvh, vec3 start, vec3 invDir, float maxDistance, LeafFunction leafFunction,
+	EnterFunction enter = EnterAll(), int root = 0) {
+
+	if(bvh.nodes.empty()) {
+		return false;
+	}
+
+	int stack[BVH_STACK_SIZE];
+	int stackSize = 0;
+
+	float entry;
+	STATISTICS_COUNT(numRayBoxTests, 1);
+	if(BoxIntersection(start, invDir, bvh.nodes[root].Pmin, bvh.nodes[root].Pmax, maxDistance, entry)) {
+		stack[stackSize++] = root;
+	}
+
+	while(stackSize > 0) {
+		int n = stack[--stackSize];
+		if(!enter(n)) {
+			continue;
+		}
+		const BVHNode& node = bvh.nodes[n];
+		STATISTICS_COUNT(numTraversalSteps, 1);
+
+		if(node.count > 0) {
+			if(leafFunction(node)) {
+				return true;
+			}
+			continue;
+		}
+
+		STATISTICS_COUNT(numRayBoxTests, 2);
+		if(BoxIntersection(start, invDir, bvh.nodes[node.first + 1].Pmin, bvh.nodes[node.first + 1].Pmax, maxDistance, entry)) {
+			stack[stackSize++] = node.first + 1;
+		}
+		if(BoxIntersection(start, invDir, bvh.nodes[node.first].Pmin, bvh.nodes[node.first].Pmax, maxDistance, entry)) {
+			stack[stackSize++] = node.first;
+		}
+	}
+	return false;
+}
+
+//Load a scene into objects and build the hierarchy over them. The scene is the Cornell Box, one
+//of the generated scenes of spheres or the room of the Cornell Box with an OBJ or PLY mesh standing
+//on its floor. Returns false and puts the reason in error if the scene cannot be loaded. Out of
+//core the scene is always rendered from the cache, which is written first if it has to be
+bool LoadScene(const string& name, string& error) {
+	//drop everything that refers to the previous cache before it is unmapped
+	pager.Clear();
+	objects.clear();
+	objectsBVH = BVH();
+	sceneVersion++;
+
+	bool outOfCore = geometryBudget > 0;
+	if(outOfCore && sceneCacheFile.empty()) {
+		error = "out-of-core rendering needs a scene cache";
+		return false;
+	}
+
+	string key = SceneCacheKey(name) + (compactMeshes ? " compact" : "") + (outOfCore ? " paged " + to_string(MESH_PAGE_TRIANGLES) : "");
+	if(!sceneCacheFile.empty()) {
+		string cacheError;
+		if(LoadSceneCache(sceneCacheFile, key, sceneCache, objects, objectsBVH, *threadPool, cacheError, outOfCore)) {
+			if(outOfCore)
+				pager.Attach(objects, geometryBudget);
+			return true;
+		}
+		if(!cacheError.empty())
+			cout << "Not using scene cache " << sceneCacheFile << ": " << cacheError << "." << endl;
+	}
+
+	if(name == "cornell") {
+		LoadTestModelO(objects);
+	}
+	else if(name == "spheres") {
+		LoadSphereScene(objects, 4, 16);
+	}
+	else if(name == "spheres-large") {
+		LoadSphereScene(objects, 8, 32);
+	}
+	else {
+		vector<Triangle> room;
+		RoomTriangles(room);
+		objects.push_back(Object(room));
+
+		vector<Triangle> mesh;
+		if(!LoadMesh(name, mesh, white, *threadPool, error)) {
+			error = name + ": " + error;
+			return false;
+		}
+		if(mesh.empty()) {
+			error = name + ": no triangles";
+			return false;
+		}
+		FitTriangles(mesh, vec3(-0.8,-0.6,-0.8), vec3(0.8,1,0.8));
+		objects.push_back(Object(mesh));
+	}
+
+	if(compactMeshes) {
+		for(unsigned int j = 0; j < objects.size(); j++) {
+			objects[j].mesh->Compact(*threadPool);
+			objects[j].UpdateBoundingBox();
+		}
+	}
+	if(outOfCore) {
+		vector<const Mesh*> laidOut;
+		for(unsigned int j = 0; j < objects.size(); j++) {
+			Mesh* mesh = objects[j].mesh.get();
+			if(find(laidOut.begin(), laidOut.end(), mesh) == laidOut.end()) {
+				LayoutMeshPages(*mesh, MESH_PAGE_TRIANGLES);
+				laidOut.push_back(mesh);
+			}
+		}
+	}
+	BuildObjectsBVH();
+
+	if(!sceneCacheFile.empty()) {
+		string cacheError;
+		if(!WriteSceneCache(sceneCacheFile, key, objects, objectsBVH, *threadPool, cacheError, outOfCore)) {
+			if(outOfCore) {
+				objects.clear();
+				objectsBVH = BVH();
+				error = cacheError;
+				return false;
+			}
+			cout << "Warning: " << cacheError << "." << endl;
+		}
+		else if(outOfCore) {
+			//out of core the meshes are emptied as they are written, and the scene just built is
+			//dropped for the one in the cache
+			objects.clear();
+			objectsBVH = BVH();
+			if(!LoadSceneCache(sceneCacheFile, key, sceneCache, objects, objectsBVH, *threadPool, cacheError, true)) {
+				error = sceneCacheFile + ": " + cacheError;
+				return false;
+			}
+			pager.Attach(objects, geometryBudget);
+		}
+	}
+	return true;
+}
+
+//Memory taken by the meshes of the scene, counting every shared mesh once
+size_t SceneMemoryUsage() {
+	vector<const Mesh*> counted;
+	size_t bytes = 0;
+	for(unsigned int j = 0; j < objects.size(); j++) {
+		const Mesh* mesh = objects[j].mesh.get();
+		if(find(counted.begin(), counted.end(), mesh) != counted.end())
+			continue;
+		counted.push_back(mesh);
+		bytes += mesh->MemoryUsage();
+	}
+	return bytes;
+}
+
+//Build the top level BVH over the bounding boxes of the objects
+void BuildObjectsBVH() {
+	vector<vec3> boxMin(objects.size());
+	vector<vec3> boxMax(objects.size());
+	for(unsigned int j = 0; j < objects.size(); j++) {
+		boxMin[j] = objects[j].Pmin;
+		boxMax[j] = objects[j].Pmax;
+	}
+	objectsBVH.Build(boxMin, boxMax);
+}
+
+//Builder of the hierarchies of objects whose triangles move relative to each other, which keeps
+//its memory from frame to frame
+LBVHBuilder lbvhBuilder;
+
+//Update the top level hierarchy after objects moved and make the next frame start afresh
+void SceneChanged() {
+	BuildObjectsBVH();
+	sceneVersion++;
+}
+
+//Move object j by transform. An instance is only placed again, the mesh of any other object is
+//no longer paged, copied out of the scene cache, which is mapped read only, and moved. With rebuild
+//the hierarchy of the mesh is built again by the linear builder, otherwise only its bounds are
+//refitted, which is faster but gives a worse hierarchy when the triangles do not move together
+void TransformObject(int j, const mat4& transform, bool rebuild) {
+	Object& object = objects[j];
+	if(object.instanced) {
+		object.Place(transform * object.transform);
+	}
+	else {
+		pager.Detach(*object.mesh);
+		object.mesh->Own();
+		object.mesh->Transform(transform, *threadPool);
+		if(rebuild) {
+			object.mesh->RebuildBVH(lbvhBuilder, *threadPool);
+		}
+		else {
+			object.mesh->Refit(*threadPool);
+		}
+		object.UpdateBoundingBox();
+	}
+	SceneChanged();
+}
+
+//Whether a ray may go into node n of the hierarchy of the mesh of object j. When n is the root of
+//a treelet of a paged mesh, page is set to its page. If the page is not resident, the test of the
+//treelet is deferred when the thread defers tests, see TraceDeferredPrimaryRays, otherwise the
+//page is loaded first
+bool EnterNode(const Mesh& mesh, int j, int n, int& page) {
+	if(mesh.firstPage < 0 || n >= (int) mesh.rootPage.size() || mesh.rootPage[n] < 0) {
+		return true;
+	}
+
+	page = mesh.firstPage + mesh.rootPage[n];
+	if(pager.Resident(page)) {
+		pager.Use(page);
+		return true;
+	}
+	if(deferredTests) {
+		DeferredTest test = {deferredRay, j, n, page};
+		deferredTests->push_back(test);
+		statistics->numDeferredTests++;
+		return false;
+	}
+	if(pager.Load(page)) {
+		statistics->numPageLoads++;
+	}
+	return true;
+}
+
+//Find the closest intersection of a ray with the triangles of object j below node root of its
+//hierarchy that is closer than closestIntersection, and put it there. dir must be normalized
+bool ObjectClosestIntersection(int j, vec3 start, vec3 dir, vec3 invDir, int root, Intersection& closestIntersection) {
+	const Object& object = objects[j];
+	const Mesh& mesh = *object.mesh;
+	bool intersection = false;
+	float& closestDistance = closestIntersection.distance;
+
+	//instances are traced in the coordinates of their mesh
+	vec3 objectStart = start;
+	vec3 objectDir = dir;
+	vec3 objectInvDir = invDir;
+	if(object.instanced) {
+		object.RayToObject(objectStart, objectDir);
+		objectInvDir = InverseDirection(objectDir);
+	}
+
+	//the bottom level hierarchy gives the triangles of the object
+	int page = -1;
+	auto enter = [&](int n) {
+		return EnterNode(mesh, j, n, page);
+	};
+	TraverseBVH(mesh.bvh, objectStart, objectInvDir, closestDistance, [&](const BVHNode& leaf) {
+		if(mesh.compact) {
+			STATISTICS_COUNT(numRayTrianglesTests, leaf.count);
+
+			//the triangles of the leaf are decoded from the faces and vertices of the mesh
+			float t, u, v;
+			long numHits = 0;
+			int lane = compactIntersection(mesh.CompactLeaf(leaf), leaf.count, objectStart, objectDir, closestDistance, epsilon, t, u, v, numHits);
+			STATISTICS_COUNT(numRayTrianglesIntersections, numHits);
+
+			if(lane >= 0) {
+				intersection = true;
+				int triangleIndex = mesh.bvh.indices[leaf.first + lane];
+				closestIntersection.position = object.PointToWorld(mesh.Point(triangleIndex, u, v));
+				closestIntersection.distance = t;
+				closestIntersection.objectIndex = j;
+				closestIntersection.triangleIndex = triangleIndex;
+			}
+			return false;
+		}
+
+		int firstBlock = mesh.store.leafBlock[&leaf - &mesh.bvh.nodes[0]];
+		for(int b = 0; b * TRIANGLE_BLOCK_SIZE < leaf.count; b++) {
+			const TriangleBlock& block = mesh.store.blocks[firstBlock + b];
+			int count = min(leaf.count - b * TRIANGLE_BLOCK_SIZE, TRIANGLE_BLOCK_SIZE);
+
+			//increment the variable counting the number of triangle ray intersection tests
+			STATISTICS_COUNT(numRayTrianglesTests, count);
+
+			//find the closest triangle of the block that is closer than the current closest intersection
+			float t, u, v;
+			long numHits = 0;
+			int lane = blockIntersection(block, count, objectStart, objectDir, closestDistance, epsilon, t, u, v, numHits);
+			STATISTICS_COUNT(numRayTrianglesIntersections, numHits);
+
+			if(lane >= 0) {
+				//set intersection flag to true
+				intersection = true;
+				//update closestIntersection flag
+				vec3 v0(block.v0x[lane], block.v0y[lane], block.v0z[lane]);
+				vec3 e1(block.e1x[lane], block.e1y[lane], block.e1z[lane]);
+				vec3 e2(block.e2x[lane], block.e2y[lane], block.e2z[lane]);
+				closestIntersection.position = object.PointToWorld(v0 + u * e1 + v * e2);
+				closestIntersection.distance = t;
+				closestIntersection.objectIndex = j;
+				closestIntersection.triangleIndex = block.triangleIndex[lane];
+			}
+		}
+		return false;
+	}, enter, root);
+
+	return intersection;
+}
+
+//Find the closest intersection of a ray with the objects of the scene that is closer than
+//closestIntersection, and put it there
+bool SceneClosestIntersection(vec3 start, vec3 dir, Intersection& closestIntersection) {
+	//bool stating whether or not this ray intersects a triangle
+	bool intersection = false;
+
+	//make sure that the direction vector is normalized
+	dir = normalize(dir);
+	vec3 invDir = InverseDirection(dir);
+
+	//the top level hierarchy gives the objects in front to back order
+	TraverseBVH(objectsBVH, start, invDir, closestIntersection.distance, [&](const BVHNode& objectLeaf) {
+		for(int k = objectLeaf.first; k < objectLeaf.first + objectLeaf.count; k++) {
+			if(ObjectClosestIntersection(objectsBVH.indices[k], start, dir, invDir, 0, closestIntersection)) {
+				intersection = true;
+			}
+		}
+		return false;
+	});
+
+	//return flag indicating whether ray intersects with any triangles
+	return intersection;
+}
+
+bool ClosestIntersection(vec3 start, vec3 dir, const vector<Object>& objects, Intersection& closestIntersection) {
+
+	//Increment the variable holding the total number of primary rays
+	statistics->numPrimaryRays++;
+
+	return SceneClosestIntersection(start, dir, closestIntersection);
+}
+
+//Whether any triangle of object j below node root of its hierarchy lies on the ray before
+//maxDistance. dir must be normalized. The block of the triangle found is put in the occluder cache
+bool ObjectInShadow(int j, vec3 start, vec3 dir, vec3 invDir, float maxDistance, int root) {
+	const Object& object = objects[j];
+	const Mesh& mesh = *object.mesh;
+	Occluder& cached = lastOccluder;
+
+	vec3 objectStart = start;
+	vec3 objectDir = dir;
+	vec3 objectInvDir = invDir;
+	if(object.instanced) {
+		object.RayToObject(objectStart, objectDir);
+		objectInvDir = InverseDirection(objectDir);
+	}
+
+	int page = -1;
+	auto enter = [&](int n) {
+		return EnterNode(mesh, j, n, page);
+	};
+	return AnyHitTraverseBVH(mesh.bvh, objectStart, objectInvDir, maxDistance, [&](const BVHNode& leaf) {
+		if(mesh.compact) {
+			STATISTICS_COUNT(numRayTrianglesTests, leaf.count);
+			if(compactOcclusion(mesh.CompactLeaf(leaf), leaf.count, objectStart, objectDir, maxDistance, epsilon) >= 0) {
+				STATISTICS_COUNT(numRayTrianglesIntersections, 1);
+				cached.objectIndex = j;
+				cached.block = &leaf - &mesh.bvh.nodes[0];
+				cached.count = leaf.count;
+				cached.page = page;
+				cached.scene = sceneVersion;
+				return true;
+			}
+			return false;
+		}
+
+		int firstBlock = mesh.store.leafBlock[&leaf - &mesh.bvh.nodes[0]];
+		for(int b = 0; b * TRIANGLE_BLOCK_SIZE < leaf.count; b++) {
+			int count = min(leaf.count - b * TRIANGLE_BLOCK_SIZE, TRIANGLE_BLOCK_SIZE);
+			STATISTICS_COUNT(numRayTrianglesTests, count);
+
+			if(blockOcclusion(mesh.store.blocks[firstBlock + b], count, objectStart, objectDir, maxDistance, epsilon) >= 0) {
+				STATISTICS_COUNT(numRayTrianglesIntersections, 1);
+				cached.objectIndex = j;
+				cached.block = firstBlock + b;
+				cached.count = count;
+				cached.page = page;
+				cached.scene = sceneVersion;
+				return true;
+			}
+		}
+		return false;
+	}, enter, root);
+}
+
+//Whether the block of the occluder cache exists in the meshes of objects. In a compact mesh it has
+//to be a leaf of at least as many triangles as were tested in it
+bool OccluderValid(const Occluder& cached, const vector<Object>& objects) {
+	if(cached.objectIndex >= (int) objects.size()) {
+		return false;
+	}
+	const Mesh& mesh = *objects[cached.objectIndex].mesh;
+	if(mesh.compact) {
+		return cached.block < (int) mesh.bvh.nodes.size() && mesh.bvh.nodes[cached.block].count > 0 &&
+			cached.count <= mesh.bvh.nodes[cached.block].count;
+	}
+	return cached.block < (int) mesh.store.blocks.size();
+}
+
+//Whether a triangle lies between start and the light source radius away in direction dir. If the
+//last shadow ray of the thread was blocked, the block of the triangle that blocked it is tested
+//first, then the hierarchy is traversed until any triangle is found
+bool PointInShadow(vec3 start, vec3 dir, const vector<Object>& objects, float radius) {
+
+	//Increment the variable holding the total number of shadow rays
+	statistics->numShadowRays++;
+
+	//make sure that the direction vector is normalized
+	dir = normalize(dir);
+
+	//any triangle closer than the light source blocks it
+	float maxDistance = radius + epsilon;
+
+	//the cached block is only tested in the scene it was found in, and the block of a paged mesh
+	//only while its page is resident
+	Occluder& cached = lastOccluder;
+	if(cached.objectIndex >= 0 && cached.scene == sceneVersion && OccluderValid(cached, objects) &&
+		(cached.page < 0 || (cached.page < pager.NumPages() && pager.Resident(cached.page)))) {
+		STATISTICS_COUNT(numRayTrianglesTests, cached.count);
+		const Object& object = objects[cached.objectIndex];
+		const Mesh& mesh = *object.mesh;
+		vec3 objectStart = start;
+		vec3 objectDir = dir;
+		object.RayToObject(objectStart, objectDir);
+		bool blocked = mesh.compact ?
+			compactOcclusion(mesh.CompactLeaf(mesh.bvh.nodes[cached.block]), cached.count, objectStart, objectDir, maxDistance, epsilon) >= 0 :
+			blockOcclusion(mesh.store.blocks[cached.block], cached.count, objectStart, objectDir, maxDistance, epsilon) >= 0;
+		if(blocked) {
+			STATISTICS_COUNT(numRayTrianglesIntersections, 1);
+			STATISTICS_COUNT(numOccluderCacheHits, 1);
+			return true;
+		}
+	}
+
+	vec3 invDir = InverseDirection(dir);
+
+	//forget the cached block when the ray is not blocked, so that lit surfaces do not test it
+	cached.objectIndex = -1;
+
+	return AnyHitTraverseBVH(objectsBVH, start, invDir, maxDistance, [&](const BVHNode& objectLeaf) {
+		for(int k = objectLeaf.first; k < objectLeaf.first + objectLeaf.count; k++) {
+			if(ObjectInShadow(objectsBVH.indices[k], start, dir, invDir, maxDistance, 0)) {
+				return true;
+			}
+		}
+		return false;
+	});
+}
+
+
+void updateRotationMatrix() {
+	//Calcuate new columns for the camera's rotation matrix
+	cameraRot[0] = vec3(cos(yaw), 0, -sin(yaw));
+	cameraRot[2] = vec3(sin(yaw), 0, cos(yaw));
+}
+
+//Calculate the Euclidean distance between the two given vectors
+float distanceBetweenPoints(vec3 a, vec3 b) {
+	return sqrt(pow(a.x - b.x, 2) + pow(a.y - b.y, 2) + pow(a.z - b.z, 2));
+}
+
+//Caluclate the dot product between the two given vectors
+float dotProduct(vec3 a, vec3 b) {
+	return a.x * b.x + a.y * b.y + a.z * b.z;
+}
+
+//Calculate the normalised direction vector from the given vector to the lightsource
+vec3 unitVectorToLightSource(vec3 a) {
+	vec3 v(lightPos.x - a.x, lightPos.y - a.y, lightPos.z - a.z);
+	return normalize(v);
+}
+
+//Output the illumination of the point in the intersection by a light source at lightPoint if
+//nothing lies in between. The unit vector towards the light source is put in r and the distance
+//to it in radius
+vec3 UnoccludedLight(const Intersection& i, vec3 lightPoint, vec3& r, float& radius) {
+
+	//distance from intersection point to light source
+	radius = length(i.position - lightPoint);
+
+	//r is the unit vector describing direction from surface point to light source
+	vec3 v(lightPoint.x - i.position.x, lightPoint.y - i.position.y, lightPoint.z - i.position.z);
+	r = normalize(v);
+
+	//The power per area at this point
+	vec3 B = lightColor / (4 * PI * (float) pow(radius,3));
+
+	//unit vector describing normal of surface
+	vec3 n = objects[i.objectIndex].Normal(i.triangleIndex);
+
+	//fraction of the power per area depending on surface's angle from light source
+	return B * max(dot(r,n),0.0f);
+}
+
+//Output the illumination of the point in the intersection by a light source at lightPoint
+vec3 LightFromPoint(const Intersection& i, vec3 lightPoint) {
+	vec3 r;
+	float radius;
+	vec3 light = UnoccludedLight(i, lightPoint, r, radius);
+
+	//trace ray from intersection point to lightsource, if intersection distance is less than distance to light
+	//source then give give this point no direct illumination. This creates shadow effect
+	if(PointInShadow(i.position, r, objects, radius)) {
+		return vec3(0,0,0);
+	}
+	return light;
+}
+
+//Output the radiance arriving at a point from direction dir, the light the surface it comes from
+//reflects from the centre of the light. The distance of the surface is put in distance, or the
+//largest float if there is none
+vec3 IndirectSample(vec3 start, vec3 dir, float& distance) {
+	statistics->numIndirectRays++;
+
+	Intersection hit;
+	hit.distance = std::numeric_limits<float>::max();
+	hit.objectIndex = -1;
+	if(!SceneClosestIntersection(start, dir, hit)) {
+		distance = std::numeric_limits<float>::max();
+		return vec3(0,0,0);
+	}
+	distance = hit.distance;
+	return objects[hit.objectIndex].mesh->Color(hit.triangleIndex) * LightFromPoint(hit, lightPos);
+}
+
+//Output the indirect illumination of the point in the intersection, a primary intersection of the
+//camera. It is interpolated from the records of the irradiance cache, and of the tile, that cover
+//the point, and a new record is computed for the point when none does
+vec3 IndirectLight(const Intersection& i) {
+	if(irradianceError <= 0) {
+		return indirectLight;
+	}
+
+	//the side of the surface the camera sees
+	vec3 n = objects[i.objectIndex].Normal(i.triangleIndex);
+	if(dot(n, i.position - cameraPos) > 0) {
+		n = -n;
+	}
+
+	vec3 sum(0,0,0);
+	float weight = 0;
+	irradianceCache.Gather(i.position, n, sum, weight);
+	vector<IrradianceRecord>& records = *newIrradianceRecords;
+	for(size_t k = firstTileRecord; k < records.size(); k++) {
+		GatherIrradianceRecord(records[k], i.position, n, irradianceError, sum, weight);
+	}
+	if(weight > 0) {
+		return sum / weight;
+	}
+
+	float pixelRadius = i.distance / focalLength / irradianceError;
+	vec3 start = i.position;
+	records.push_back(ComputeIrradianceRecord(start, n, MIN_RECORD_PIXELS * pixelRadius, MAX_RECORD_PIXELS * pixelRadius,
+		[&](vec3 dir, float& distance) {
+		return IndirectSample(start, dir, distance);
+	}));
+	statistics->numIrradianceRecords++;
+	return records.back().irradiance;
+}
+
+//Position of light point j of the soft shadows, the light points lying on the three axes
+//lightRadius away from the centre of the light on either side
+vec3 LightPoint(int j) {
+	vec3 offset(0,0,0);
+	offset[j / 2] = j % 2 == 0 ? lightRadius : -lightRadius;
+	return lightPos + offset;
+}
+
+//Output the illumination of the point in the intersection by only the light point with the
+//given index, which over all indices averages to DirectLight
+template<bool SoftShadows>
+vec3 DirectLightSample(const Intersection& i, unsigned int index) {
+	if(!SoftShadows) {
+		return LightFromPoint(i, lightPos);
+	}
+	return LightFromPoint(i, lightPoints[index % NUM_LIGHT_POINTS]);
+}
+
+//Output the illumination of the point in the intersection, by the NUM_LIGHT_POINTS points of
+//the light with soft shadows and by the centre of the light without
+template<bool SoftShadows>
+vec3 DirectLight(const Intersection& i) {
+	if(!SoftShadows) {
+		return LightFromPoint(i, lightPos);
+	}
+
+	vec3 D(0,0,0);
+	const float fraction = 1.0f / (float) NUM_LIGHT_POINTS;
+	for(int j = 0; j < NUM_LIGHT_POINTS; j++) {
+		D += fraction * LightFromPoint(i, lightPoints[j]);
+	}
+	return D;
+}
+
+//Shadow ray of the wavefront shading, towards a light point from the point seen by pixel p of
+//RenderPixels, and the light it brings to the pixel unless it is blocked
+struct ShadowRay
+{
+	vec3 start;
+	vec3 dir;
+	float radius;
+	vec3 light;
+	int p;
+};
+
+//Add the shadow ray of the intersection towards lightPoint to rays, weight being the share of
+//the light point in the color of pixel p. Rays that would bring no light are left out
+void QueueShadowRay(const Intersection& i, vec3 lightPoint, vec3 weight, int p, ShadowRay* rays, int& numRays) {
+	ShadowRay& ray = rays[numRays];
+	ray.light = weight * UnoccludedLight(i, lightPoint, ray.dir, ray.radius);
+	if(ray.light == vec3(0,0,0)) {
+		return;
+	}
+	ray.start = i.position;
+	ray.p = p;
+	numRays++;
+}
+
+//Wavefront version of DirectLight, or of DirectLightSample with the given index when sampled, which
+//queues the shadow rays of the light points instead of tracing them
+template<bool SoftShadows>
+void QueueDirectLight(const Intersection& i, bool sampled, unsigned int index, vec3 weight, int p, ShadowRay* rays, int& numRays) {
+	if(!SoftShadows) {
+		QueueShadowRay(i, lightPos, weight, p, rays, numRays);
+	}
+	else if(sampled) {
+		QueueShadowRay(i, lightPoints[index % NUM_LIGHT_POINTS], weight, p, rays, numRays);
+	}
+	else {
+		const float fraction = 1.0f / (float) NUM_LIGHT_POINTS;
+		for(int j = 0; j < NUM_LIGHT_POINTS; j++) {
+			QueueShadowRay(i, lightPoints[j], fraction * weight, p, rays, numRays);
+		}
+	}
+}
+
+//Spread the lowest 4 bits of x out to every third bit
+uint32_t SpreadBits(uint32_t x) {
+	x &= 0xF;
+	x = (x | x << 4) & 0x0C3;
+	x = (x | x << 2) & 0x249;
+	return x;
+}
+
+//Trace the tests the shadow rays deferred while their pages were not resident, page by page,
+//and mark the rays found to be blocked in blocked
+void TraceDeferredShadowRays(const ShadowRay* rays, bool* blocked, float* cost) {
+	vector<DeferredTest>& tests = *deferredTests;
+	deferredTests = 0;
+	sort(tests.begin(), tests.end(), [](const DeferredTest& a, const DeferredTest& b) {
+		return a.page < b.page || (a.page == b.page && a.ray < b.ray);
+	});
+
+	for(size_t k = 0; k < tests.size(); k++) {
+		const DeferredTest& test = tests[k];
+		if(k == 0 || test.page != tests[k - 1].page) {
+			if(pager.Load(test.page)) {
+				statistics->numPageLoads++;
+			}
+		}
+		if(blocked[test.ray]) {
+			continue;
+		}
+
+		const ShadowRay& ray = rays[test.ray];
+		long work = StatisticsWork(*statistics);
+		vec3 dir = normalize(ray.dir);
+		blocked[test.ray] = ObjectInShadow(test.objectIndex, ray.start, dir, InverseDirection(dir), ray.radius + epsilon, test.node);
+		if(statisticsEnabled) {
+			cost[ray.p] += StatisticsWork(*statistics) - work;
+		}
+	}
+	tests.clear();
+}
+
+//Trace the shadow rays of a tile and add the light of the rays that are not blocked to the
+//radiance of their pixels, and their cost to cost. The rays are traced sorted by the octant of
+//their direction and then by the Morton code of their start within the bounds of all starts, so
+//that rays that follow each other take similar paths through the hierarchies and find the
+//occluder cache of the thread still valid
+void TraceShadowRays(const ShadowRay* rays, int numRays, vec3* radiance, float* cost) {
+	if(numRays == 0) {
+		return;
+	}
+
+	vec3 low = rays[0].start;
+	vec3 high = rays[0].start;
+	for(int k = 1; k < numRays; k++) {
+		low = min(low, rays[k].start);
+		high = max(high, rays[k].start);
+	}
+	vec3 scale = 15.0f / max(high - low, vec3(1e-6f));
+
+	//the sort key is made of 3 bits of octant and 12 of Morton code
+	uint16_t* keys = arena.Allocate<uint16_t>(numRays);
+	for(int k = 0; k < numRays; k++) {
+		const ShadowRay& ray = rays[k];
+		uint32_t octant = (ray.dir.x < 0 ? 4 : 0) | (ray.dir.y < 0 ? 2 : 0) | (ray.dir.z < 0 ? 1 : 0);
+		vec3 q = (ray.start - low) * scale;
+		uint32_t morton = SpreadBits((uint32_t) q.x) << 2 | SpreadBits((uint32_t) q.y) << 1 | SpreadBits((uint32_t) q.z);
+		keys[k] = octant << 12 | morton;
+	}
+
+	//radix sort of the rays by the bytes of their keys, rays with equal keys stay in the order
+	//they were queued in
+	int* order = arena.Allocate<int>(numRays);
+	int* sorted = arena.Allocate<int>(numRays);
+	for(int k = 0; k < numRays; k++) {
+		order[k] = k;
+	}
+	for(int shift = 0; shift < 16; shift += 8) {
+		int start[257] = {0};
+		for(int k = 0; k < numRays; k++) {
+			start[((keys[k] >> shift) & 0xFF) + 1]++;
+		}
+		for(int b = 0; b < 256; b++) {
+			start[b + 1] += start[b];
+		}
+		for(int k = 0; k < numRays; k++) {
+			sorted[start[(keys[order[k]] >> shift) & 0xFF]++] = order[k];
+		}
+		swap(order, sorted);
+	}
+
+	//out of core, the rays are only known to be unblocked once their deferred tests are done
+	bool* blocked = arena.Allocate<bool>(numRays);
+	if(geometryBudget > 0) {
+		deferredTests = &threadDeferredTests;
+	}
+
+	for(int k = 0; k < numRays; k++) {
+		const ShadowRay& ray = rays[order[k]];
+		long work = StatisticsWork(*statistics);
+		deferredRay = order[k];
+		blocked[order[k]] = PointInShadow(ray.start, ray.dir, objects, ray.radius);
+		if(!blocked[order[k]] && !deferredTests) {
+			radiance[ray.p] += ray.light;
+		}
+		if(statisticsEnabled) {
+			cost[ray.p] += StatisticsWork(*statistics) - work;
+		}
+	}
+
+	if(deferredTests) {
+		TraceDeferredShadowRays(rays, blocked, cost);
+		for(int k = 0; k < numRays; k++) {
+			if(!blocked[order[k]]) {
+				radiance[rays[order[k]].p] += rays[order[k]].light;
+			}
+		}
+	}
+}
+
+//Square root of a square number, at compile time
+constexpr int SquareRoot(int n) {
+	int r = 0;
+	while((r + 1) * (r + 1) <= n) {
+		r++;
+	}
+	return r;
+}
+
+//Directions of the n antialiasing samples of the pixel at x, y relative to the centre of the
+//screen. N is n for the sample counts RenderPixels is specialized for and 0 for the others
+template<int N>
+void getArrayOfDirectionVectors(float x, float y, int n, vec3 dir[]) {
+
+	const int rowLength = N > 0 ? SquareRoot(N) : (int) sqrt(n);
+
+	float cellLength = 1/(float) rowLength;
+	int k = 0;
+
+	for(int i = 0; i < rowLength; i++) {
+		for(int j = 0; j < rowLength; j++) {
+
+			//For now not using any randomness
+			float newX = (x - ((i-1) * cellLength));
+			float newY = (y - ((j-1) * cellLength));
+
+			dir[k] = normalize(vec3(newX, newY, focalLength));
+			dir[k] = cameraRot * dir[k];
+			k++;
+		}
+	}
+}
+
+//Scramble the pixel coordinates, so that neighbouring pixels take their progressive samples
+//at unrelated positions
+unsigned int PixelHash(int x, int y) {
+	unsigned int h = (unsigned int) x * 0x8da6b343u ^ (unsigned int) y * 0xd8163841u;
+	h ^= h >> 16;
+	h *= 0x7feb352du;
+	h ^= h >> 15;
+	h *= 0x846ca68bu;
+	h ^= h >> 16;
+	return h;
+}
+
+//Position in [0,1) x [0,1) of progressive sample n of the pixel, from the R2 low discrepancy
+//sequence shifted by the hash of the pixel
+void SampleJitter(unsigned int hash, int n, float& jx, float& jy) {
+	float shiftX = (hash & 0xffff) / 65536.0f;
+	float shiftY = (hash >> 16) / 65536.0f;
+	jx = fmod(shiftX + 0.7548777f * n, 1.0f);
+	jy = fmod(shiftY + 0.5698403f * n, 1.0f);
+}
+
+//Trace the tests the primary rays deferred while their pages were not resident, page by page, into
+//the closest intersections in hits
+void TraceDeferredPrimaryRays(const vec3* dirs, Intersection* hits, float* cost) {
+	vector<DeferredTest>& tests = *deferredTests;
+	deferredTests = 0;
+	sort(tests.begin(), tests.end(), [](const DeferredTest& a, const DeferredTest& b) {
+		return a.page < b.page || (a.page == b.page && a.ray < b.ray);
+	});
+
+	for(size_t k = 0; k < tests.size(); k++) {
+		const DeferredTest& test = tests[k];
+		if(k == 0 || test.page != tests[k - 1].page) {
+			if(pager.Load(test.page)) {
+				statistics->numPageLoads++;
+			}
+		}
+
+		long work = StatisticsWork(*statistics);
+		vec3 dir = normalize(dirs[test.ray]);
+		ObjectClosestIntersection(test.objectIndex, cameraPos, dir, InverseDirection(dir), test.node, hits[test.ray]);
+		if(statisticsEnabled) {
+			cost[test.ray] += StatisticsWork(*statistics) - work;
+		}
+	}
+	tests.clear();
+}
+
+//Find the closest intersections of n rays starting at the camera. Coherent groups of rays
+//are traced as packets, the others one by one. When the statistics are enabled the work
+//done for every ray is put in cost, the work of a packet being shared out between its rays
+void TracePrimaryRays(const vec3* dirs, int n, Intersection* hits, float* cost) {
+	//out of core, the rays are traced one by one and their deferred tests once they are done
+	if(geometryBudget > 0) {
+		deferredTests = &threadDeferredTests;
+	}
+
+	for(int first = 0; first < n; first += max(packetWidth, 1)) {
+		RayPacket packet;
+		packet.width = min(packetWidth, n - first);
+
+		for(int i = 0; i < packet.width; i++) {
+			vec3 dir = normalize(dirs[first + i]);
+			packet.startX[i] = cameraPos.x;
+			packet.startY[i] = cameraPos.y;
+			packet.startZ[i] = cameraPos.z;
+			packet.dirX[i] = dir.x;
+			packet.dirY[i] = dir.y;
+			packet.dirZ[i] = dir.z;
+			packet.distance[i] = std::numeric_limits<float>::max();
+		}
+
+		if(packet.width < 2 || deferredTests || !PacketIsCoherent(packet)) {
+			//fall back to tracing the rays one by one
+			for(int i = first; i < first + packet.width; i++) {
+				long work = StatisticsWork(*statistics);
+				deferredRay = i;
+				hits[i].distance = std::numeric_limits<float>::max();
+				hits[i].objectIndex = -1;
+				ClosestIntersection(cameraPos, dirs[i], objects, hits[i]);
+				if(statisticsEnabled) {
+					cost[i] = StatisticsWork(*statistics) - work;
+				}
+			}
+			continue;
+		}
+
+		packet.numTraversalSteps = 0;
+		packet.numRayBoxTests = 0;
+		packet.numRayTrianglesTests = 0;
+		packet.numRayTrianglesIntersections = 0;
+		tracePacket(packet, objects, objectsBVH, epsilon);
+
+		statistics->numPrimaryRays += packet.width;
+		STATISTICS_COUNT(numTraversalSteps, packet.numTraversalSteps);
+		STATISTICS_COUNT(numRayBoxTests, packet.numRayBoxTests);
+		STATISTICS_COUNT(numRayTrianglesTests, packet.numRayTrianglesTests);
+		STATISTICS_COUNT(numRayTrianglesIntersections, packet.numRayTrianglesIntersections);
+		if(statisticsEnabled) {
+			for(int i = first; i < first + packet.width; i++) {
+				cost[i] = (float) (packet.numRayBoxTests + packet.numRayTrianglesTests) / packet.width;
+			}
+		}
+
+		for(int i = 0; i < packet.width; i++) {
+			Intersection& hit = hits[first + i];
+			hit.distance = packet.distance[i];
+			hit.objectIndex = packet.objectIndex[i];
+			hit.triangleIndex = packet.triangleIndex[i];
+			if(hit.objectIndex >= 0) {
+				const Object& object = objects[hit.objectIndex];
+				hit.position = object.PointToWorld(object.mesh->Point(hit.triangleIndex, packet.u[i], packet.v[i]));
+			}
+		}
+	}
+
+	if(deferredTests) {
+		TraceDeferredPrimaryRays(dirs, hits, cost);
+	}
+}
+
+float Luminance(vec3 color) {
+	return 0.2126f * color.r + 0.7152f * color.g + 0.0722f * color.b;
+}
+
+//Find the shading of the last frame for the point of a centre sample, centre being the offset of
+//centre samples in their pixel. Returns false if the last frame did not see the point, otherwise
+//puts the shading in radiance
+bool Reproject(const Intersection& hit, float centre, vec3& radiance) {
+	//position of the point relative to the camera of the last frame
+	vec3 p = transpose(previousCameraRot) * (hit.position - previousCameraPos);
+	if(p.z <= 0) {
+		return false;
+	}
+
+	//the pixel whose centre sample is closest to the point
+	int x = (int) floor(p.x / p.z * focalLength + screenWidth / 2.0f - centre + 0.5f);
+	int y = (int) floor(p.y / p.z * focalLength + screenHeight / 2.0f - centre + 0.5f);
+	if(x < 0 || y < 0 || x >= screenWidth || y >= screenHeight) {
+		return false;
+	}
+
+	//its sample has to have hit the same triangle close to the point, or the point was hidden
+	//behind something else
+	const Intersection& previous = previousHits[y * screenWidth + x];
+	float pixelSize = p.z / focalLength;
+	if(previous.objectIndex != hit.objectIndex || previous.triangleIndex != hit.triangleIndex ||
+		length(previous.position - hit.position) > 2 * pixelSize) {
+		return false;
+	}
+	radiance = previousRadiance[y * screenWidth + x];
+	return true;
+}
+
+//Render the n pixels given by their index y * screenWidth + x, with numSamples samples per
+//pixel. These are the antialiasing samples when numSamples is antiAliasingCells and more than
+//one, otherwise a single sample, jittered when progressive and at the centre of the antialiasing
+//samples when not. Only the pixels without primary intersections in the G-buffer trace primary rays.
+//N is numSamples, with the loops over the samples unrolled, or 0 for any number of samples
+template<int N, bool SoftShadows>
+void RenderPixels(const int* pixels, int n, int runtimeSamples) {
+	const int numSamples = N > 0 ? N : runtimeSamples;
+	int sample = numAccumulated - 1;
+	int rowLength = sqrt(antiAliasingCells);
+	float centre = (1 - (rowLength - 1) / 2.0f) / rowLength;
+
+	//the G-buffer keeping the intersections of these samples, none for progressive samples. A
+	//single sample per pixel is the centre sample, which can be reprojected
+	bool grid = !progressive && numSamples == antiAliasingCells && numSamples > 1;
+	Intersection* gbuffer = progressive ? 0 : grid ? &gridHits[0] : &centreHits[0];
+	unsigned char filled = grid ? GRID_HITS : CENTRE_HIT;
+
+	//direction vectors and intersections of the primary rays of the pixels that are traced,
+	//with the samples of a pixel next to each other, and the pixels they belong to
+	vec3* d = arena.Allocate<vec3>(n * numSamples);
+	Intersection* hits = arena.Allocate<Intersection>(n * numSamples);
+	float* cost = arena.Allocate<float>(n * numSamples);
+	int* traced = arena.Allocate<int>(n);
+	float* tracedCost = arena.Allocate<float>(n);
+	int numTraced = 0;
+	fill(tracedCost, tracedCost + n, 0.0f);
+
+	for(int p = 0; p < n; p++) {
+		if(gbuffer && (gbufferState[pixels[p]] & filled)) {
+			continue;
+		}
+		int x = pixels[p] % screenWidth;
+		int y = pixels[p] / screenWidth;
+		int k = numTraced * numSamples;
+		traced[numTraced++] = p;
+
+		//Calculate relative x and y positions of the pixel to the camera position
+		float newX = (float) x - (float) screenWidth / 2;
+		float newY = (float) y - (float) screenHeight / 2;
+
+		if(grid) {
+			getArrayOfDirectionVectors<N>(newX, newY, antiAliasingCells, &d[k]);
+		}
+		else if(progressive) {
+			float jx, jy;
+			SampleJitter(PixelHash(x, y), sample, jx, jy);
+			d[k] = cameraRot * normalize(vec3(newX + jx, newY + jy, focalLength));
+		}
+		else {
+			d[k] = cameraRot * normalize(vec3(newX + centre, newY + centre, focalLength));
+		}
+	}
+
+	TracePrimaryRays(d, numTraced * numSamples, hits, cost);
+
+	for(int t = 0; t < numTraced; t++) {
+		int p = traced[t];
+		if(statisticsEnabled) {
+			for(int i = 0; i < numSamples; i++) {
+				tracedCost[p] += cost[t * numSamples + i];
+			}
+		}
+		if(gbuffer) {
+			copy(&hits[t * numSamples], &hits[t * numSamples] + numSamples, &gbuffer[pixels[p] * numSamples]);
+			gbufferState[pixels[p]] |= filled;
+		}
+	}
+
+	//radiance of the pixels, and the shadow rays queued for them by the wavefront shading
+	vec3* radiance = arena.Allocate<vec3>(n);
+	ShadowRay* rays = wavefront ? arena.Allocate<ShadowRay>(n * numSamples * (SoftShadows && !progressive ? NUM_LIGHT_POINTS : 1)) : 0;
+	int numRays = 0;
+
+	for(int p = 0; p < n; p++) {
+		int x = pixels[p] % screenWidth;
+		int y = pixels[p] / screenWidth;
+
+		//progressive samples are all traced, in the order of the pixels
+		const Intersection* pixelHits = gbuffer ? &gbuffer[pixels[p] * numSamples] : &hits[p * numSamples];
+
+		vec3 R(0,0,0);
+		long work = StatisticsWork(*statistics);
+		if(statisticsEnabled) {
+			objectBuffer[pixels[p]] = pixelHits[0].objectIndex;
+		}
+
+		//centre samples take their shading from the last frame when they can, except for the
+		//pixels whose turn it is to be shaded again
+		bool reused = false;
+		if(reprojecting && !grid && pixelHits[0].objectIndex >= 0 && (PixelHash(x, y) + frameNumber) % reprojectionPeriod != 0) {
+			reused = Reproject(pixelHits[0], centre, R);
+			STATISTICS_COUNT(numReprojectedPixels, reused ? 1 : 0);
+		}
+
+		float factor = 1.0f/(float) numSamples;
+		
+		//If the ray intersects a triangle then fill the pixel
+		//with the color of the closest intersecting triangle
+		for(int i = 0; i < numSamples && !reused; i++) {
+
+			//holds information about the closest intersection for this ray
+			const Intersection& closest = pixelHits[i];
+
+			if(closest.objectIndex >= 0) {
+				//row
+				vec3 color = objects[closest.objectIndex].mesh->Color(closest.triangleIndex);
+
+				//the direct light is added once the shadow rays of all pixels are traced
+				if(wavefront) {
+					R += color * IndirectLight(closest) * factor;
+					QueueDirectLight<SoftShadows>(closest, progressive, PixelHash(y, x) + sample, color * factor, p, rays, numRays);
+					continue;
+				}
+
+				//D
+				vec3 light = progressive ? DirectLightSample<SoftShadows>(closest, PixelHash(y, x) + sample) : DirectLight<SoftShadows>(closest);
+	
+				//Assuming diffuse surface, the light that gets reflected is the color vector * the light vector plus
+				//the indirect light vector where the * operator denotes element-wise multiplication between vectors.
+				R += color * (light + IndirectLight(closest)) * factor;
+			}
+		}
+		radiance[p] = R;
+		if(statisticsEnabled) {
+			tracedCost[p] += StatisticsWork(*statistics) - work;
+		}
+	}
+
+	TraceShadowRays(rays, numRays, radiance, tracedCost);
+
+	for(int p = 0; p < n; p++) {
+		vec3 R = radiance[p];
+		if(progressive) {
+			accumulation[pixels[p]] += R;
+			R = accumulation[pixels[p]] / (float) numAccumulated;
+		}
+		framebuffer[pixels[p]] = R;
+		if(!grid && !progressive) {
+			sampleLuminance[pixels[p]] = Luminance(R);
+			centreRadiance[pixels[p]] = R;
+		}
+		if(statisticsEnabled) {
+			costBuffer[pixels[p]] += tracedCost[p];
+		}
+	}
+}
+
+typedef void (*RenderPixelsFunction)(const int* pixels, int n, int numSamples);
+
+template<int N>
+RenderPixelsFunction RenderPixelsVariant() {
+	return softShadows ? RenderPixels<N, true> : RenderPixels<N, false>;
+}
+
+//Variant of RenderPixels for numSamples samples per pixel and the shadows, specialized for the
+//sample counts up to 16
+RenderPixelsFunction RenderPixelsKernel(int numSamples) {
+	switch(numSamples) {
+	case 1:
+		return RenderPixelsVariant<1>();
+	case 4:
+		return RenderPixelsVariant<4>();
+	case 9:
+		return RenderPixelsVariant<9>();
+	case 16:
+		return RenderPixelsVariant<16>();
+	default:
+		return RenderPixelsVariant<0>();
+	}
+}
+
+//Render the pixels x0 <= x < x1, y0 <= y < y1 with numSamples samples per pixel, see RenderPixels
+void RenderTile(int x0, int y0, int x1, int y1, int numSamples) {
+	int* pixels = arena.Allocate<int>((x1 - x0) * (y1 - y0));
+	int n = 0;
+	for(int y = y0; y < y1; y++) {
+		for(int x = x0; x < x1; x++) {
+			pixels[n++] = y * screenWidth + x;
+		}
+	}
+	RenderPixelsKernel(numSamples)(pixels, n, numSamples);
+}
+
+//Whether the pixel, rendered with a single sample, is next to an edge: a neighbour's sample hit
+//another triangle or its luminance differs by more than adaptiveThreshold. Pixels on the border
+//of the image count as well, as nothing is known about what lies beyond it
+bool NeedsAntiAliasing(int x, int y) {
+	int p = y * screenWidth + x;
+	const int dx[4] = {-1, 1, 0, 0};
+	const int dy[4] = {0, 0, -1, 1};
+	for(int i = 0; i < 4; i++) {
+		int nx = x + dx[i];
+		int ny = y + dy[i];
+		if(nx < 0 || ny < 0 || nx >= screenWidth || ny >= screenHeight) {
+			return true;
+		}
+		int q = ny * screenWidth + nx;
+		if(centreHits[q].objectIndex != centreHits[p].objectIndex || centreHits[q].triangleIndex != centreHits[p].triangleIndex ||
+			fabs(sampleLuminance[q] - sampleLuminance[p]) > adaptiveThreshold) {
+			return true;
+		}
+	}
+	return false;
+}
+
+//Give the pixels x0 <= x < x1, y0 <= y < y1 that are next to an edge all antialiasing samples
+void RefineTile(int x0, int y0, int x1, int y1) {
+	int* pixels = arena.Allocate<int>((x1 - x0) * (y1 - y0));
+	int n = 0;
+	for(int y = y0; y < y1; y++) {
+		for(int x = x0; x < x1; x++) {
+			if(NeedsAntiAliasing(x, y)) {
+				pixels[n++] = y * screenWidth + x;
+			}
+		}
+	}
+
+	if(n > 0) {
+		RenderPixelsKernel(antiAliasingCells)(pixels, n, antiAliasingCells);
+	}
+}
+
+//Make the thread add the irradiance records it computes from now on to its own list, and the
+//next tile use the records of that list from here on only
+void StartIrradianceTile(int thread) {
+	newIrradianceRecords = &threadIrradianceRecords[thread];
+	firstTileRecord = newIrradianceRecords->size();
+}
+
+//Add the irradiance records the threads computed to the irradiance cache
+void AddIrradianceRecords() {
+	for(unsigned int t = 0; t < threadIrradianceRecords.size(); t++) {
+		vector<IrradianceRecord>& records = threadIrradianceRecords[t];
+		for(unsigned int k = 0; k < records.size(); k++) {
+			irradianceCache.Add(records[k]);
+		}
+		records.clear();
+	}
+}
+
+//Make the irradiance cache ready for a frame. It starts again when the scene or the light changed.
+//When the view changed the records of a sparse grid of pixels are computed first, from every 16th
+//pixel to every 4th, so that records that are valid over many tiles are computed once rather than
+//by every tile
+void PrepareIrradianceCache(bool viewChanged) {
+	if(sceneVersion != irradianceScene || lightPos != irradianceLightPos) {
+		vec3 low(0,0,0);
+		vec3 high(0,0,0);
+		if(!objectsBVH.nodes.empty()) {
+			low = objectsBVH.nodes[0].Pmin;
+			high = objectsBVH.nodes[0].Pmax;
+		}
+		vec3 margin = 0.01f * (high - low) + vec3(epsilon);
+		irradianceCache.Reset(low - margin, high + margin, irradianceError);
+		irradianceScene = sceneVersion;
+		irradianceLightPos = lightPos;
+		viewChanged = true;
+	}
+	if(!viewChanged) {
+		return;
+	}
+
+	int tilesX = (screenWidth + TILE_SIZE - 1) / TILE_SIZE;
+	int tilesY = (screenHeight + TILE_SIZE - 1) / TILE_SIZE;
+	for(int spacing = TILE_SIZE; spacing >= 4; spacing /= 2) {
+		threadPool->ParallelFor(tilesX * tilesY, [&](int tile, int thread) {
+			if(cancelFrame) {
+				return;
+			}
+			statistics = &threadStatistics[thread];
+			StartIrradianceTile(thread);
+
+			int x0 = (tile % tilesX) * TILE_SIZE;
+			int y0 = (tile / tilesX) * TILE_SIZE;
+			for(int y = y0 + spacing / 2; y < min(y0 + TILE_SIZE, screenHeight); y += spacing) {
+				for(int x = x0 + spacing / 2; x < min(x0 + TILE_SIZE, screenWidth); x += spacing) {
+					vec3 dir = cameraRot * normalize(vec3(x - screenWidth / 2.0f, y - screenHeight / 2.0f, focalLength));
+					Intersection hit;
+					hit.distance = std::numeric_limits<float>::max();
+					hit.objectIndex = -1;
+					if(ClosestIntersection(cameraPos, dir, objects, hit)) {
+						IndirectLight(hit);
+					}
+				}
+			}
+		});
+		AddIrradianceRecords();
+	}
+}
+
+//Render a frame into the framebuffer, returns false if it was cancelled before it was complete
+bool raytracing() {
+	if(progressive) {
+		//start again when the view changed since the first accumulated sample
+		if(numAccumulated == 0 || cameraPos != accumulatedCameraPos || yaw != accumulatedYaw || lightPos != accumulatedLightPos ||
+			sceneVersion != accumulatedScene) {
+			accumulation.assign(screenWidth * screenHeight, vec3(0,0,0));
+			numAccumulated = 0;
+			accumulatedCameraPos = cameraPos;
+			accumulatedYaw = yaw;
+			accumulatedLightPos = lightPos;
+			accumulatedScene = sceneVersion;
+		}
+		if(numAccumulated == maxAccumulated) {
+			return true;
+		}
+		numAccumulated++;
+	}
+	if(statisticsEnabled) {
+		costBuffer.assign(screenWidth * screenHeight, 0);
+	}
+	long allocations = numHeapAllocations;
+
+	//progressive frames take one sample per pixel, adaptive antialiasing starts with one
+	bool adaptive = !progressive && adaptiveThreshold > 0 && antiAliasingCells > 1;
+	int numSamples = progressive || adaptive ? 1 : antiAliasingCells;
+
+	//the shading of the centre samples is kept for reprojection when every pixel starts with one,
+	//with adaptive antialiasing or a single sample per pixel
+	bool centreSamples = !progressive && (adaptive || antiAliasingCells == 1);
+
+	//the primary intersections stay valid as long as the camera and the scene do
+	reprojecting = false;
+	bool viewChanged = false;
+	if(cameraPos != gbufferCameraPos || yaw != gbufferYaw || sceneVersion != gbufferScene ||
+		gridHits.size() != (size_t) (screenWidth * screenHeight * antiAliasingCells)) {
+
+		//the last frame is reprojected if only the camera moved since
+		if(reprojectionPeriod > 0 && centreSamples && radianceValid && sceneVersion == gbufferScene &&
+			lightPos == radianceLightPos && centreHits.size() == (size_t) (screenWidth * screenHeight)) {
+			swap(previousHits, centreHits);
+			swap(previousRadiance, centreRadiance);
+			previousCameraPos = gbufferCameraPos;
+			previousCameraRot = gbufferCameraRot;
+			reprojecting = true;
+		}
+
+		centreHits.resize(screenWidth * screenHeight);
+		gridHits.resize(screenWidth * screenHeight * antiAliasingCells);
+		gbufferState.assign(screenWidth * screenHeight, 0);
+		gbufferCameraPos = cameraPos;
+		gbufferYaw = yaw;
+		gbufferCameraRot = cameraRot;
+		gbufferScene = sceneVersion;
+		viewChanged = true;
+	}
+	centreRadiance.resize(screenWidth * screenHeight);
+	frameNumber++;
+
+	for(int j = 0; j < NUM_LIGHT_POINTS; j++) {
+		lightPoints[j] = LightPoint(j);
+	}
+	if(irradianceError > 0) {
+		PrepareIrradianceCache(viewChanged);
+	}
+
+	int tilesX = (screenWidth + TILE_SIZE - 1) / TILE_SIZE;
+	int tilesY = (screenHeight + TILE_SIZE - 1) / TILE_SIZE;
+
+	//Render all tiles, the threads take tiles from each other until none are left
+	threadPool->ParallelFor(tilesX * tilesY, [&](int tile, int thread) {
+		if(cancelFrame) {
+			return;
+		}
+		statistics = &threadStatistics[thread];
+		arena.Reset();
+		StartIrradianceTile(thread);
+
+		int x0 = (tile % tilesX) * TILE_SIZE;
+		int y0 = (tile / tilesX) * TILE_SIZE;
+		RenderTile(x0, y0, min(x0 + TILE_SIZE, screenWidth), min(y0 + TILE_SIZE, screenHeight), numSamples);
+	});
+	AddIrradianceRecords();
+
+	if(adaptive) {
+		threadPool->ParallelFor(tilesX * tilesY, [&](int tile, int thread) {
+			if(cancelFrame) {
+				return;
+			}
+			statistics = &threadStatistics[thread];
+			arena.Reset();
+			StartIrradianceTile(thread);
+
+			int x0 = (tile % tilesX) * TILE_SIZE;
+			int y0 = (tile / tilesX) * TILE_SIZE;
+			RefineTile(x0, y0, min(x0 + TILE_SIZE, screenWidth), min(y0 + TILE_SIZE, screenHeight));
+		});
+		AddIrradianceRecords();
+	}
+
+	//out of core, the pages read in again after they were given back are given back once more
+	if(geometryBudget > 0) {
+		pager.Trim();
+	}
+
+	bool complete = !cancelFrame;
+	radianceValid = centreSamples && complete;
+	radianceLightPos = lightPos;
+
+	//the pixels of an incomplete frame keep their own intersections in the G-buffer, but a
+	//progressive image has to start again
+	if(!complete && progressive) {
+		numAccumulated = 0;
+	}
+
+	//Add the statistics of every thread to the statistics of the frame
+	for(unsigned int i = 0; i < threadStatistics.size(); i++) {
+		AddStatistics(frameStatistics, threadStatistics[i]);
+		threadStatistics[i] = Statistics();
+	}
+	frameStatistics.numAllocations += numHeapAllocations - allocations;
+	return complete;
+}
+
+#endif
@@ -0,0 +1,145 @@
+#ifndef SCENE_ARRAY_H
+#define SCENE_ARRAY_H
+
+// Array of the scene data (triangles, BVH nodes, triangle blocks) that either
+// owns its elements like a std::vector or refers to elements in memory owned
+// by someone else, such as a memory mapped scene cache (see SceneCache.h).
+// Reading an element costs the same in both cases. Changing the size of a
+// referring array first copies the elements, so that it owns them.
+
+#include <vector>
+#include <cstddef>
+#include <utility>
+
+template<class T>
+class SceneArray
+{
+public:
+	SceneArray()
+		: first(0), count(0)
+	{
+	}
+
+	SceneArray( const std::vector<T>& elements )
+		: owned(elements)
+	{
+		Update();
+	}
+
+	SceneArray( const SceneArray& other )
+	{
+		*this = other;
+	}
+
+	SceneArray( SceneArray&& other )
+		: owned(std::move(other.owned)), first(other.first), count(other.count)
+	{
+		other.Update();
+	}
+
+	SceneArray& operator=( SceneArray&& other )
+	{
+		owned = std::move( other.owned );
+		first = other.first;
+		count = other.count;
+		other.Update();
+		return *this;
+	}
+
+	SceneArray& operator=( const SceneArray& other )
+	{
+		if( this == &other )
+			return *this;
+		owned = other.owned;
+		if( other.IsReference() )
+		{
+			first = other.first;
+			count = other.count;
+		}
+		else
+			Update();
+		return *this;
+	}
+
+	// Refers to the n elements at data, which must stay valid as long as the
+	// array refers to them
+	void Refer( T* data, size_t n )
+	{
+		owned.clear();
+		owned.shrink_to_fit();
+		first = data;
+		count = n;
+	}
+
+	bool IsReference() const
+	{
+		return count > 0 && first != owned.data();
+	}
+
+	size_t size() const { return count; }
+	bool empty() const { return count == 0; }
+	T* data() { return first; }
+	const T* data() const { return first; }
+	T& operator[]( size_t i ) { return first[i]; }
+	const T& operator[]( size_t i ) const { return first[i]; }
+	T* begin() { return first; }
+	T* end() { return first + count; }
+	const T* begin() const { return first; }
+	const T* end() const { return first + count; }
+	T& back() { return first[count - 1]; }
+	const T& back() const { return first[count - 1]; }
+
+	void clear()
+	{
+		owned.clear();
+		Update();
+	}
+
+	void reserve( size_t n )
+	{
+		Own();
+		owned.reserve( n );
+		Update();
+	}
+
+	void resize( size_t n )
+	{
+		Own();
+		owned.resize( n );
+		Update();
+	}
+
+	void assign( size_t n, const T& value )
+	{
+		owned.assign( n, value );
+		Update();
+	}
+
+	void push_back( const T& value )
+	{
+		Own();
+		owned.push_back( value );
+		Update();
+	}
+
+	// Copies the elements it refers to, so that it owns them
+	void Own()
+	{
+		if( IsReference() )
+			owned.assign( first, first + count );
+		Update();
+	}
+
+private:
+	std::vector<T> owned;
+	T* first;
+	size_t count;
+
+	void Update()
+	{
+		first = owned.data();
+		count = owned.size();
+	}
+};
+
+#endif
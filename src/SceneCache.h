@@ -0,0 +1,431 @@
+#ifndef SCENE_CACHE_H
+#define SCENE_CACHE_H
+
+// Binary cache of a loaded scene: the vertices, faces, colours, bounds,
+// hierarchies and triangle blocks of every mesh, or the quantized vertices of
+// a compact mesh, and the pages of a mesh laid out for paging, the objects placing the meshes and the
+// hierarchy over the objects, stored exactly as they are in memory. A mesh
+// shared by several instances is stored once. Loading the cache maps the file and points
+// the arrays of the objects into the mapping (see SceneArray.h), so nothing
+// is parsed, copied or rebuilt. The pages are only read from disk when they
+// are first used.
+//
+// All positions in the file are relative to its start, so the mapping can be
+// at any address. The header records the version of the format and the sizes
+// of the stored structures, and a checksum covers everything after the
+// header. A cache that does not match is rejected and the scene is built
+// again.
+
+#include <glm/glm.hpp>
+#include <vector>
+#include <string>
+#include <memory>
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <stdint.h>
+#include <sys/stat.h>
+#include "TestModel.h"
+#include "BVH.h"
+#include "ThreadPool.h"
+#include "MappedFile.h"
+
+const char SCENE_CACHE_MAGIC[8] = { 'R', 'T', 'S', 'C', 'E', 'N', 'E', 0 };
+const uint32_t SCENE_CACHE_VERSION = 4;
+
+// Arrays start at multiples of this, so that triangle blocks stay aligned
+const uint64_t SCENE_CACHE_ALIGNMENT = 64;
+
+// The checksum is made of the checksums of blocks of this size, which are
+// computed in parallel
+const uint64_t SCENE_CACHE_CHECKSUM_BLOCK = 1 << 20;
+
+// Position and number of elements of an array in the file
+struct SceneCacheArray
+{
+	uint64_t offset;
+	uint64_t count;
+};
+
+struct SceneCacheMesh
+{
+	glm::vec3 Pmin;
+	glm::vec3 Pmax;
+	SceneCacheArray vertices;
+	SceneCacheArray faces;
+	SceneCacheArray colors;
+	SceneCacheArray nodes;
+	SceneCacheArray indices;
+	SceneCacheArray blocks;
+	SceneCacheArray leafBlock;
+	SceneCacheArray quantizedVertices;
+	SceneCacheArray pages;
+	SceneCacheArray rootPage;
+	uint32_t compact;
+	QuantizedFrame frame;
+};
+
+struct SceneCacheObject
+{
+	glm::vec3 Pmin;
+	glm::vec3 Pmax;
+	uint32_t mesh;
+	uint32_t instanced;
+	glm::mat4 transform;
+};
+
+struct SceneCacheHeader
+{
+	char magic[8];
+	uint32_t version;
+
+	// Layout of the program that wrote the file, which has to match the
+	// program reading it
+	uint32_t byteOrder;
+	uint32_t faceSize;
+	uint32_t nodeSize;
+	uint32_t blockSize;
+	uint32_t meshSize;
+	uint32_t objectSize;
+
+	uint64_t fileSize;
+	uint64_t checksum;
+
+	// Describes what the scene was made from, see SceneCacheKey
+	SceneCacheArray key;
+
+	SceneCacheArray meshes;
+	SceneCacheArray objects;
+	SceneCacheArray objectNodes;
+	SceneCacheArray objectIndices;
+};
+
+inline void SceneCacheLayout( SceneCacheHeader& header )
+{
+	memcpy( header.magic, SCENE_CACHE_MAGIC, sizeof(header.magic) );
+	header.version = SCENE_CACHE_VERSION;
+	header.byteOrder = 0x01020304;
+	header.faceSize = sizeof(MeshFace);
+	header.nodeSize = sizeof(BVHNode);
+	header.blockSize = sizeof(TriangleBlock);
+	header.meshSize = sizeof(SceneCacheMesh);
+	header.objectSize = sizeof(SceneCacheObject);
+}
+
+// Checksum of size bytes, size being a multiple of 8. With release the
+// memory of a mapped file is given back once it has been read, so that
+// checking a file larger than the memory does not fill it (see
+// GeometryPager.h).
+inline uint64_t SceneCacheChecksum( const char* data, uint64_t size, ThreadPool& pool, bool release = false )
+{
+	int numBlocks = (size + SCENE_CACHE_CHECKSUM_BLOCK - 1) / SCENE_CACHE_CHECKSUM_BLOCK;
+	std::vector<uint64_t> blockChecksum( numBlocks );
+
+	pool.ParallelFor( numBlocks, [&]( int b, int thread )
+	{
+		const char* begin = data + b * SCENE_CACHE_CHECKSUM_BLOCK;
+		const char* end = data + std::min( (b + 1) * SCENE_CACHE_CHECKSUM_BLOCK, size );
+		uint64_t h = 0x9E3779B97F4A7C15ull ^ b;
+		for( const char* p = begin; p < end; p += 8 )
+		{
+			uint64_t word;
+			memcpy( &word, p, 8 );
+			h = ((h << 5 | h >> 59) ^ word) * 0x100000001B3ull;
+		}
+		blockChecksum[b] = h;
+
+		//only the memory pages within the block. Reading one of the pages it
+		//shares with a neighbour after it was given back would map all of the
+		//memory the operating system holds it in again, which may be far more
+		if( release )
+		{
+			uintptr_t pageSize = sysconf( _SC_PAGESIZE );
+			uintptr_t first = ((uintptr_t) begin + pageSize - 1) & ~(pageSize - 1);
+			uintptr_t last = (uintptr_t) end & ~(pageSize - 1);
+			if( first < last )
+				madvise( (void*) first, last - first, MADV_DONTNEED );
+		}
+	} );
+
+	uint64_t h = size;
+	for( int b = 0; b < numBlocks; b++ )
+		h = ((h << 5 | h >> 59) ^ blockChecksum[b]) * 0x100000001B3ull;
+	return h;
+}
+
+// Describes a scene by its name and, if it is loaded from a file, the size
+// and modification time of the file, so that a changed file is loaded again,
+// and by the parameters the hierarchies are built with. Nothing else of the
+// program that made the scene is described, a cache has to be deleted when
+// the code making the scenes changes
+std::string SceneCacheKey( const std::string& name )
+{
+	std::string key = name;
+	struct stat info;
+	if( stat( name.c_str(), &info ) == 0 )
+		key += " " + std::to_string( (long long) info.st_size ) + " " + std::to_string( (long long) info.st_mtime );
+	key += " bvh " + std::to_string( BVH_NUM_BINS ) + " " + std::to_string( BVH_MAX_LEAF_SIZE ) + " " +
+		std::to_string( BVH_MAX_SAH_DEPTH ) + " " + std::to_string( BVH_TRAVERSAL_COST ) + " " +
+		std::to_string( BVH_INTERSECTION_COST ) + " " + std::to_string( BVH_LEAF_GROUP_SIZE );
+	return key;
+}
+
+// Appends count elements to the file, which is size bytes long, at the next
+// aligned position and returns where they are. written is cleared if they
+// cannot be written.
+template<class T>
+SceneCacheArray PutSceneCacheArray( FILE* file, uint64_t& size, const T* elements, uint64_t count, bool& written )
+{
+	static const char padding[SCENE_CACHE_ALIGNMENT] = {};
+	SceneCacheArray array;
+	array.offset = (size + SCENE_CACHE_ALIGNMENT - 1) / SCENE_CACHE_ALIGNMENT * SCENE_CACHE_ALIGNMENT;
+	array.count = count;
+	if( fwrite( padding, 1, array.offset - size, file ) != array.offset - size ||
+		(count > 0 && fwrite( elements, sizeof(T), count, file ) != count) )
+		written = false;
+	size = array.offset + count * sizeof(T);
+	return array;
+}
+
+// Writes the scene to a cache file. The arrays are written to the file one
+// after the other, and the header, which comes first, once the file has been
+// checksummed, so that writing the cache takes no more memory than the scene.
+// With release every mesh is emptied once it has been written, which leaves
+// the objects unusable but gives their memory back while the others are
+// written. The file is written under a temporary name and then renamed, so
+// that processes loading the cache at the same time never see half of it.
+bool WriteSceneCache( const std::string& filename, const std::string& key, std::vector<Object>& objects,
+	const BVH& objectsBVH, ThreadPool& pool, std::string& error, bool release = false )
+{
+	SceneCacheHeader header;
+	memset( &header, 0, sizeof(header) );
+	SceneCacheLayout( header );
+
+	std::string temporary = filename + ".tmp";
+	FILE* file = fopen( temporary.c_str(), "wb" );
+	if( !file )
+	{
+		error = "cannot write " + temporary;
+		return false;
+	}
+
+	//the file starts with room for the header, which is filled in last
+	bool written = fwrite( &header, sizeof(header), 1, file ) == 1;
+	uint64_t size = sizeof(header);
+	header.key = PutSceneCacheArray( file, size, key.data(), key.size(), written );
+	header.objectNodes = PutSceneCacheArray( file, size, objectsBVH.nodes.data(), objectsBVH.nodes.size(), written );
+	header.objectIndices = PutSceneCacheArray( file, size, objectsBVH.indices.data(), objectsBVH.indices.size(), written );
+
+	//every mesh is stored the first time an object refers to it
+	std::vector<SceneCacheMesh> meshRecords;
+	std::vector<const Mesh*> meshes;
+	std::vector<SceneCacheObject> records( objects.size() );
+	for( size_t j = 0; j < objects.size() && written; j++ )
+	{
+		const Object& object = objects[j];
+		SceneCacheObject& record = records[j];
+		record.Pmin = object.Pmin;
+		record.Pmax = object.Pmax;
+		record.instanced = object.instanced;
+		record.transform = object.instanced ? object.transform : glm::mat4( 1 );
+
+		record.mesh = std::find( meshes.begin(), meshes.end(), object.mesh.get() ) - meshes.begin();
+		if( record.mesh < meshes.size() )
+			continue;
+
+		Mesh& mesh = *object.mesh;
+		meshes.push_back( &mesh );
+		SceneCacheMesh meshRecord;
+		meshRecord.Pmin = mesh.Pmin;
+		meshRecord.Pmax = mesh.Pmax;
+		meshRecord.compact = mesh.compact;
+		meshRecord.frame = mesh.frame;
+		meshRecord.vertices = PutSceneCacheArray( file, size, mesh.vertices.data(), mesh.vertices.size(), written );
+		meshRecord.quantizedVertices = PutSceneCacheArray( file, size, mesh.quantizedVertices.data(),
+			mesh.quantizedVertices.size(), written );
+		meshRecord.faces = PutSceneCacheArray( file, size, mesh.faces.data(), mesh.faces.size(), written );
+		meshRecord.colors = PutSceneCacheArray( file, size, mesh.colors.data(), mesh.colors.size(), written );
+		meshRecord.nodes = PutSceneCacheArray( file, size, mesh.bvh.nodes.data(), mesh.bvh.nodes.size(), written );
+		meshRecord.indices = PutSceneCacheArray( file, size, mesh.bvh.indices.data(), mesh.bvh.indices.size(), written );
+		meshRecord.blocks = PutSceneCacheArray( file, size, mesh.store.blocks.data(), mesh.store.blocks.size(), written );
+		meshRecord.leafBlock = PutSceneCacheArray( file, size, mesh.store.leafBlock.data(), mesh.store.leafBlock.size(),
+			written );
+		meshRecord.pages = PutSceneCacheArray( file, size, mesh.pages.data(), mesh.pages.size(), written );
+		meshRecord.rootPage = PutSceneCacheArray( file, size, mesh.rootPage.data(), mesh.rootPage.size(), written );
+		meshRecords.push_back( meshRecord );
+		if( release )
+			mesh = Mesh();
+	}
+	header.meshes = PutSceneCacheArray( file, size, meshRecords.data(), meshRecords.size(), written );
+	header.objects = PutSceneCacheArray( file, size, records.data(), records.size(), written );
+
+	//the file ends aligned, which keeps its size a multiple of the 8 bytes the checksum reads at once
+	PutSceneCacheArray( file, size, (const char*) 0, 0, written );
+	header.fileSize = size;
+
+	//the checksum is taken from the file, whose memory is given back as it is read
+	MappedFile mapped;
+	written = written && fflush( file ) == 0 && mapped.Open( temporary, false, false ) && mapped.size == size;
+	if( written )
+	{
+		header.checksum = SceneCacheChecksum( mapped.data + sizeof(header), size - sizeof(header), pool, true );
+		mapped.Close();
+		written = fseek( file, 0, SEEK_SET ) == 0 && fwrite( &header, sizeof(header), 1, file ) == 1;
+	}
+	if( fclose( file ) != 0 || !written || rename( temporary.c_str(), filename.c_str() ) != 0 )
+	{
+		remove( temporary.c_str() );
+		error = "cannot write " + filename;
+		return false;
+	}
+	return true;
+}
+
+// Checks that an array of count elements of the given size lies in the file
+inline bool ValidSceneCacheArray( const SceneCacheArray& array, uint64_t elementSize, uint64_t fileSize )
+{
+	return array.offset % SCENE_CACHE_ALIGNMENT == 0 && array.offset <= fileSize &&
+		array.count <= (fileSize - array.offset) / elementSize;
+}
+
+template<class T>
+void ReferSceneCacheArray( SceneArray<T>& array, const MappedFile& file, const SceneCacheArray& position )
+{
+	array.Refer( (T*) (file.data + position.offset), position.count );
+}
+
+// Maps a cache file written for the scene described by key and points the
+// objects and the hierarchy over them into it. The mapping is read only and
+// has to stay open while they are used, a mesh that is changed has to copy
+// its arrays out of it first (see Mesh::Own). Returns false if the file does not exist, and also
+// puts the reason in error if it exists but cannot be used. For out-of-core
+// rendering the file is not read ahead, and the memory read to check it is
+// given back, so that only the pages of the meshes in use are read later.
+bool LoadSceneCache( const std::string& filename, const std::string& key, MappedFile& file, std::vector<Object>& objects,
+	BVH& objectsBVH, ThreadPool& pool, std::string& error, bool outOfCore = false )
+{
+	if( !file.Open( filename, false, !outOfCore ) )
+	{
+		//a missing cache is not an error, it is about to be written
+		struct stat info;
+		if( stat( filename.c_str(), &info ) == 0 )
+			error = "cannot open " + filename;
+		return false;
+	}
+
+	//out of core the pager gives back the memory of parts of the file, which the
+	//operating system would widen to the huge pages it can map a file with
+	if( outOfCore )
+		madvise( file.data, file.size, MADV_NOHUGEPAGE );
+
+	SceneCacheHeader expected;
+	SceneCacheHeader header;
+	memset( &expected, 0, sizeof(expected) );
+	SceneCacheLayout( expected );
+	if( file.size >= sizeof(header) )
+		memcpy( &header, file.data, sizeof(header) );
+
+	if( file.size < sizeof(header) || memcmp( header.magic, expected.magic, sizeof(header.magic) ) != 0 )
+		error = "not a scene cache";
+	else if( header.version != expected.version || header.byteOrder != expected.byteOrder ||
+		header.faceSize != expected.faceSize || header.nodeSize != expected.nodeSize ||
+		header.blockSize != expected.blockSize || header.meshSize != expected.meshSize ||
+		header.objectSize != expected.objectSize )
+		error = "written by a different version of the program";
+	else if( header.fileSize != file.size || file.size % 8 != 0 ||
+		!ValidSceneCacheArray( header.key, 1, file.size ) ||
+		!ValidSceneCacheArray( header.meshes, sizeof(SceneCacheMesh), file.size ) ||
+		!ValidSceneCacheArray( header.objects, sizeof(SceneCacheObject), file.size ) ||
+		!ValidSceneCacheArray( header.objectNodes, sizeof(BVHNode), file.size ) ||
+		!ValidSceneCacheArray( header.objectIndices, sizeof(int), file.size ) )
+		error = "truncated";
+	else if( std::string( file.data + header.key.offset, header.key.count ) != key )
+		error = "made from a different scene";
+	else if( SceneCacheChecksum( file.data + sizeof(header), file.size - sizeof(header), pool, outOfCore ) !=
+		header.checksum )
+		error = "checksum mismatch";
+
+	//out of core the file read to check it is dropped from the memory of the
+	//operating system, which keeps a file read in order in pieces of up to
+	//megabytes and maps all of a piece when any of it is read. The pager reads
+	//the parts it needs itself, and the file is no longer read around them, so
+	//that they are kept, and given back, in memory pages
+	if( error.empty() && outOfCore )
+	{
+		int fd = open( filename.c_str(), O_RDONLY );
+		if( fd >= 0 )
+		{
+			posix_fadvise( fd, 0, 0, POSIX_FADV_DONTNEED );
+			close( fd );
+		}
+		madvise( file.data, file.size, MADV_RANDOM );
+	}
+
+	const SceneCacheMesh* meshRecords = (const SceneCacheMesh*) (file.data + header.meshes.offset);
+	for( uint64_t m = 0; error.empty() && m < header.meshes.count; m++ )
+	{
+		const SceneCacheMesh& record = meshRecords[m];
+		if( !ValidSceneCacheArray( record.vertices, sizeof(glm::vec3), file.size ) ||
+			!ValidSceneCacheArray( record.quantizedVertices, sizeof(QuantizedVertex), file.size ) ||
+			!ValidSceneCacheArray( record.faces, sizeof(MeshFace), file.size ) ||
+			!ValidSceneCacheArray( record.colors, sizeof(glm::vec3), file.size ) ||
+			!ValidSceneCacheArray( record.nodes, sizeof(BVHNode), file.size ) ||
+			!ValidSceneCacheArray( record.indices, sizeof(int), file.size ) ||
+			!ValidSceneCacheArray( record.blocks, sizeof(TriangleBlock), file.size ) ||
+			!ValidSceneCacheArray( record.leafBlock, sizeof(int), file.size ) ||
+			!ValidSceneCacheArray( record.pages, sizeof(MeshPage), file.size ) ||
+			!ValidSceneCacheArray( record.rootPage, sizeof(int), file.size ) )
+			error = "truncated";
+	}
+
+	const SceneCacheObject* records = (const SceneCacheObject*) (file.data + header.objects.offset);
+	for( uint64_t j = 0; error.empty() && j < header.objects.count; j++ )
+	{
+		if( records[j].mesh >= header.meshes.count )
+			error = "truncated";
+	}
+
+	if( !error.empty() )
+	{
+		file.Close();
+		return false;
+	}
+
+	std::vector< std::shared_ptr<Mesh> > meshes( header.meshes.count );
+	for( size_t m = 0; m < meshes.size(); m++ )
+	{
+		meshes[m] = std::make_shared<Mesh>();
+		Mesh& mesh = *meshes[m];
+		mesh.Pmin = meshRecords[m].Pmin;
+		mesh.Pmax = meshRecords[m].Pmax;
+		mesh.compact = meshRecords[m].compact;
+		mesh.frame = meshRecords[m].frame;
+		ReferSceneCacheArray( mesh.vertices, file, meshRecords[m].vertices );
+		ReferSceneCacheArray( mesh.quantizedVertices, file, meshRecords[m].quantizedVertices );
+		ReferSceneCacheArray( mesh.faces, file, meshRecords[m].faces );
+		ReferSceneCacheArray( mesh.colors, file, meshRecords[m].colors );
+		ReferSceneCacheArray( mesh.bvh.nodes, file, meshRecords[m].nodes );
+		ReferSceneCacheArray( mesh.bvh.indices, file, meshRecords[m].indices );
+		ReferSceneCacheArray( mesh.store.blocks, file, meshRecords[m].blocks );
+		ReferSceneCacheArray( mesh.store.leafBlock, file, meshRecords[m].leafBlock );
+		ReferSceneCacheArray( mesh.pages, file, meshRecords[m].pages );
+		ReferSceneCacheArray( mesh.rootPage, file, meshRecords[m].rootPage );
+	}
+
+	objects.clear();
+	objects.resize( header.objects.count );
+	for( size_t j = 0; j < objects.size(); j++ )
+	{
+		Object& object = objects[j];
+		object.mesh = meshes[records[j].mesh];
+		if( records[j].instanced )
+			object.Place( records[j].transform );
+		object.Pmin = records[j].Pmin;
+		object.Pmax = records[j].Pmax;
+	}
+	ReferSceneCacheArray( objectsBVH.nodes, file, header.objectNodes );
+	ReferSceneCacheArray( objectsBVH.indices, file, header.objectIndices );
+	return true;
+}
+
+#endif
@@ -0,0 +1,126 @@
+#ifndef STATISTICS_H
+#define STATISTICS_H
+
+// Counters of the work done while rendering. The rays traced are always
+// counted. The counters updated for every node and triangle a ray visits are
+// only kept when the program is compiled with RAYTRACER_STATISTICS defined
+// (make STATS=1), otherwise STATISTICS_COUNT compiles to nothing. That build
+// also counts the heap allocations of the whole program, by replacing operator
+// new, to check that rendering a frame does not allocate.
+
+#include <glm/glm.hpp>
+#include <vector>
+#include <algorithm>
+#include <atomic>
+#include <cstdlib>
+#include <new>
+
+#ifdef RAYTRACER_STATISTICS
+const bool statisticsEnabled = true;
+#define STATISTICS_COUNT(counter, n) (statistics->counter += (n))
+#else
+const bool statisticsEnabled = false;
+#define STATISTICS_COUNT(counter, n) ((void) 0)
+#endif
+
+// Heap allocations made by all threads so far
+std::atomic<long> numHeapAllocations(0);
+
+#ifdef RAYTRACER_STATISTICS
+//kept out of line, otherwise the compiler warns about free being called on memory from new
+__attribute__((noinline)) void* operator new( size_t size )
+{
+	numHeapAllocations++;
+	void* p = malloc( size > 0 ? size : 1 );
+	if( !p )
+		throw std::bad_alloc();
+	return p;
+}
+
+__attribute__((noinline)) void operator delete( void* p ) noexcept
+{
+	free( p );
+}
+
+__attribute__((noinline)) void operator delete( void* p, size_t ) noexcept
+{
+	free( p );
+}
+#endif
+
+// Every thread counts into its own copy, aligned to a cache line so that the
+// copies of different threads do not share one
+struct alignas(64) Statistics
+{
+	long numPrimaryRays;
+	long numShadowRays;
+
+	long numTraversalSteps;
+	long numRayBoxTests;
+	long numRayTrianglesTests;
+	long numRayTrianglesIntersections;
+	long numOccluderCacheHits;
+	long numReprojectedPixels;
+
+	// Records of the irradiance cache computed and the rays traced over the
+	// hemispheres of their points (see IrradianceCache.h)
+	long numIrradianceRecords;
+	long numIndirectRays;
+
+	// Tests of rays deferred until the page of geometry they need is loaded,
+	// and the pages loaded, when rendering out of core (see GeometryPager.h)
+	long numDeferredTests;
+	long numPageLoads;
+
+	// Heap allocations made while rendering
+	long numAllocations;
+};
+
+void AddStatistics( Statistics& total, const Statistics& s )
+{
+	total.numPrimaryRays += s.numPrimaryRays;
+	total.numShadowRays += s.numShadowRays;
+	total.numTraversalSteps += s.numTraversalSteps;
+	total.numRayBoxTests += s.numRayBoxTests;
+	total.numRayTrianglesTests += s.numRayTrianglesTests;
+	total.numRayTrianglesIntersections += s.numRayTrianglesIntersections;
+	total.numOccluderCacheHits += s.numOccluderCacheHits;
+	total.numReprojectedPixels += s.numReprojectedPixels;
+	total.numIrradianceRecords += s.numIrradianceRecords;
+	total.numIndirectRays += s.numIndirectRays;
+	total.numDeferredTests += s.numDeferredTests;
+	total.numPageLoads += s.numPageLoads;
+	total.numAllocations += s.numAllocations;
+}
+
+// The cost of the counted work, in box and triangle tests
+long StatisticsWork( const Statistics& s )
+{
+	return s.numRayBoxTests + s.numRayTrianglesTests;
+}
+
+// Colors the cost of every pixel from black over blue, red and yellow to
+// white. The scale ends at the 99th percentile of the costs so that a few
+// expensive pixels do not leave the rest of the image black.
+void CostHeatmap( const std::vector<float>& cost, std::vector<glm::vec3>& image )
+{
+	image.resize( cost.size() );
+	if( cost.empty() )
+		return;
+
+	std::vector<float> sorted( cost );
+	std::sort( sorted.begin(), sorted.end() );
+	float scale = std::max( sorted[(sorted.size() - 1) * 99 / 100], 1.0f );
+
+	const glm::vec3 ramp[5] = {
+		glm::vec3( 0, 0, 0 ), glm::vec3( 0, 0, 1 ), glm::vec3( 1, 0, 0 ), glm::vec3( 1, 1, 0 ), glm::vec3( 1, 1, 1 ) };
+
+	for( size_t i = 0; i < cost.size(); i++ )
+	{
+		float x = std::min( cost[i] / scale, 1.0f ) * 4;
+		int k = std::min( (int) x, 3 );
+		image[i] = glm::mix( ramp[k], ramp[k + 1], x - k );
+	}
+}
+
+#endif
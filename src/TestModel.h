@@ -5,6 +5,13 @@
 
 #include <glm/glm.hpp>
 #include <vector>
+#include <memory>
+#include <unordered_map>
+#include <cstring>
+#include "BVH.h"
+#include "TriangleStore.h"
+#include "LBVH.h"
+#include "ThreadPool.h"
 
 
 // Defines colors:
@@ -43,89 +50,467 @@ public:
 	}
 };
 
-class Object
+// A page of a mesh laid out for paging (see GeometryPager.h): the nodes,
+// triangles, triangle blocks and vertices of a run of treelets of its
+// hierarchy, each a range of the arrays of the mesh. A page has the vertices
+// its triangles use first, the others are in earlier pages.
+struct MeshPage
+{
+	int firstNode, endNode;
+	int firstTriangle, endTriangle;
+	int firstBlock, endBlock;
+	int firstVertex, endVertex;
+};
+
+// The triangles of an object together with the hierarchy over them and the
+// copy used for intersection tests, in the coordinates of the object. The
+// objects placed as instances of a mesh all share it, so it stays the same
+// once they refer to it.
+//
+// The triangles are indexed: every face refers to three vertices, which the
+// faces around them share, and to a color in a table of the colors of the
+// mesh. Normals are computed from the vertices when they are needed. A
+// compact mesh stores its vertices quantized to 16 bits within its bounding
+// box instead of as floats and has no triangle blocks, its triangles are
+// decoded by the intersection tests (see TriangleStore.h).
+class Mesh
 {
 public:
 	glm::vec3 Pmin;
 	glm::vec3 Pmax;
-	std::vector<Triangle> triangles;
+	SceneArray<glm::vec3> vertices;
+	SceneArray<MeshFace> faces;
+	SceneArray<glm::vec3> colors;
+	BVH bvh;
+	TriangleStore store;
+
+	// The vertices of a compact mesh, which has no float vertices
+	bool compact;
+	SceneArray<QuantizedVertex> quantizedVertices;
+	QuantizedFrame frame;
+
+	// The pages of a mesh laid out for paging, and the page of every node
+	// above them that is the root of a treelet, -1 for the other nodes. Both
+	// are empty for other meshes. firstPage is the number of the first page
+	// in the pager, -1 while it does not page the mesh.
+	SceneArray<MeshPage> pages;
+	SceneArray<int> rootPage;
+	int firstPage;
+
+	// An empty mesh, filled in by the scene cache (see SceneCache.h)
+	Mesh()
+		: compact( false ), firstPage( -1 )
+	{
+	}
 
-	Object( std::vector<Triangle>&triangles)
-		: triangles(triangles)
+	Mesh( const std::vector<Triangle>& triangles )
+		: compact( false ), firstPage( -1 )
 	{
+		Index( triangles );
 		ComputeBoundingBox();
+		BuildBVH();
+	}
+
+	int NumTriangles() const
+	{
+		return faces.size();
+	}
+
+	int NumVertices() const
+	{
+		return compact ? quantizedVertices.size() : vertices.size();
+	}
+
+	glm::vec3 Vertex( int v ) const
+	{
+		return compact ? frame.Decode( quantizedVertices[v] ) : vertices[v];
+	}
+
+	void Positions( int i, glm::vec3& v0, glm::vec3& v1, glm::vec3& v2 ) const
+	{
+		const MeshFace& face = faces[i];
+		v0 = Vertex( face.v[0] );
+		v1 = Vertex( face.v[1] );
+		v2 = Vertex( face.v[2] );
+	}
+
+	// The point of triangle i at barycentric coordinates u and v
+	glm::vec3 Point( int i, float u, float v ) const
+	{
+		glm::vec3 v0, v1, v2;
+		Positions( i, v0, v1, v2 );
+		return v0 + u * (v1 - v0) + v * (v2 - v0);
+	}
+
+	// Unit normal of triangle i, on the side of Triangle::normal
+	glm::vec3 Normal( int i ) const
+	{
+		glm::vec3 v0, v1, v2;
+		Positions( i, v0, v1, v2 );
+		return glm::normalize( glm::cross( v2 - v0, v1 - v0 ) );
+	}
+
+	glm::vec3 Color( int i ) const
+	{
+		return colors[faces[i].color];
+	}
+
+	// Bytes taken by the arrays of the mesh
+	size_t MemoryUsage() const
+	{
+		return vertices.size() * sizeof(glm::vec3) + quantizedVertices.size() * sizeof(QuantizedVertex) +
+			faces.size() * sizeof(MeshFace) + colors.size() * sizeof(glm::vec3) +
+			bvh.nodes.size() * sizeof(BVHNode) + bvh.indices.size() * sizeof(int) +
+			store.blocks.size() * sizeof(TriangleBlock) + store.leafBlock.size() * sizeof(int) +
+			pages.size() * sizeof(MeshPage) + rootPage.size() * sizeof(int);
+	}
+
+	// Copies the arrays that refer into the scene cache, so that the mesh
+	// owns all of them and they can be changed
+	void Own()
+	{
+		vertices.Own();
+		faces.Own();
+		colors.Own();
+		quantizedVertices.Own();
+		bvh.nodes.Own();
+		bvh.indices.Own();
+		store.blocks.Own();
+		store.leafBlock.Own();
+		pages.Own();
+		rootPage.Own();
+	}
+
+	// The leaf of the hierarchy as the tests of compact meshes read it
+	CompactTriangles CompactLeaf( const BVHNode& leaf ) const
+	{
+		CompactTriangles triangles;
+		triangles.indices = &bvh.indices[leaf.first];
+		triangles.faces = &faces[0];
+		triangles.vertices = &quantizedVertices[0];
+		triangles.frame = frame;
+		return triangles;
+	}
+
+	// Builds the hierarchy over the bounding boxes of the triangles and the
+	// copy of the triangles used for intersection tests
+	void BuildBVH()
+	{
+		std::vector<glm::vec3> boxMin( faces.size() );
+		std::vector<glm::vec3> boxMax( faces.size() );
+		for(unsigned int i = 0; i < faces.size(); i++) {
+			TriangleBox( i, boxMin[i], boxMax[i] );
+		}
+		bvh.Build( boxMin, boxMax );
+		if( !compact )
+			store.Build( *this, bvh );
+	}
+
+	// Quantizes the vertices to 16 bits within the bounding box and drops the
+	// triangle blocks. The triangles move by up to half a step of the
+	// quantization, so the bounds of the hierarchy are refitted.
+	void Compact( ThreadPool& pool )
+	{
+		if( compact )
+			return;
+
+		frame.Fit( Pmin, Pmax );
+		quantizedVertices.resize( vertices.size() );
+		for( size_t v = 0; v < vertices.size(); v++ )
+			quantizedVertices[v] = frame.Encode( vertices[v] );
+		vertices.clear();
+		compact = true;
+
+		store.blocks.clear();
+		store.leafBlock.clear();
+		Refit( pool );
+	}
+
+	// Moves the vertices by transform. The hierarchy has to be refitted or
+	// built again before the object is rendered. The vertices of a compact
+	// mesh are quantized again within their new bounding box.
+	void Transform( const glm::mat4& transform, ThreadPool& pool )
+	{
+		int count = NumVertices();
+		if( count == 0 )
+			return;
+
+		int numChunks = std::min( 4 * pool.NumThreads(), count );
+		moved.resize( count );
+		pool.ParallelFor( numChunks, [&]( int chunk, int thread )
+		{
+			int end = (long) count * (chunk + 1) / numChunks;
+			for( int v = (long) count * chunk / numChunks; v < end; v++ )
+				moved[v] = glm::vec3( transform * glm::vec4( Vertex( v ), 1 ) );
+		} );
+
+		if( !compact )
+		{
+			for( int v = 0; v < count; v++ )
+				vertices[v] = moved[v];
+			return;
+		}
+
+		glm::vec3 boxMin = moved[0], boxMax = moved[0];
+		for( int v = 1; v < count; v++ )
+		{
+			boxMin = glm::min( boxMin, moved[v] );
+			boxMax = glm::max( boxMax, moved[v] );
+		}
+		frame.Fit( boxMin, boxMax );
+		pool.ParallelFor( numChunks, [&]( int chunk, int thread )
+		{
+			int end = (long) count * (chunk + 1) / numChunks;
+			for( int v = (long) count * chunk / numChunks; v < end; v++ )
+				quantizedVertices[v] = frame.Encode( moved[v] );
+		} );
+	}
+
+	// Updates the bounds of the hierarchy and the copy of the triangles after
+	// the vertices changed, keeping the structure of the hierarchy. Cheap, but
+	// the hierarchy gets worse the further the triangles move from where it
+	// was built.
+	void Refit( ThreadPool& pool )
+	{
+		bvh.Refit( [this]( int i, glm::vec3& boxMin, glm::vec3& boxMax )
+		{
+			TriangleBox( i, boxMin, boxMax );
+		}, pool );
+		if( !compact )
+			store.Update( *this, bvh, pool );
+		UpdateBoundingBox();
+	}
+
+	// Builds the hierarchy again with the linear builder after the vertices
+	// changed, for triangles that move relative to each other
+	void RebuildBVH( LBVHBuilder& builder, ThreadPool& pool )
+	{
+		builder.Build( bvh, faces.size(), [this]( int i, glm::vec3& boxMin, glm::vec3& boxMax )
+		{
+			TriangleBox( i, boxMin, boxMax );
+		}, pool );
+		if( !compact )
+			store.Build( *this, bvh, pool );
+		UpdateBoundingBox();
+
+		//the new hierarchy is not laid out in pages
+		pages.clear();
+		rootPage.clear();
+	}
+
+	void TriangleBox( int i, glm::vec3& boxMin, glm::vec3& boxMax ) const
+	{
+		glm::vec3 v0, v1, v2;
+		Positions( i, v0, v1, v2 );
+		boxMin = glm::min( v0, glm::min( v1, v2 ) );
+		boxMax = glm::max( v0, glm::max( v1, v2 ) );
+	}
+
+	// The bounding box of the mesh is the one of the root of its hierarchy
+	void UpdateBoundingBox()
+	{
+		if( bvh.nodes.empty() )
+			return;
+		Pmin = bvh.nodes[0].Pmin;
+		Pmax = bvh.nodes[0].Pmax;
 	}
 
 	void ComputeBoundingBox()
 	{
-		Pmin = triangles[0].v0;
-		Pmax = triangles[0].v1;
-		for(unsigned int i = 0; i < triangles.size(); i++) {
-			
-			//Check min for v0
-			if(triangles[i].v0.x < Pmin.x) {
-				Pmin.x = triangles[i].v0.x;
-			}
-			if(triangles[i].v0.y < Pmin.y) {
-				Pmin.y = triangles[i].v0.y;
-			}
-			if(triangles[i].v0.z < Pmin.z) {
-				Pmin.z = triangles[i].v0.z;
-			}
-			//Check max for v0
-			if(triangles[i].v0.x > Pmax.x) {
-				Pmax.x = triangles[i].v0.x;
-			}
-			if(triangles[i].v0.y > Pmax.y) {
-				Pmax.y = triangles[i].v0.y;
-			}
-			if(triangles[i].v0.z > Pmax.z) {
-				Pmax.z = triangles[i].v0.z;
-			}
+		Pmin = Pmax = vertices.empty() ? glm::vec3( 0 ) : vertices[0];
+		for(unsigned int v = 1; v < vertices.size(); v++) {
+			Pmin = glm::min( Pmin, vertices[v] );
+			Pmax = glm::max( Pmax, vertices[v] );
+		}
+	}
 
-			//Check min for v1
-			if(triangles[i].v1.x < Pmin.x) {
-				Pmin.x = triangles[i].v1.x;
-			}
-			if(triangles[i].v1.y < Pmin.y) {
-				Pmin.y = triangles[i].v1.y;
-			}
-			if(triangles[i].v1.z < Pmin.z) {
-				Pmin.z = triangles[i].v1.z;
-			}
-			//Check max for v1
-			if(triangles[i].v1.x > Pmax.x) {
-				Pmax.x = triangles[i].v1.x;
-			}
-			if(triangles[i].v1.y > Pmax.y) {
-				Pmax.y = triangles[i].v1.y;
-			}
-			if(triangles[i].v1.z > Pmax.z) {
-				Pmax.z = triangles[i].v1.z;
-			}
+private:
+	// Vertices moved by Transform, kept from frame to frame
+	std::vector<glm::vec3> moved;
 
-			//Check min for v2
-			if(triangles[i].v2.x < Pmin.x) {
-				Pmin.x = triangles[i].v2.x;
-			}
-			if(triangles[i].v2.y < Pmin.y) {
-				Pmin.y = triangles[i].v2.y;
-			}
-			if(triangles[i].v2.z < Pmin.z) {
-				Pmin.z = triangles[i].v2.z;
+	// Makes the faces, vertices and colors of the triangles, giving the
+	// vertices with the same position the same index
+	void Index( const std::vector<Triangle>& triangles )
+	{
+		//open addressing table of vertex indices, at most half full
+		std::vector<uint32_t> table( 64, EMPTY_SLOT );
+		std::unordered_map<glm::vec3, uint32_t, VertexHash> colorIndex;
+		faces.resize( triangles.size() );
+		vertices.clear();
+		colors.clear();
+
+		for( size_t i = 0; i < triangles.size(); i++ )
+		{
+			const Triangle& triangle = triangles[i];
+			const glm::vec3* corners[3] = { &triangle.v0, &triangle.v1, &triangle.v2 };
+			for( int k = 0; k < 3; k++ )
+			{
+				if( 2 * (vertices.size() + 1) > table.size() )
+					Rehash( table, 2 * table.size() );
+				uint32_t& slot = FindSlot( table, *corners[k] );
+				if( slot == EMPTY_SLOT )
+				{
+					slot = vertices.size();
+					vertices.push_back( *corners[k] );
+				}
+				faces[i].v[k] = slot;
 			}
-			//Check max for v2
-			if(triangles[i].v2.x > Pmax.x) {
-				Pmax.x = triangles[i].v2.x;
+
+			//neighbouring triangles mostly have the same colour
+			if( i > 0 && triangle.color == triangles[i - 1].color )
+			{
+				faces[i].color = faces[i - 1].color;
+				continue;
 			}
-			if(triangles[i].v2.y > Pmax.y) {
-				Pmax.y = triangles[i].v2.y;
+			auto inserted = colorIndex.insert( std::make_pair( triangle.color, (uint32_t) colors.size() ) );
+			if( inserted.second )
+				colors.push_back( triangle.color );
+			faces[i].color = inserted.first->second;
+		}
+	}
+
+	static constexpr uint32_t EMPTY_SLOT = 0xFFFFFFFF;
+
+	// The slot of the table holding the index of the vertex at p, or the
+	// empty slot where it belongs
+	uint32_t& FindSlot( std::vector<uint32_t>& table, const glm::vec3& p ) const
+	{
+		size_t mask = table.size() - 1;
+		for( size_t s = VertexHash()( p ) & mask; ; s = (s + 1) & mask )
+		{
+			if( table[s] == EMPTY_SLOT || vertices[table[s]] == p )
+				return table[s];
+		}
+	}
+
+	void Rehash( std::vector<uint32_t>& table, size_t size ) const
+	{
+		table.assign( size, EMPTY_SLOT );
+		for( size_t v = 0; v < vertices.size(); v++ )
+			FindSlot( table, vertices[v] ) = v;
+	}
+
+	// Hash of the bits of a position, equal positions being the same bits
+	// except for zero and minus zero, which are made the same
+	struct VertexHash
+	{
+		size_t operator()( const glm::vec3& p ) const
+		{
+			uint32_t bits[3];
+			for( int i = 0; i < 3; i++ )
+			{
+				float x = p[i] == 0 ? 0.0f : p[i];
+				memcpy( &bits[i], &x, sizeof(x) );
 			}
-			if(triangles[i].v2.z > Pmax.z) {
-				Pmax.z = triangles[i].v2.z;
-			}				
+			uint64_t h = bits[0] * 0x9E3779B97F4A7C15ull;
+			h = (h ^ bits[1]) * 0x9E3779B97F4A7C15ull;
+			h = (h ^ bits[2]) * 0x9E3779B97F4A7C15ull;
+			return h ^ h >> 32;
+		}
+	};
+};
+
+// An object of the scene: a mesh, either in world coordinates or, for an
+// instance, placed by a transform. Instances of the same mesh share its
+// triangles and hierarchies, so the memory of a scene grows with the meshes
+// in it rather than with the objects. Rays are moved into the coordinates
+// of an instance to be traced against its mesh. The transform is affine, so
+// distances along the moved rays are the same as along the rays.
+class Object
+{
+public:
+	// Bounding box in world coordinates
+	glm::vec3 Pmin;
+	glm::vec3 Pmax;
+	std::shared_ptr<Mesh> mesh;
+
+	// Whether the object is an instance, whose transform is stored as the
+	// object to world matrix, its linear part and translation, their inverse
+	// and the matrix that takes normals to world coordinates
+	bool instanced;
+	glm::mat4 transform;
+	glm::mat3 toWorld;
+	glm::vec3 toWorldOffset;
+	glm::mat3 toObject;
+	glm::vec3 toObjectOffset;
+	glm::mat3 normalToWorld;
+
+	// An empty object, filled in by the scene cache (see SceneCache.h)
+	Object()
+		: instanced( false )
+	{
+	}
+
+	// An object with a mesh of its own, made of the triangles
+	Object( std::vector<Triangle>&triangles )
+		: mesh( std::make_shared<Mesh>( triangles ) ), instanced( false )
+	{
+		UpdateBoundingBox();
+	}
+
+	// An instance of mesh placed by transform
+	Object( const std::shared_ptr<Mesh>& mesh, const glm::mat4& transform )
+		: mesh( mesh )
+	{
+		Place( transform );
+	}
+
+	// Makes the object an instance of its mesh placed by transform
+	void Place( const glm::mat4& transform )
+	{
+		instanced = true;
+		this->transform = transform;
+		toWorld = glm::mat3( glm::vec3( transform[0] ), glm::vec3( transform[1] ), glm::vec3( transform[2] ) );
+		toWorldOffset = glm::vec3( transform[3] );
+		toObject = glm::inverse( toWorld );
+		toObjectOffset = -(toObject * toWorldOffset);
+		normalToWorld = glm::transpose( toObject );
+		UpdateBoundingBox();
+	}
+
+	// Takes the bounding box from the mesh, for an instance the box around
+	// the corners of the box of the mesh
+	void UpdateBoundingBox()
+	{
+		if( !instanced )
+		{
+			Pmin = mesh->Pmin;
+			Pmax = mesh->Pmax;
+			return;
+		}
+
+		for( int corner = 0; corner < 8; corner++ )
+		{
+			glm::vec3 p( corner & 1 ? mesh->Pmax.x : mesh->Pmin.x, corner & 2 ? mesh->Pmax.y : mesh->Pmin.y,
+				corner & 4 ? mesh->Pmax.z : mesh->Pmin.z );
+			p = PointToWorld( p );
+			Pmin = corner == 0 ? p : glm::min( Pmin, p );
+			Pmax = corner == 0 ? p : glm::max( Pmax, p );
+		}
+	}
+
+	glm::vec3 PointToWorld( glm::vec3 p ) const
+	{
+		return instanced ? toWorld * p + toWorldOffset : p;
+	}
+
+	// Moves a ray into the coordinates of the mesh, its direction is not
+	// normalized again
+	void RayToObject( glm::vec3& start, glm::vec3& dir ) const
+	{
+		if( instanced )
+		{
+			start = toObject * start + toObjectOffset;
+			dir = toObject * dir;
 		}
 	}
+
+	// Unit normal of a triangle of the mesh in world coordinates
+	glm::vec3 Normal( int triangleIndex ) const
+	{
+		glm::vec3 n = mesh->Normal( triangleIndex );
+		return instanced ? glm::normalize( normalToWorld * n ) : n;
+	}
 };
 
 // Loads the Cornell Box. It is scaled to fill the volume:
@@ -445,4 +830,68 @@ void LoadTestModelO( std::vector<Object>& objects )
 }
 
 
+// Loads a larger scene for benchmarking: the room of the Cornell Box with a
+// grid of n x n spheres standing on its floor. Every sphere is an instance of
+// the mesh of its color, a sphere of 4*rings*(rings-1) triangles.
+void LoadSphereScene( std::vector<Object>& objects, int n, int rings )
+{
+	using glm::vec3;
+
+	std::vector<Triangle> room;
+	RoomTriangles( room );
+	objects.push_back( Object( room ) );
+
+	vec3 colors[6] = { red, yellow, green, cyan, blue, purple };
+	std::shared_ptr<Mesh> spheres[6];
+	float radius = 0.8f / n;
+	int segments = 2 * rings;
+
+	std::vector<vec3> points;
+	for( int r = 0; r <= rings; r++ )
+	{
+		float theta = 3.1415926535897f * r / rings;
+		for( int s = 0; s <= segments; s++ )
+		{
+			float phi = 2 * 3.1415926535897f * s / segments;
+			points.push_back( radius * vec3( sin(theta) * cos(phi), cos(theta), sin(theta) * sin(phi) ) );
+		}
+	}
+
+	for( int i = 0; i < n; i++ )
+	{
+		for( int j = 0; j < n; j++ )
+		{
+			int c = (i * n + j) % 6;
+			if( !spheres[c] )
+			{
+				std::vector<Triangle> triangles;
+				triangles.reserve( 2 * rings * segments );
+				for( int r = 0; r < rings; r++ )
+				{
+					for( int s = 0; s < segments; s++ )
+					{
+						vec3 A = points[r * (segments + 1) + s];
+						vec3 B = points[r * (segments + 1) + s + 1];
+						vec3 C = points[(r + 1) * (segments + 1) + s];
+						vec3 D = points[(r + 1) * (segments + 1) + s + 1];
+						// At the poles one of the two triangles collapses to a line
+						if( r > 0 )
+							triangles.push_back( Triangle( A, C, B, colors[c] ) );
+						if( r < rings - 1 )
+							triangles.push_back( Triangle( B, C, D, colors[c] ) );
+					}
+				}
+				spheres[c] = std::make_shared<Mesh>( triangles );
+			}
+
+			// The floor is at y = 1 after the scaling of the room
+			vec3 center( -0.8f + (2*i + 1) * radius, 1 - radius, -0.8f + (2*j + 1) * radius );
+			glm::mat4 transform( 1 );
+			transform[3] = glm::vec4( center, 1 );
+			objects.push_back( Object( spheres[c], transform ) );
+		}
+	}
+}
+
+
 #endif
@@ -0,0 +1,183 @@
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+// A pool of worker threads used to run the iterations of a parallel loop.
+// Every thread owns a deque of task indices. It takes tasks from the back of
+// its own deque and, once that is empty, steals from the front of the deques
+// of the other threads, so that uneven task costs balance out. Once the deques
+// have grown to the largest loop, running a loop allocates no memory.
+
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <vector>
+
+class ThreadPool
+{
+public:
+	// The calling thread takes part in every loop, so numThreads - 1 worker
+	// threads are created.
+	ThreadPool( int numThreads )
+		: queues( numThreads < 1 ? 1 : numThreads ), task(0), generation(0), remaining(0), quit(false)
+	{
+		for( int i = 1; i < NumThreads(); i++ )
+			threads.push_back( std::thread( &ThreadPool::WorkerLoop, this, i ) );
+	}
+
+	~ThreadPool()
+	{
+		{
+			std::lock_guard<std::mutex> lock( mutex );
+			quit = true;
+		}
+		start.notify_all();
+		for( size_t i = 0; i < threads.size(); i++ )
+			threads[i].join();
+	}
+
+	int NumThreads() const
+	{
+		return queues.size();
+	}
+
+	// Calls f(index, thread) for every index in [0, count) and returns once all
+	// of them have finished. thread is in [0, NumThreads()) and identifies the
+	// thread running the task, 0 being the calling thread.
+	template<class Function>
+	void ParallelFor( int count, const Function& f )
+	{
+		if( count <= 0 )
+			return;
+
+		{
+			std::lock_guard<std::mutex> lock( mutex );
+			task = &f;
+			runTask = &RunTask<Function>;
+			remaining = count;
+
+			//deal the tasks out round robin so neighbouring tasks start on different threads
+			for( int i = 0; i < count; i++ )
+			{
+				WorkQueue& queue = queues[i % queues.size()];
+				std::lock_guard<std::mutex> queueLock( queue.mutex );
+				queue.tasks.push_back( i );
+			}
+			generation++;
+		}
+		start.notify_all();
+
+		RunTasks( 0 );
+
+		std::unique_lock<std::mutex> lock( mutex );
+		done.wait( lock, [this] { return remaining == 0; } );
+		task = 0;
+	}
+
+private:
+	// Deque of task indices, the tasks in [front, tasks.size()) are left. It
+	// is emptied rather than shrunk, so its memory is kept for the next loop.
+	struct WorkQueue
+	{
+		std::mutex mutex;
+		std::vector<int> tasks;
+		size_t front;
+
+		WorkQueue()
+			: front(0)
+		{
+		}
+
+		bool empty() const
+		{
+			return front == tasks.size();
+		}
+
+		void push_back( int index )
+		{
+			if( empty() )
+			{
+				tasks.clear();
+				front = 0;
+			}
+			tasks.push_back( index );
+		}
+	};
+
+	std::vector<std::thread> threads;
+	std::vector<WorkQueue> queues;
+
+	std::mutex mutex;
+	std::condition_variable start;
+	std::condition_variable done;
+	const void* task;
+	void (*runTask)( const void* task, int index, int thread );
+	unsigned int generation;
+	std::atomic<int> remaining;
+	bool quit;
+
+	template<class Function>
+	static void RunTask( const void* task, int index, int thread )
+	{
+		(*(const Function*) task)( index, thread );
+	}
+
+	void WorkerLoop( int thread )
+	{
+		unsigned int seen = 0;
+		while( true )
+		{
+			{
+				std::unique_lock<std::mutex> lock( mutex );
+				start.wait( lock, [&] { return quit || generation != seen; } );
+				if( quit )
+					return;
+				seen = generation;
+			}
+			RunTasks( thread );
+		}
+	}
+
+	// Runs tasks until there are none left to take or steal
+	void RunTasks( int thread )
+	{
+		int index;
+		while( PopTask( thread, index ) )
+		{
+			runTask( task, index, thread );
+			if( --remaining == 0 )
+			{
+				std::lock_guard<std::mutex> lock( mutex );
+				done.notify_all();
+			}
+		}
+	}
+
+	bool PopTask( int thread, int& index )
+	{
+		{
+			WorkQueue& own = queues[thread];
+			std::lock_guard<std::mutex> lock( own.mutex );
+			if( !own.empty() )
+			{
+				index = own.tasks.back();
+				own.tasks.pop_back();
+				return true;
+			}
+		}
+
+		for( size_t i = 1; i < queues.size(); i++ )
+		{
+			WorkQueue& victim = queues[(thread + i) % queues.size()];
+			std::lock_guard<std::mutex> lock( victim.mutex );
+			if( !victim.empty() )
+			{
+				index = victim.tasks[victim.front++];
+				return true;
+			}
+		}
+		return false;
+	}
+};
+
+#endif
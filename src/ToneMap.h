@@ -0,0 +1,105 @@
+#ifndef TONE_MAP_H
+#define TONE_MAP_H
+
+// Conversion of the linear RGB radiance the renderer produces to 8 bit
+// pixels, for the screen and for image files. The radiance is scaled by the
+// exposure, compressed to [0,1] by a tone mapping operator, optionally
+// encoded with the sRGB curve, and packed into 32 bit pixels with the
+// channels at the shifts of the target format. Whole rows are converted with
+// vector instructions, the widest the processor supports being chosen at run
+// time as for the triangle kernels.
+//
+// The default mapping clamps the radiance and does no sRGB encoding, which
+// gives the same pixels as the renderer always has.
+
+#include <glm/glm.hpp>
+#include <algorithm>
+#include <string>
+#include <cstring>
+#include <cmath>
+#include <stdint.h>
+
+enum ToneMapOperator
+{
+	TONEMAP_CLAMP,
+	TONEMAP_REINHARD,	//c / (1 + c)
+	TONEMAP_ACES		//fit of the ACES filmic curve by Krzysztof Narkowicz
+};
+
+struct ToneMapping
+{
+	float exposure;
+	ToneMapOperator op;
+	bool srgb;
+
+	ToneMapping()
+		: exposure( 1 ), op( TONEMAP_CLAMP ), srgb( false )
+	{
+	}
+};
+
+// Layout of a 32 bit pixel: the shifts of the red, green and blue bytes and
+// the bits that are always set, for an opaque alpha channel
+struct PackedFormat
+{
+	int rshift;
+	int gshift;
+	int bshift;
+	uint32_t alpha;
+};
+
+// Red in the lowest byte, as read by the image writers
+const PackedFormat RGB_FORMAT = { 0, 8, 16, 0 };
+
+namespace ToneMapKernelBaseline
+{
+#include "ToneMapKernel.h"
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+#pragma GCC push_options
+#pragma GCC target("avx2,fma")
+namespace ToneMapKernelAVX2
+{
+#include "ToneMapKernel.h"
+}
+#pragma GCC pop_options
+#endif
+
+typedef void (*ToneMapFunction)( const float* rgb, int count, uint32_t* out, const ToneMapping& mapping,
+	const PackedFormat& format );
+
+// The fastest version of ToneMapPixels the processor supports
+ToneMapFunction ToneMapKernel()
+{
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_cpu_init();
+	if( __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma") )
+		return ToneMapKernelAVX2::ToneMapPixels<8>;
+#endif
+	return ToneMapKernelBaseline::ToneMapPixels<4>;
+}
+
+// Tone maps and packs one row of pixels
+inline void ToneMapRow( const glm::vec3* pixels, int count, uint32_t* out, const ToneMapping& mapping,
+	const PackedFormat& format )
+{
+	static const ToneMapFunction toneMap = ToneMapKernel();
+	toneMap( &pixels[0].x, count, out, mapping, format );
+}
+
+// Parses the name of a tone mapping operator, returns false if it is unknown
+bool ParseToneMapOperator( const std::string& name, ToneMapOperator& op )
+{
+	if( name == "clamp" )
+		op = TONEMAP_CLAMP;
+	else if( name == "reinhard" )
+		op = TONEMAP_REINHARD;
+	else if( name == "aces" )
+		op = TONEMAP_ACES;
+	else
+		return false;
+	return true;
+}
+
+#endif
@@ -0,0 +1,85 @@
+// Tone mapping and packing of pixels, see ToneMap.h. Like TriangleKernel.h
+// this file has no include guard because it is included once for every
+// instruction set, inside its own namespace and with the instruction set
+// enabled by a pragma.
+
+template<int W>
+struct ToneMapLanes
+{
+	typedef float Float __attribute__((vector_size(W * sizeof(float))));
+	typedef int Int __attribute__((vector_size(W * sizeof(int))));
+};
+
+// Maps W channels of linear radiance to 8 bit values
+template<int W>
+typename ToneMapLanes<W>::Int ToneMapChannels( typename ToneMapLanes<W>::Float c, const ToneMapping& mapping )
+{
+	typedef typename ToneMapLanes<W>::Float Float;
+	typedef typename ToneMapLanes<W>::Int Int;
+
+	//negative values and NaNs become zero
+	c = c * mapping.exposure;
+	c = c > 0 ? c : c * 0;
+
+	if( mapping.op == TONEMAP_REINHARD )
+		c = c / (c + 1);
+	else if( mapping.op == TONEMAP_ACES )
+		c = (c * (2.51f * c + 0.03f)) / (c * (2.43f * c + 0.59f) + 0.14f);
+	c = c < 1 ? c : c * 0 + 1;
+
+	if( mapping.srgb )
+	{
+		//approximation of the sRGB curve by square roots, within a quarter of
+		//a step of 8 bits of the exact curve
+		Float s1, s2, s3;
+		for( int l = 0; l < W; l++ )
+			s1[l] = sqrtf( c[l] );
+		for( int l = 0; l < W; l++ )
+			s2[l] = sqrtf( s1[l] );
+		for( int l = 0; l < W; l++ )
+			s3[l] = sqrtf( s2[l] );
+		Float curve = 0.662002687f * s1 + 0.684122060f * s2 - 0.323583601f * s3 - 0.0225411470f * c;
+		c = c <= 0.0031308f ? 12.92f * c : curve;
+		c = c < 1 ? c : c * 0 + 1;
+	}
+
+	//truncated like PutPixelSDL did, so that the default mapping gives the same
+	//values
+	return __builtin_convertvector( c * 255.0f, Int );
+}
+
+// Tone maps count pixels of linear RGB radiance, given as 3 * count floats,
+// and packs them into 32 bit pixels of the given format. W pixels are done at
+// a time, as three vectors of interleaved channels.
+template<int W>
+void ToneMapPixels( const float* rgb, int count, uint32_t* out, const ToneMapping& mapping, const PackedFormat& format )
+{
+	typedef typename ToneMapLanes<W>::Float Float;
+	typedef typename ToneMapLanes<W>::Int Int;
+
+	for( int first = 0; first < count; first += W )
+	{
+		int n = std::min( W, count - first );
+
+		//the last pixels of a row are copied so that whole vectors can be read
+		Float c[3];
+		if( n == W )
+			memcpy( c, rgb + 3 * first, sizeof(c) );
+		else
+		{
+			memset( c, 0, sizeof(c) );
+			memcpy( c, rgb + 3 * first, 3 * n * sizeof(float) );
+		}
+
+		Int bytes[3];
+		for( int i = 0; i < 3; i++ )
+			bytes[i] = ToneMapChannels<W>( c[i], mapping );
+
+		const int* channel = (const int*) bytes;
+		for( int p = 0; p < n; p++ )
+		{
+			out[first + p] = (uint32_t) channel[3 * p] << format.rshift | (uint32_t) channel[3 * p + 1] << format.gshift |
+				(uint32_t) channel[3 * p + 2] << format.bshift | format.alpha;
+		}
+	}
+}
@@ -0,0 +1,207 @@
+// Ray-triangle block test, see TriangleStore.h. Like PacketKernel.h this file
+// has no include guard because it is included once for every instruction set,
+// inside its own namespace and with the instruction set enabled by a pragma.
+
+template<int W>
+struct BlockLanes
+{
+	typedef float Float __attribute__((vector_size(W * sizeof(float))));
+	typedef int Mask __attribute__((vector_size(W * sizeof(int))));
+};
+
+// W triangles as their first vertex and two edges, one triangle per lane
+template<int W>
+struct LaneTriangles
+{
+	typedef typename BlockLanes<W>::Float Float;
+
+	Float v0x, v0y, v0z;
+	Float e1x, e1y, e1z;
+	Float e2x, e2y, e2z;
+};
+
+// Loads triangles first ... first + W - 1 of a block
+template<int W>
+inline void LoadTriangles( const TriangleBlock& block, int first, int count, LaneTriangles<W>& triangles )
+{
+	typedef typename BlockLanes<W>::Float Float;
+
+	triangles.v0x = *(const Float*) (block.v0x + first);
+	triangles.v0y = *(const Float*) (block.v0y + first);
+	triangles.v0z = *(const Float*) (block.v0z + first);
+	triangles.e1x = *(const Float*) (block.e1x + first);
+	triangles.e1y = *(const Float*) (block.e1y + first);
+	triangles.e1z = *(const Float*) (block.e1z + first);
+	triangles.e2x = *(const Float*) (block.e2x + first);
+	triangles.e2y = *(const Float*) (block.e2y + first);
+	triangles.e2z = *(const Float*) (block.e2z + first);
+}
+
+// Decodes triangles first ... first + W - 1 of the leaf of a compact mesh,
+// lanes past count are set to zero
+template<int W>
+inline void LoadTriangles( const CompactTriangles& leaf, int first, int count, LaneTriangles<W>& triangles )
+{
+	typedef typename BlockLanes<W>::Float Float;
+
+	Float q[9];
+	for( int l = 0; l < W; l++ )
+	{
+		bool used = first + l < count;
+		const MeshFace& face = leaf.faces[leaf.indices[used ? first + l : first]];
+		for( int k = 0; k < 3; k++ )
+		{
+			const QuantizedVertex& vertex = leaf.vertices[face.v[k]];
+			q[3 * k][l] = used ? vertex.x : 0;
+			q[3 * k + 1][l] = used ? vertex.y : 0;
+			q[3 * k + 2][l] = used ? vertex.z : 0;
+		}
+	}
+
+	const QuantizedFrame& frame = leaf.frame;
+	triangles.v0x = frame.origin.x + q[0] * frame.scale.x;
+	triangles.v0y = frame.origin.y + q[1] * frame.scale.y;
+	triangles.v0z = frame.origin.z + q[2] * frame.scale.z;
+	triangles.e1x = (q[3] - q[0]) * frame.scale.x;
+	triangles.e1y = (q[4] - q[1]) * frame.scale.y;
+	triangles.e1z = (q[5] - q[2]) * frame.scale.z;
+	triangles.e2x = (q[6] - q[0]) * frame.scale.x;
+	triangles.e2y = (q[7] - q[1]) * frame.scale.y;
+	triangles.e2z = (q[8] - q[2]) * frame.scale.z;
+}
+
+// Möller-Trumbore test of one ray against the first count triangles of a
+// block, or of the leaf of a compact mesh, W triangles at a time. Among the
+// triangles hit closer than maxDistance, the lane of the closest one is
+// returned and its distance and barycentric coordinates are put in t, u and
+// v. Returns -1 if no triangle is hit. numHits is increased by the number of
+// triangles the ray hits.
+template<int W, class Triangles>
+int BlockIntersection( const Triangles& block, int count, glm::vec3 start, glm::vec3 dir, float maxDistance,
+	float epsilon, float& t, float& u, float& v, long& numHits )
+{
+	typedef typename BlockLanes<W>::Float Float;
+	typedef typename BlockLanes<W>::Mask Mask;
+
+	int closest = -1;
+
+	for( int first = 0; first < count; first += W )
+	{
+		LaneTriangles<W> triangles;
+		LoadTriangles<W>( block, first, count, triangles );
+		const Float& v0x = triangles.v0x;
+		const Float& v0y = triangles.v0y;
+		const Float& v0z = triangles.v0z;
+		const Float& e1x = triangles.e1x;
+		const Float& e1y = triangles.e1y;
+		const Float& e1z = triangles.e1z;
+		const Float& e2x = triangles.e2x;
+		const Float& e2y = triangles.e2y;
+		const Float& e2z = triangles.e2z;
+
+		//p = dir x e2
+		Float px = dir.y * e2z - dir.z * e2y;
+		Float py = dir.z * e2x - dir.x * e2z;
+		Float pz = dir.x * e2y - dir.y * e2x;
+		Float det = e1x * px + e1y * py + e1z * pz;
+
+		//unused lanes get a determinant of one so that they do not divide by zero
+		Mask used;
+		for( int l = 0; l < W; l++ )
+			used[l] = first + l < count ? -1 : 0;
+		det = used ? det : det * 0 + 1;
+		Float invDet = 1.0f / det;
+
+		Float bx = start.x - v0x;
+		Float by = start.y - v0y;
+		Float bz = start.z - v0z;
+		Float lu = (bx * px + by * py + bz * pz) * invDet;
+
+		//q = b x e1
+		Float qx = by * e1z - bz * e1y;
+		Float qy = bz * e1x - bx * e1z;
+		Float qz = bx * e1y - by * e1x;
+		Float lv = (dir.x * qx + dir.y * qy + dir.z * qz) * invDet;
+		Float lt = (e2x * qx + e2y * qy + e2z * qz) * invDet;
+
+		Mask hit = used & (lt > epsilon) & (lu > -epsilon) & (lu <= 1 + epsilon) & (lv > -epsilon) & (lu + lv <= 1 + epsilon);
+
+		for( int l = 0; l < W; l++ )
+		{
+			if( hit[l] )
+			{
+				numHits++;
+				if( lt[l] < maxDistance )
+				{
+					maxDistance = lt[l];
+					closest = first + l;
+					t = lt[l];
+					u = lu[l];
+					v = lv[l];
+				}
+			}
+		}
+	}
+
+	return closest;
+}
+
+// Any hit version of BlockIntersection for shadow rays. Returns the lane of
+// the first triangle found that is hit closer than maxDistance, which need not
+// be the closest one, or -1 if no triangle is hit. Stops at the first group of
+// W triangles with a hit and computes nothing else.
+template<int W, class Triangles>
+int BlockOcclusion( const Triangles& block, int count, glm::vec3 start, glm::vec3 dir, float maxDistance,
+	float epsilon )
+{
+	typedef typename BlockLanes<W>::Float Float;
+	typedef typename BlockLanes<W>::Mask Mask;
+
+	for( int first = 0; first < count; first += W )
+	{
+		LaneTriangles<W> triangles;
+		LoadTriangles<W>( block, first, count, triangles );
+		const Float& v0x = triangles.v0x;
+		const Float& v0y = triangles.v0y;
+		const Float& v0z = triangles.v0z;
+		const Float& e1x = triangles.e1x;
+		const Float& e1y = triangles.e1y;
+		const Float& e1z = triangles.e1z;
+		const Float& e2x = triangles.e2x;
+		const Float& e2y = triangles.e2y;
+		const Float& e2z = triangles.e2z;
+
+		Float px = dir.y * e2z - dir.z * e2y;
+		Float py = dir.z * e2x - dir.x * e2z;
+		Float pz = dir.x * e2y - dir.y * e2x;
+		Float det = e1x * px + e1y * py + e1z * pz;
+
+		Mask used;
+		for( int l = 0; l < W; l++ )
+			used[l] = first + l < count ? -1 : 0;
+		det = used ? det : det * 0 + 1;
+		Float invDet = 1.0f / det;
+
+		Float bx = start.x - v0x;
+		Float by = start.y - v0y;
+		Float bz = start.z - v0z;
+		Float lu = (bx * px + by * py + bz * pz) * invDet;
+
+		Float qx = by * e1z - bz * e1y;
+		Float qy = bz * e1x - bx * e1z;
+		Float qz = bx * e1y - by * e1x;
+		Float lv = (dir.x * qx + dir.y * qy + dir.z * qz) * invDet;
+		Float lt = (e2x * qx + e2y * qy + e2z * qz) * invDet;
+
+		Mask hit = used & (lt > epsilon) & (lt < maxDistance) & (lu > -epsilon) & (lu <= 1 + epsilon) &
+			(lv > -epsilon) & (lu + lv <= 1 + epsilon);
+
+		for( int l = 0; l < W; l++ )
+		{
+			if( hit[l] )
+				return first + l;
+		}
+	}
+
+	return -1;
+}
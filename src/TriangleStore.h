@@ -0,0 +1,283 @@
+#ifndef TRIANGLE_STORE_H
+#define TRIANGLE_STORE_H
+
+// Copy of the triangles of a Mesh holding only what the ray-triangle test
+// needs: the first vertex and the two edges. The triangles are stored in
+// blocks of TRIANGLE_BLOCK_SIZE in structure of arrays layout, every BVH leaf
+// starting at a new block, so that a leaf is tested with aligned vector loads.
+// Colors and normals are only looked up in the Mesh once the closest
+// intersection is known.
+//
+// Compact meshes have no blocks: their positions are quantized to 16 bits and
+// the intersection tests decode the triangles of a leaf from the faces and
+// vertices of the mesh (see CompactTriangles), trading speed for memory.
+
+#include <glm/glm.hpp>
+#include <vector>
+#include <cstring>
+#include <algorithm>
+#include <cmath>
+#include <stdint.h>
+#include "BVH.h"
+#include "ThreadPool.h"
+
+const int TRIANGLE_BLOCK_SIZE = 8;
+
+// A triangle of an indexed mesh: the indices of its vertices and of its color
+struct MeshFace
+{
+	uint32_t v[3];
+	uint32_t color;
+};
+
+// A vertex position quantized to 16 bits per coordinate, see QuantizedFrame
+struct QuantizedVertex
+{
+	uint16_t x;
+	uint16_t y;
+	uint16_t z;
+};
+
+// The box quantized positions are relative to: a position q stands for
+// origin + q * scale, which spreads the 65536 values of a coordinate over the
+// extent of the box
+struct QuantizedFrame
+{
+	glm::vec3 origin;
+	glm::vec3 scale;
+
+	void Fit( glm::vec3 Pmin, glm::vec3 Pmax )
+	{
+		origin = Pmin;
+		scale = (Pmax - Pmin) / 65535.0f;
+	}
+
+	QuantizedVertex Encode( glm::vec3 p ) const
+	{
+		QuantizedVertex q;
+		q.x = Quantize( p.x, origin.x, scale.x );
+		q.y = Quantize( p.y, origin.y, scale.y );
+		q.z = Quantize( p.z, origin.z, scale.z );
+		return q;
+	}
+
+	glm::vec3 Decode( const QuantizedVertex& q ) const
+	{
+		return glm::vec3( origin.x + q.x * scale.x, origin.y + q.y * scale.y, origin.z + q.z * scale.z );
+	}
+
+	static uint16_t Quantize( float x, float origin, float scale )
+	{
+		if( scale <= 0 )
+			return 0;
+		float q = std::round( (x - origin) / scale );
+		return (uint16_t) std::min( std::max( q, 0.0f ), 65535.0f );
+	}
+};
+
+// The triangles of a leaf of a compact mesh as the intersection tests read
+// them: the faces of the leaf are faces[indices[0]], faces[indices[1]], ...
+struct CompactTriangles
+{
+	const int* indices;
+	const MeshFace* faces;
+	const QuantizedVertex* vertices;
+	QuantizedFrame frame;
+};
+
+struct alignas(32) TriangleBlock
+{
+	float v0x[TRIANGLE_BLOCK_SIZE];
+	float v0y[TRIANGLE_BLOCK_SIZE];
+	float v0z[TRIANGLE_BLOCK_SIZE];
+	float e1x[TRIANGLE_BLOCK_SIZE];
+	float e1y[TRIANGLE_BLOCK_SIZE];
+	float e1z[TRIANGLE_BLOCK_SIZE];
+	float e2x[TRIANGLE_BLOCK_SIZE];
+	float e2y[TRIANGLE_BLOCK_SIZE];
+	float e2z[TRIANGLE_BLOCK_SIZE];
+
+	// Index of the triangle in Mesh::faces, -1 for unused lanes
+	int triangleIndex[TRIANGLE_BLOCK_SIZE];
+};
+
+class TriangleStore
+{
+public:
+	SceneArray<TriangleBlock> blocks;
+
+	// First block of every leaf of the BVH, indexed like BVH::nodes. The leaf
+	// occupies blocks leafBlock[n] ... leafBlock[n] + (count-1)/TRIANGLE_BLOCK_SIZE
+	SceneArray<int> leafBlock;
+
+	// Fills the blocks from the vertices of the triangles, grouped by the
+	// leaves of the BVH built over them. mesh.Positions( i, v0, v1, v2 ) gives
+	// the vertices of triangle i.
+	template<class Geometry>
+	void Build( const Geometry& mesh, const BVH& bvh )
+	{
+		Layout( bvh );
+		for( size_t n = 0; n < bvh.nodes.size(); n++ )
+			FillLeaf( mesh, bvh, n );
+	}
+
+	// Build with the leaves filled in parallel
+	template<class Geometry>
+	void Build( const Geometry& mesh, const BVH& bvh, ThreadPool& pool )
+	{
+		Layout( bvh );
+		Update( mesh, bvh, pool );
+	}
+
+	// Copies the vertices of the triangles again after they moved, for a BVH
+	// that was refitted and so has the leaves the blocks were built for
+	template<class Geometry>
+	void Update( const Geometry& mesh, const BVH& bvh, ThreadPool& pool )
+	{
+		int numNodes = bvh.nodes.size();
+		int numChunks = std::min( 4 * pool.NumThreads(), numNodes );
+		pool.ParallelFor( numChunks, [&]( int chunk, int thread )
+		{
+			int end = (long) numNodes * (chunk + 1) / numChunks;
+			for( int n = (long) numNodes * chunk / numChunks; n < end; n++ )
+				FillLeaf( mesh, bvh, n );
+		} );
+	}
+
+private:
+	// Assigns the blocks of every leaf, in the order of the triangles of the
+	// leaves in BVH::indices, so that the blocks of a range of triangles are
+	// a range of blocks as well
+	void Layout( const BVH& bvh )
+	{
+		std::vector<int> leaves;
+		for( size_t n = 0; n < bvh.nodes.size(); n++ )
+		{
+			if( bvh.nodes[n].count > 0 )
+				leaves.push_back( n );
+		}
+		std::sort( leaves.begin(), leaves.end(), [&]( int a, int b )
+		{
+			return bvh.nodes[a].first < bvh.nodes[b].first;
+		} );
+
+		leafBlock.assign( bvh.nodes.size(), -1 );
+		int numBlocks = 0;
+		for( size_t l = 0; l < leaves.size(); l++ )
+		{
+			leafBlock[leaves[l]] = numBlocks;
+			numBlocks += (bvh.nodes[leaves[l]].count + TRIANGLE_BLOCK_SIZE - 1) / TRIANGLE_BLOCK_SIZE;
+		}
+		blocks.resize( numBlocks );
+	}
+
+	template<class Geometry>
+	void FillLeaf( const Geometry& mesh, const BVH& bvh, int n )
+	{
+		const BVHNode& node = bvh.nodes[n];
+		if( node.count == 0 )
+			return;
+
+		for( int i = 0; i < node.count; i++ )
+		{
+			TriangleBlock& block = blocks[leafBlock[n] + i / TRIANGLE_BLOCK_SIZE];
+			int lane = i % TRIANGLE_BLOCK_SIZE;
+			if( lane == 0 )
+			{
+				memset( &block, 0, sizeof(block) );
+				for( int l = 0; l < TRIANGLE_BLOCK_SIZE; l++ )
+					block.triangleIndex[l] = -1;
+			}
+
+			int index = bvh.indices[node.first + i];
+			glm::vec3 v0, v1, v2;
+			mesh.Positions( index, v0, v1, v2 );
+			glm::vec3 e1 = v1 - v0;
+			glm::vec3 e2 = v2 - v0;
+
+			block.v0x[lane] = v0.x;
+			block.v0y[lane] = v0.y;
+			block.v0z[lane] = v0.z;
+			block.e1x[lane] = e1.x;
+			block.e1y[lane] = e1.y;
+			block.e1z[lane] = e1.z;
+			block.e2x[lane] = e2.x;
+			block.e2y[lane] = e2.y;
+			block.e2z[lane] = e2.z;
+			block.triangleIndex[lane] = index;
+		}
+	}
+};
+
+// Kernels testing a ray against a block, see TriangleKernel.h
+namespace TriangleKernelBaseline
+{
+#include "TriangleKernel.h"
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+#pragma GCC push_options
+#pragma GCC target("avx2,fma")
+namespace TriangleKernelAVX2
+{
+#include "TriangleKernel.h"
+}
+#pragma GCC pop_options
+#endif
+
+typedef int (*BlockIntersectionFunction)( const TriangleBlock& block, int count, glm::vec3 start, glm::vec3 dir,
+	float maxDistance, float epsilon, float& t, float& u, float& v, long& numHits );
+
+// Block test for the CPU running the program, which tests all triangles of a
+// block at once if it supports AVX2 and four at a time otherwise
+BlockIntersectionFunction BlockKernel()
+{
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_cpu_init();
+	if( __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma") )
+		return TriangleKernelAVX2::BlockIntersection<8, TriangleBlock>;
+#endif
+	return TriangleKernelBaseline::BlockIntersection<4, TriangleBlock>;
+}
+
+typedef int (*BlockOcclusionFunction)( const TriangleBlock& block, int count, glm::vec3 start, glm::vec3 dir,
+	float maxDistance, float epsilon );
+
+// Any hit block test for the CPU running the program, see BlockKernel
+BlockOcclusionFunction BlockOcclusionKernel()
+{
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_cpu_init();
+	if( __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma") )
+		return TriangleKernelAVX2::BlockOcclusion<8, TriangleBlock>;
+#endif
+	return TriangleKernelBaseline::BlockOcclusion<4, TriangleBlock>;
+}
+
+typedef int (*CompactIntersectionFunction)( const CompactTriangles& leaf, int count, glm::vec3 start, glm::vec3 dir,
+	float maxDistance, float epsilon, float& t, float& u, float& v, long& numHits );
+typedef int (*CompactOcclusionFunction)( const CompactTriangles& leaf, int count, glm::vec3 start, glm::vec3 dir,
+	float maxDistance, float epsilon );
+
+// Tests of the leaves of compact meshes, see BlockKernel
+CompactIntersectionFunction CompactKernel()
+{
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_cpu_init();
+	if( __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma") )
+		return TriangleKernelAVX2::BlockIntersection<8, CompactTriangles>;
+#endif
+	return TriangleKernelBaseline::BlockIntersection<4, CompactTriangles>;
+}
+
+CompactOcclusionFunction CompactOcclusionKernel()
+{
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_cpu_init();
+	if( __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma") )
+		return TriangleKernelAVX2::BlockOcclusion<8, CompactTriangles>;
+#endif
+	return TriangleKernelBaseline::BlockOcclusion<4, CompactTriangles>;
+}
+
+#endif
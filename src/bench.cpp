@@ -0,0 +1,419 @@
+#include <iostream>
+#include <glm/glm.hpp>
+#include <glm/gtc/matrix_transform.hpp>
+#include "Renderer.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+
+//Benchmark of the renderer. Every scene is rendered along every camera path, the frame times
+//and the work done per frame are written as JSON. Nothing but the rendering is timed, with
+//--animate the time taken to move the last object of the scene every frame is reported on its own.
+
+//structure holding the camera and light at one point of a camera path
+struct Keyframe
+{
+	vec3 cameraPos;
+	float yaw;
+	vec3 lightPos;
+};
+
+//structure holding a scripted camera path, the camera and light move linearly between the keyframes
+struct CameraPath
+{
+	string name;
+	vector<Keyframe> keyframes;
+};
+
+//structure holding the results of rendering a scene along a camera path
+struct BenchResult
+{
+	string scene;
+	string path;
+	int numTriangles;
+	size_t sceneBytes;
+	float buildTime;
+	vector<float> frameTimes;
+	vector<float> updateTimes;
+	Statistics statistics;
+};
+
+/* ----------------------------------------------------------------------------*/
+/* GLOBAL VARIABLES                                                            */
+
+//Benchmark settings, every path is rendered numWarmup times before it is timed numIterations
+//times. A path is numPathFrames frames long
+int numWarmup = 1;
+int numIterations = 5;
+int numPathFrames = 8;
+vector<string> sceneNames;
+string outputFile;
+
+//How the last object of the scene is moved every frame, "" when nothing moves, "refit" or "rebuild"
+//for the update of its hierarchy. It turns by animationAngle radians a frame about its centre
+string animation;
+const float animationAngle = 0.1f;
+
+//Whether frames may reuse the primary intersections the renderer keeps while the camera stands
+//still. By default they are dropped before every frame, so that every frame traces its primary rays
+bool reuseHits = false;
+
+const char* allScenes[] = {"cornell", "spheres", "spheres-large"};
+
+/* ----------------------------------------------------------------------------*/
+/* FUNCTIONS                                                                   */
+
+void PrintUsage(const char* program) {
+	cout << "Usage: " << program << " [options]" << endl;
+	cout << "  --threads N            number of render threads" << endl;
+	cout << "  --packet 1|4|8|16      width of primary ray packets, 1 disables them" << endl;
+	cout << "  --width N              width of the image in pixels" << endl;
+	cout << "  --height N             height of the image in pixels" << endl;
+	cout << "  --samples N            antialiasing samples per pixel, a square number" << endl;
+	cout << "  --shadows soft|hard    soft shadows sample the light at several points" << endl;
+	cout << "  --wavefront            trace the shadow rays of a tile together, sorted by direction" << endl;
+	cout << "                         and origin" << endl;
+	cout << "  --adaptive T           luminance threshold of adaptive antialiasing, 0 disables it" << endl;
+	cout << "  --reprojection N       frames between shading pixels again when reprojecting, 0" << endl;
+	cout << "                         disables reprojection" << endl;
+	cout << "  --irradiance E         compute the indirect light with an irradiance cache of error E" << endl;
+	cout << "  --compact              store the meshes with 16 bit vertices and no triangle blocks" << endl;
+	cout << "  --cache FILE           scene cache, needed to render out of core" << endl;
+	cout << "  --resident MB          render out of core aiming to keep MB megabytes of the meshes" << endl;
+	cout << "                         in memory" << endl;
+	cout << "  --reuse-hits           let frames reuse the primary intersections of the last frame" << endl;
+	cout << "                         while the camera stands still" << endl;
+	cout << "  --animate refit|rebuild turn the last object of the scene every frame and refit or" << endl;
+	cout << "                         rebuild its hierarchy" << endl;
+	cout << "  --scene NAME           scene to render, cornell, spheres, spheres-large or an OBJ or" << endl;
+	cout << "                         PLY file. Can be given more than once, the first three scenes" << endl;
+	cout << "                         are rendered by default" << endl;
+	cout << "  --warmup N             untimed runs of every camera path" << endl;
+	cout << "  --iterations N         timed runs of every camera path" << endl;
+	cout << "  --frames N             frames per camera path" << endl;
+	cout << "  --output FILE          write the results to FILE instead of the standard output" << endl;
+}
+
+vector<CameraPath> CameraPaths() {
+	vector<CameraPath> paths;
+
+	//the starting view of the interactive program
+	CameraPath front = {"front", {{vec3(0,0,-3.001), 0, vec3(0,-0.5,-0.7)}}};
+	paths.push_back(front);
+
+	//the camera circles around the centre of the box while looking at it
+	CameraPath orbit = {"orbit", {
+		{3.001f * vec3(sin(0.5f),0,-cos(0.5f)), -0.5f, vec3(0,-0.5,-0.7)},
+		{vec3(0,0,-3.001), 0, vec3(0,-0.5,-0.7)},
+		{3.001f * vec3(-sin(0.5f),0,-cos(0.5f)), 0.5f, vec3(0,-0.5,-0.7)}}};
+	paths.push_back(orbit);
+
+	//the camera walks into the box and turns while the light moves through it
+	CameraPath walk = {"walk", {
+		{vec3(0,0,-3.001), 0, vec3(-0.5,-0.5,-0.7)},
+		{vec3(0,0,-0.2), 0.3f, vec3(0.5,-0.5,0.3)}}};
+	paths.push_back(walk);
+
+	return paths;
+}
+
+//Set the camera and light to frame of the numPathFrames frames of path
+void SetPathFrame(const CameraPath& path, int frame) {
+	const vector<Keyframe>& keys = path.keyframes;
+
+	float s = numPathFrames > 1 ? (float) frame / (numPathFrames - 1) * (keys.size() - 1) : 0;
+	int k = min((int) s, (int) keys.size() - 1);
+	int next = min(k + 1, (int) keys.size() - 1);
+	float f = s - k;
+
+	cameraPos = (1 - f) * keys[k].cameraPos + f * keys[next].cameraPos;
+	yaw = (1 - f) * keys[k].yaw + f * keys[next].yaw;
+	lightPos = (1 - f) * keys[k].lightPos + f * keys[next].lightPos;
+	updateRotationMatrix();
+}
+
+//Turn the last object of the scene about the vertical axis through its centre
+void AnimateScene() {
+	const Object& object = objects.back();
+	vec3 centre = 0.5f * (object.Pmin + object.Pmax);
+	mat4 transform = glm::translate(mat4(1), centre) * glm::rotate(mat4(1), animationAngle, vec3(0,1,0)) *
+		glm::translate(mat4(1), -centre);
+	TransformObject(objects.size() - 1, transform, animation == "rebuild");
+}
+
+//Render the frames of path numWarmup + numIterations times and record the times of the last numIterations
+void RunPath(const CameraPath& path, BenchResult& result) {
+	for(int iteration = 0; iteration < numWarmup + numIterations; iteration++) {
+		for(int frame = 0; frame < numPathFrames; frame++) {
+			SetPathFrame(path, frame);
+			frameStatistics = Statistics();
+
+			if(!animation.empty()) {
+				chrono::steady_clock::time_point start = chrono::steady_clock::now();
+				AnimateScene();
+				float dt = chrono::duration<float, milli>(chrono::steady_clock::now() - start).count();
+				if(iteration >= numWarmup) {
+					result.updateTimes.push_back(dt);
+				}
+			}
+
+			if(!reuseHits) {
+				fill(gbufferState.begin(), gbufferState.end(), 0);
+			}
+
+			chrono::steady_clock::time_point start = chrono::steady_clock::now();
+			raytracing();
+			float dt = chrono::duration<float, milli>(chrono::steady_clock::now() - start).count();
+
+			if(iteration >= numWarmup) {
+				result.frameTimes.push_back(dt);
+				AddStatistics(result.statistics, frameStatistics);
+			}
+		}
+	}
+}
+
+//The p-th percentile of the values, using the nearest rank
+float Percentile(vector<float> values, float p) {
+	sort(values.begin(), values.end());
+	int rank = (int) ceil(p / 100 * values.size());
+	return values[max(rank - 1, 0)];
+}
+
+//The text as the contents of a JSON string, with quotes, backslashes and control characters escaped
+string JsonEscape(const string& text) {
+	string escaped;
+	for(unsigned int i = 0; i < text.size(); i++) {
+		unsigned char c = text[i];
+		if(c == '"' || c == '\\') {
+			escaped += '\\';
+			escaped += c;
+		}
+		else if(c < 0x20) {
+			char code[8];
+			snprintf(code, sizeof(code), "\\u%04x", c);
+			escaped += code;
+		}
+		else {
+			escaped += c;
+		}
+	}
+	return escaped;
+}
+
+void WriteResults(FILE* file, const vector<BenchResult>& results) {
+	fprintf(file, "{\n");
+	fprintf(file, "  \"width\": %d,\n", screenWidth);
+	fprintf(file, "  \"height\": %d,\n", screenHeight);
+	fprintf(file, "  \"samples\": %d,\n", antiAliasingCells);
+	fprintf(file, "  \"softShadows\": %s,\n", softShadows ? "true" : "false");
+	fprintf(file, "  \"wavefront\": %s,\n", wavefront ? "true" : "false");
+	fprintf(file, "  \"compact\": %s,\n", compactMeshes ? "true" : "false");
+	fprintf(file, "  \"residentBytes\": %zu,\n", geometryBudget);
+	fprintf(file, "  \"reuseHits\": %s,\n", reuseHits ? "true" : "false");
+	fprintf(file, "  \"animation\": \"%s\",\n", animation.empty() ? "none" : JsonEscape(animation).c_str());
+	fprintf(file, "  \"adaptiveThreshold\": %g,\n", adaptiveThreshold);
+	fprintf(file, "  \"reprojectionPeriod\": %d,\n", reprojectionPeriod);
+	fprintf(file, "  \"irradianceError\": %g,\n", irradianceError);
+	fprintf(file, "  \"threads\": %d,\n", threadPool->NumThreads());
+	fprintf(file, "  \"packetWidth\": %d,\n", packetWidth);
+	fprintf(file, "  \"warmup\": %d,\n", numWarmup);
+	fprintf(file, "  \"iterations\": %d,\n", numIterations);
+	fprintf(file, "  \"framesPerPath\": %d,\n", numPathFrames);
+	fprintf(file, "  \"statistics\": %s,\n", statisticsEnabled ? "true" : "false");
+	fprintf(file, "  \"results\": [\n");
+
+	for(unsigned int i = 0; i < results.size(); i++) {
+		const BenchResult& r = results[i];
+		float total = 0;
+		for(unsigned int f = 0; f < r.frameTimes.size(); f++) {
+			total += r.frameTimes[f];
+		}
+		long n = r.frameTimes.size();
+		long numRays = r.statistics.numPrimaryRays + r.statistics.numShadowRays + r.statistics.numIndirectRays;
+
+		fprintf(file, "    {\n");
+		fprintf(file, "      \"scene\": \"%s\",\n", JsonEscape(r.scene).c_str());
+		fprintf(file, "      \"path\": \"%s\",\n", JsonEscape(r.path).c_str());
+		fprintf(file, "      \"triangles\": %d,\n", r.numTriangles);
+		fprintf(file, "      \"sceneBytes\": %zu,\n", r.sceneBytes);
+		fprintf(file, "      \"buildMs\": %.3f,\n", r.buildTime);
+		fprintf(file, "      \"frames\": %ld,\n", n);
+		fprintf(file, "      \"medianMs\": %.3f,\n", Percentile(r.frameTimes, 50));
+		fprintf(file, "      \"p95Ms\": %.3f,\n", Percentile(r.frameTimes, 95));
+		fprintf(file, "      \"meanMs\": %.3f,\n", total / n);
+		fprintf(file, "      \"minMs\": %.3f,\n", *min_element(r.frameTimes.begin(), r.frameTimes.end()));
+		fprintf(file, "      \"maxMs\": %.3f,\n", *max_element(r.frameTimes.begin(), r.frameTimes.end()));
+		if(!r.updateTimes.empty()) {
+			fprintf(file, "      \"updateMedianMs\": %.3f,\n", Percentile(r.updateTimes, 50));
+			fprintf(file, "      \"updateMaxMs\": %.3f,\n", *max_element(r.updateTimes.begin(), r.updateTimes.end()));
+		}
+		fprintf(file, "      \"raysPerSecond\": %.0f,\n", numRays / (total / 1000));
+		fprintf(file, "      \"perFrame\": {\n");
+		fprintf(file, "        \"numPrimaryRays\": %ld,\n", r.statistics.numPrimaryRays / n);
+		fprintf(file, "        \"numIndirectRays\": %ld,\n", r.statistics.numIndirectRays / n);
+		fprintf(file, "        \"numIrradianceRecords\": %ld,\n", r.statistics.numIrradianceRecords / n);
+		fprintf(file, "        \"numDeferredTests\": %ld,\n", r.statistics.numDeferredTests / n);
+		fprintf(file, "        \"numPageLoads\": %ld,\n", r.statistics.numPageLoads / n);
+		if(statisticsEnabled) {
+			//the counters of the traversal are only kept when the statistics are enabled
+			fprintf(file, "        \"numShadowRays\": %ld,\n", r.statistics.numShadowRays / n);
+			fprintf(file, "        \"numTraversalSteps\": %ld,\n", r.statistics.numTraversalSteps / n);
+			fprintf(file, "        \"numRayBoxTests\": %ld,\n", r.statistics.numRayBoxTests / n);
+			fprintf(file, "        \"numRayTrianglesTests\": %ld,\n", r.statistics.numRayTrianglesTests / n);
+			fprintf(file, "        \"numRayTrianglesIntersections\": %ld,\n", r.statistics.numRayTrianglesIntersections / n);
+			fprintf(file, "        \"numOccluderCacheHits\": %ld,\n", r.statistics.numOccluderCacheHits / n);
+			fprintf(file, "        \"numReprojectedPixels\": %ld,\n", r.statistics.numReprojectedPixels / n);
+			fprintf(file, "        \"numAllocations\": %ld\n", r.statistics.numAllocations / n);
+		}
+		else {
+			fprintf(file, "        \"numShadowRays\": %ld\n", r.statistics.numShadowRays / n);
+		}
+		fprintf(file, "      }\n");
+		fprintf(file, "    }%s\n", i + 1 < results.size() ? "," : "");
+	}
+
+	fprintf(file, "  ]\n");
+	fprintf(file, "}\n");
+}
+
+int main(int argc, char* argv[]) {
+
+	//smaller images than the interactive program so that the larger scenes finish in reasonable time
+	screenWidth = 256;
+	screenHeight = 256;
+
+	for(int i = 1; i < argc; i++) {
+		if(strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+			numThreads = atoi(argv[++i]);
+		}
+		else if(strcmp(argv[i], "--packet") == 0 && i + 1 < argc) {
+			//never use wider packets than the CPU supports
+			packetWidth = min(atoi(argv[++i]), packetWidth);
+		}
+		else if(strcmp(argv[i], "--width") == 0 && i + 1 < argc) {
+			screenWidth = atoi(argv[++i]);
+		}
+		else if(strcmp(argv[i], "--height") == 0 && i + 1 < argc) {
+			screenHeight = atoi(argv[++i]);
+		}
+		else if(strcmp(argv[i], "--samples") == 0 && i + 1 < argc) {
+			antiAliasingCells = atoi(argv[++i]);
+		}
+		else if(strcmp(argv[i], "--shadows") == 0 && i + 1 < argc) {
+			softShadows = strcmp(argv[++i], "hard") != 0;
+		}
+		else if(strcmp(argv[i], "--wavefront") == 0) {
+			wavefront = true;
+		}
+		else if(strcmp(argv[i], "--adaptive") == 0 && i + 1 < argc) {
+			adaptiveThreshold = atof(argv[++i]);
+		}
+		else if(strcmp(argv[i], "--reprojection") == 0 && i + 1 < argc) {
+			reprojectionPeriod = atoi(argv[++i]);
+		}
+		else if(strcmp(argv[i], "--irradiance") == 0 && i + 1 < argc) {
+			irradianceError = atof(argv[++i]);
+		}
+		else if(strcmp(argv[i], "--compact") == 0) {
+			compactMeshes = true;
+		}
+		else if(strcmp(argv[i], "--cache") == 0 && i + 1 < argc) {
+			sceneCacheFile = argv[++i];
+		}
+		else if(strcmp(argv[i], "--resident") == 0 && i + 1 < argc) {
+			geometryBudget = (size_t) (atof(argv[++i]) * 1048576);
+		}
+		else if(strcmp(argv[i], "--reuse-hits") == 0) {
+			reuseHits = true;
+		}
+		else if(strcmp(argv[i], "--animate") == 0 && i + 1 < argc) {
+			animation = argv[++i];
+			if(animation != "refit" && animation != "rebuild") {
+				PrintUsage(argv[0]);
+				return 1;
+			}
+		}
+		else if(strcmp(argv[i], "--scene") == 0 && i + 1 < argc) {
+			sceneNames.push_back(argv[++i]);
+		}
+		else if(strcmp(argv[i], "--warmup") == 0 && i + 1 < argc) {
+			numWarmup = atoi(argv[++i]);
+		}
+		else if(strcmp(argv[i], "--iterations") == 0 && i + 1 < argc) {
+			numIterations = atoi(argv[++i]);
+		}
+		else if(strcmp(argv[i], "--frames") == 0 && i + 1 < argc) {
+			numPathFrames = atoi(argv[++i]);
+		}
+		else if(strcmp(argv[i], "--output") == 0 && i + 1 < argc) {
+			outputFile = argv[++i];
+		}
+		else {
+			PrintUsage(argv[0]);
+			return 1;
+		}
+	}
+
+	int rowLength = sqrt(antiAliasingCells);
+	if(screenWidth < 1 || screenHeight < 1 || antiAliasingCells < 1 || rowLength * rowLength != antiAliasingCells ||
+		numWarmup < 0 || numIterations < 1 || numPathFrames < 1) {
+		PrintUsage(argv[0]);
+		return 1;
+	}
+
+	if(sceneNames.empty()) {
+		sceneNames.assign(allScenes, allScenes + sizeof(allScenes) / sizeof(allScenes[0]));
+	}
+
+	if(numThreads < 1) {
+		numThreads = 1;
+	}
+
+	ThreadPool pool(numThreads);
+	InitializeRenderer(pool);
+
+	vector<CameraPath> paths = CameraPaths();
+	vector<BenchResult> results;
+
+	for(unsigned int s = 0; s < sceneNames.size(); s++) {
+		chrono::steady_clock::time_point start = chrono::steady_clock::now();
+		string error;
+		if(!LoadScene(sceneNames[s], error)) {
+			cerr << error << endl;
+			return 1;
+		}
+		float buildTime = chrono::duration<float, milli>(chrono::steady_clock::now() - start).count();
+
+		int numTriangles = 0;
+		for(unsigned int j = 0; j < objects.size(); j++) {
+			numTriangles += objects[j].mesh->NumTriangles();
+		}
+
+		for(unsigned int p = 0; p < paths.size(); p++) {
+			cerr << "Rendering " << sceneNames[s] << " along " << paths[p].name << endl;
+
+			BenchResult result;
+			result.scene = sceneNames[s];
+			result.path = paths[p].name;
+			result.numTriangles = numTriangles;
+			result.sceneBytes = SceneMemoryUsage();
+			result.buildTime = buildTime;
+			result.statistics = Statistics();
+			RunPath(paths[p], result);
+			results.push_back(result);
+		}
+	}
+
+	FILE* file = outputFile.empty() ? stdout : fopen(outputFile.c_str(), "w");
+	if(!file) {
+		cerr << "Could not write " << outputFile << endl;
+		return 1;
+	}
+	WriteResults(file, results);
+	if(file != stdout) {
+		fclose(file);
+	}
+
+	return 0;
+}
@@ -2,559 +2,593 @@
 #include <glm/glm.hpp>
 #include <SDL.h>
 #include "SDLauxiliary.h"
-#include "TestModel.h"
-#include "limits.h"
-
-using namespace std;
-using glm::vec3;
-using glm::mat3;
-
-//structure used to hold information about the intersection of a ray and a triangle
-struct Intersection
-{
-	vec3 position;
-	float distance;
-	int objectIndex;
-	int triangleIndex;
-};
+#include "Renderer.h"
+#include "ImageIO.h"
+#include "ToneMap.h"
+#include "FrameGovernor.h"
+#include <chrono>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
 
 /* ----------------------------------------------------------------------------*/
 /* GLOBAL VARIABLES                                                            */
 
-const float PI = 3.1415926535897;
-
-//Screen information
-const int SCREEN_WIDTH = 500;
-const int SCREEN_HEIGHT = 500;
 SDL_Surface* screen;
-int t;
-
-//Scene information
-vector<Object> objects;
-
-//Camera information
-const float focalLength = 500;
-vec3 cameraPos(0,0,-3.001);
-mat3 cameraRot(vec3(1,0,0),vec3(0,1,0),vec3(0,0,1));
-float yaw = 0;
-
-//Light information
-vec3 lightPos(0, -0.5, -0.7);
-const vec3 lightColor = 14.f * vec3(1,1,1);
-const vec3 indirectLight = 0.5f * vec3(1,1,1);
-const float lightRadius = 0.03;
-
-//Update information
-const float posDelta = 0.1;
-const float rotDelta = 0.1;
-const float lightDelta = 0.1;
-
-//The number of samples taken in antialiasing
-//must be a square number
-int antiAliasingCells = 4;
 
-//Floating point inaccuracy constant
-const float epsilon = 0.00001;
-
-//Statistics
-int numRayBoxTests = 0;
-int numRayTrianglesTests = 0;
-int numRayTrianglesIntersections = 0;
-int numPrimaryRays = 0;
-
-//raytracer features
-const bool antiAliasing = true;
-const bool softShadows = true;
+//Headless rendering, numFrames frames are rendered without a window and written to outputFile
+bool headless = false;
+int numFrames = 1;
+string outputFile = "render.png";
+
+//Write the cost of every pixel next to every rendered frame, needs the statistics to be enabled
+bool heatmap = false;
+
+//Conversion of the rendered radiance to the screen and to PPM and PNG files, see ToneMap.h
+ToneMapping toneMapping;
+
+//Scene to render, see LoadScene
+string sceneName = "cornell";
+
+//Update information, speeds per second of the camera and the light while a key is held
+const float posSpeed = 1.0;
+const float rotSpeed = 1.0;
+const float lightSpeed = 1.0;
+
+//Interactive rendering, frames are rendered on renderThread while the main thread handles input
+//and shows them, so input is never blocked by a frame being rendered. The main thread moves
+//view and publishes it in pendingView, the render thread copies pendingView to the camera and
+//light at the start of every frame. A finished frame is tone mapped into backBuffer, which is
+//swapped with frontBuffer for the main thread to show. Moving the view cancels the frame being
+//rendered unless the previous one was cancelled too, so frames keep being shown while a key is
+//held. frameMutex guards everything shared by the two threads.
+struct View {
+	vec3 cameraPos;
+	float yaw;
+	vec3 lightPos;
+};
+View view;
+View pendingView;
+int viewVersion = 0;
+bool quitRendering = false;
+bool lastFrameCancelled = false;
+vector<uint32_t> backBuffer;
+vector<uint32_t> frontBuffer;
+bool newFrame = false;
+mutex frameMutex;
+condition_variable viewChanged;
+condition_variable frameFinished;
+
+//Time the main thread waits for a new frame before it handles input again, in milliseconds
+const int inputPeriod = 10;
+
+//Render time in milliseconds that frames are kept within while the view moves, by rendering them
+//at a lower resolution and upscaling them to the window, see FrameGovernor.h. Once the view stands
+//still a frame of full quality is rendered. 0 renders every frame at full quality
+float frameBudget = 0;
+int windowWidth;
+int windowHeight;
 
 /* ----------------------------------------------------------------------------*/
 /* FUNCTIONS                                                                   */
-bool ClosestIntersection(vec3 start, vec3 dir, const vector<Object>& objects, Intersection& closestIntersection);
-void Update();
-void Draw();
-vec3 DirectLight(const Intersection& i);
-
-int main() {
-
-	if(!antiAliasing) {
-		antiAliasingCells = 1;
-	}
-
-	LoadTestModelO(objects);
-	screen = InitializeSDL( SCREEN_WIDTH, SCREEN_HEIGHT );
-
-	while( NoQuitMessageSDL() )
-	{
-		Draw();
-		Update();
-	}
-
-	SDL_SaveBMP( screen, "screenshot.bmp" );	
-
-	return 0;
+void Update(float dt);
+void RenderLoop();
+bool Present(int timeout);
+
+void PrintUsage(const char* program) {
+	cout << "Usage: " << program << " [options]" << endl;
+	cout << "  --threads N            number of render threads" << endl;
+	cout << "  --packet 1|4|8|16      width of primary ray packets, 1 disables them" << endl;
+	cout << "  --width N              width of the image in pixels" << endl;
+	cout << "  --height N             height of the image in pixels" << endl;
+	cout << "  --samples N            antialiasing samples per pixel, a square number" << endl;
+	cout << "  --shadows soft|hard    soft shadows sample the light at several points" << endl;
+	cout << "  --wavefront            trace the shadow rays of a tile together, sorted by direction" << endl;
+	cout << "                         and origin" << endl;
+	cout << "  --adaptive T           only give pixels next to edges all samples, an edge being a" << endl;
+	cout << "                         change of triangle or of luminance by more than T, 0 gives" << endl;
+	cout << "                         every pixel all samples" << endl;
+	cout << "  --reprojection N       reuse the shading of the last frame while the camera moves," << endl;
+	cout << "                         shading every pixel again at least every N frames, 0 turns" << endl;
+	cout << "                         it off. Needs adaptive antialiasing or one sample per pixel" << endl;
+	cout << "                         and does nothing in progressive frames" << endl;
+	cout << "  --irradiance E         compute the indirect light with an irradiance cache, whose" << endl;
+	cout << "                         records are used within the error E, 0 gives a constant" << endl;
+	cout << "                         indirect light" << endl;
+	cout << "  --budget MS            lower the resolution of frames while the view moves so that" << endl;
+	cout << "                         they render in MS milliseconds, 0 turns it off" << endl;
+	cout << "  --camera X Y Z YAW     camera position and rotation around the y axis" << endl;
+	cout << "  --light X Y Z          light position" << endl;
+	cout << "  --scene NAME           cornell, spheres, spheres-large or an OBJ or PLY file shown in" << endl;
+	cout << "                         the Cornell Box room" << endl;
+	cout << "  --cache FILE           load the scene from a binary cache, which is written if it is" << endl;
+	cout << "                         missing or was made from a different scene" << endl;
+	cout << "  --compact              store the meshes with 16 bit vertices and no triangle blocks," << endl;
+	cout << "                         which takes less memory but renders more slowly" << endl;
+	cout << "  --resident MB          render out of core from the scene cache, aiming to keep MB" << endl;
+	cout << "                         megabytes of the meshes in memory" << endl;
+	cout << "  --progressive          add one jittered sample per pixel every frame while the view" << endl;
+	cout << "                         stands still, instead of rendering all samples every frame" << endl;
+	cout << "  --exposure E           scale the radiance by E before it is displayed" << endl;
+	cout << "  --tonemap clamp|reinhard|aces" << endl;
+	cout << "                         how radiance above one is displayed, clamp cuts it off" << endl;
+	cout << "  --srgb                 encode the displayed colors with the sRGB curve" << endl;
+	cout << "  --headless             render without a window and write the images to files" << endl;
+	cout << "  --frames N             number of frames to render headless" << endl;
+	cout << "  --output FILE          output image (.ppm, .png or .exr), frames are numbered if" << endl;
+	cout << "                         more than one is rendered" << endl;
+	cout << "  --heatmap              also write the cost of every pixel, to FILE_cost, when" << endl;
+	cout << "                         compiled with the statistics enabled (make STATS=1)" << endl;
 }
 
-//check whether a ray intercepts with an object
-bool ObjectIntersection(vec3 start, vec3 dir, const Object& object) {
-	//Bounding box
-	vec3 Pmin = object.Pmin;
-	vec3 Pmax = object.Pmax;
-	
-	float txmin = (Pmin.x - start.x) / dir.x;
-	float txmax = (Pmax.x - start.x) / dir.x;
-
-	if(txmin > txmax) {
-		float tmp = txmin;
-		txmin = txmax;
-		txmax = tmp;
-	}
-
-	float tymin = (Pmin.y - start.y) / dir.y;
-	float tymax = (Pmax.y - start.y) / dir.y;
-
-	if(tymin > tymax) {
-		float tmp = tymin;
-		tymin = tymax;
-		tymax = tmp;
-	}
-
-	if((txmin > tymax) || (tymin > txmax)) {
-		return false;
-	}
-
-	if(tymin > txmin) {
-		txmin = tymin;
+//Print the work done for the last frame
+void PrintStatistics() {
+	int numTriangles = 0;
+	for(unsigned int j = 0; j < objects.size(); j++) {
+		numTriangles += objects[j].mesh->NumTriangles();
 	}
+	printf("Total number of triangles:                     %d\n", numTriangles);
+	printf("Total number of primary rays:                  %ld\n", frameStatistics.numPrimaryRays);
+	printf("Total number of shadow rays:                   %ld\n", frameStatistics.numShadowRays);
+	printf("Total number of indirect rays:                 %ld\n", frameStatistics.numIndirectRays);
+	printf("Total number of irradiance records:            %ld\n", frameStatistics.numIrradianceRecords);
+	printf("Total number of traversal steps:               %ld\n", frameStatistics.numTraversalSteps);
+	printf("Total number of bounding box tests:            %ld\n", frameStatistics.numRayBoxTests);
+	printf("Total number of ray-triangles tests:           %ld\n", frameStatistics.numRayTrianglesTests);
+	printf("Total number of ray-triangles intersections:   %ld\n", frameStatistics.numRayTrianglesIntersections);
+	printf("Total number of occluder cache hits:           %ld\n", frameStatistics.numOccluderCacheHits);
+	printf("Total number of reprojected pixels:            %ld\n", frameStatistics.numReprojectedPixels);
+	printf("Total number of deferred tests:                %ld\n", frameStatistics.numDeferredTests);
+	printf("Total number of pages loaded:                  %ld\n", frameStatistics.numPageLoads);
+	printf("Total number of heap allocations:              %ld\n", frameStatistics.numAllocations);
+	printf("\n");
+}
 
-	if(tymax < txmax) {
-		txmax = tymax;
+//Print how much of the meshes is in memory when rendering out of core
+void PrintPaging() {
+	if(geometryBudget > 0) {
+		printf("Resident geometry: %.1f MB, %ld pages loaded and %ld given back so far.\n",
+			pager.ResidentBytes() / 1048576.0, pager.NumLoads(), pager.NumEvictions());
 	}
+}
 
-	float tzmin = (Pmin.z - start.z) / dir.z;
-	float tzmax = (Pmax.z - start.z) / dir.z;
-
-	if(tzmin > tzmax) {
-		float tmp = tzmin;
-		tzmin = tzmax;
-		tzmax = tmp;
-	}
+//Write the heatmap of the cost of every pixel of the last frame next to the image of the frame,
+//and print the share of the cost of the pixels showing each object
+bool WriteHeatmap(const string& filename) {
+	size_t dot = filename.find_last_of('.');
+	string heatmapFilename = filename.substr(0, dot) + "_cost" + filename.substr(dot);
 
-	if((txmin > tzmax) || (tzmin > txmax)) {
+	vector<vec3> image;
+	CostHeatmap(costBuffer, image);
+	if(!WriteImage(heatmapFilename, screenWidth, screenHeight, &image[0])) {
+		cout << "Could not write " << heatmapFilename << endl;
 		return false;
 	}
 
-	if(tzmin > txmin) {
-		txmin = tzmin;
+	//index 0 holds the pixels that show no object
+	vector<double> objectCost(objects.size() + 1, 0);
+	double totalCost = 0;
+	for(unsigned int i = 0; i < costBuffer.size(); i++) {
+		objectCost[objectBuffer[i] + 1] += costBuffer[i];
+		totalCost += costBuffer[i];
 	}
-
-	if(tzmax < txmax) {
-		txmax = tzmax;
+	printf("Cost per object, written to %s\n", heatmapFilename.c_str());
+	for(unsigned int j = 0; j < objectCost.size(); j++) {
+		if(objectCost[j] > 0) {
+			if(j == 0) {
+				printf("  background: %5.1f%%\n", 100 * objectCost[j] / totalCost);
+			}
+			else {
+				printf("  object %3d: %5.1f%%\n", j - 1, 100 * objectCost[j] / totalCost);
+			}
+		}
 	}
-	
 	return true;
 }
 
-bool ClosestIntersection(vec3 start, vec3 dir, const vector<Object>& objects, Intersection& closestIntersection) {
-
-	//Increment the variable holding the total number of primary rays
-	numPrimaryRays++;
-
-	//bool stating whether or not this ray intersects a triangle
-	bool intersection = false;
-
-	//make sure that the direction vector is normalized
-	dir = normalize(dir);
-
-	for(unsigned int j = 0; j < objects.size(); j++) {
-	
-	
-		if(ObjectIntersection(start, dir, objects[j])) {
-
-			//iterates through all triangles
-			for(unsigned int i = 0; i < objects[j].triangles.size(); i++) {
-				//increment the variable counting the number of triangle ray intersection tests
-				numRayTrianglesTests++;
-	
-				//triangles vertices
-				vec3 v0 = objects[j].triangles[i].v0;
-				vec3 v1 = objects[j].triangles[i].v1;
-				vec3 v2 = objects[j].triangles[i].v2;
-		
-				//basis vectors
-				vec3 e1 = v1 - v0;
-				vec3 e2 = v2 - v0;	
-	
-				//b vector
-				vec3 b = start - v0;
-	
-				//A matrix
-				mat3 A(-dir, e1, e2);
-				float detA = glm::determinant(A);
-	
-				//Cramer's rule to calculate t
-				mat3 At(b, e1, e2);
-				float t = glm::determinant(At) / detA;
-		
-				//if the distance is greater than 0, i.e. the triangle is infront of the camera then continue
-				if(t > epsilon) {
-	
-					//Use Cramer's rule to calculate u
-					mat3 Au(-dir, b, e2);
-					float u = glm::determinant(Au) / detA;
-	
-					//Only continue if u meets the inequality conditions
-					if( u > -epsilon && u <= 1 + epsilon) {
-	
-						//Use Cramer's rule to calculate v
-						mat3 Av(-dir, e1, b);
-						float v = glm::determinant(Av) / detA;
-	
-						//If ray intersects triangle
-						if(v > -epsilon && u + v <= 1 + epsilon) {
-
-							//Increment the variable containing the total number of triangle ray intersections
-							numRayTrianglesIntersections++;
-	
-							//if this triangle is closer than the current closest intersection
-							if(t < closestIntersection.distance) {
-								//set intersection flag to true
-								intersection = true;
-								//update closestIntersection flag
-								closestIntersection.position = v0 + u * e1 + v * e2;
-								closestIntersection.distance = t;
-								closestIntersection.objectIndex = j;
-								closestIntersection.triangleIndex = i;
-							}
-						}
-					}
-				}
-			}
-		}
+//Name of the file a frame is written to, the frame number is added before the extension
+//when more than one frame is rendered
+string FrameFilename(int frame) {
+	if(numFrames == 1) {
+		return outputFile;
 	}
-
-	//return flag indicating whether ray intersects with any triangles
-	return intersection;
+	size_t dot = outputFile.find_last_of('.');
+	char number[16];
+	snprintf(number, sizeof(number), "_%04d", frame);
+	return outputFile.substr(0, dot) + number + outputFile.substr(dot);
 }
 
-bool PointInShadow(vec3 start, vec3 dir, const vector<Object>& objects, float radius) {
-
-	//Increment the variable holding the total number of primary rays
-	numPrimaryRays++;
-
-	//make sure that the direction vector is normalized
-	dir = normalize(dir);
+//Render numFrames frames without a window and write them to files
+int RenderHeadless() {
+	for(int frame = 0; frame < numFrames; frame++) {
+		chrono::steady_clock::time_point start = chrono::steady_clock::now();
+		raytracing();
+		float dt = chrono::duration<float, milli>(chrono::steady_clock::now() - start).count();
+
+		string filename = FrameFilename(frame);
+		if(!WriteImage(filename, screenWidth, screenHeight, &framebuffer[0], toneMapping)) {
+			cout << "Could not write " << filename << endl;
+			return 1;
+		}
+		printf("Render time: %.0f ms, written to %s\n", dt, filename.c_str());
+		PrintPaging();
 
-	for(unsigned int j = 0; j < objects.size(); j++) {
-	
-	
-		if(ObjectIntersection(start, dir, objects[j])) {
-
-			//iterates through all triangles
-			for(unsigned int i = 0; i < objects[j].triangles.size(); i++) {
-				//increment the variable counting the number of triangle ray intersection tests
-				numRayTrianglesTests++;
-	
-				//triangles vertices
-				vec3 v0 = objects[j].triangles[i].v0;
-				vec3 v1 = objects[j].triangles[i].v1;
-				vec3 v2 = objects[j].triangles[i].v2;
-		
-				//basis vectors
-				vec3 e1 = v1 - v0;
-				vec3 e2 = v2 - v0;	
-	
-				//b vector
-				vec3 b = start - v0;
-	
-				//A matrix
-				mat3 A(-dir, e1, e2);
-				float detA = glm::determinant(A);
-	
-				//Cramer's rule to calculate t
-				mat3 At(b, e1, e2);
-				float t = glm::determinant(At) / detA;
-		
-				//if the distance is greater than 0, i.e. the triangle is infront of the camera then continue
-				if(t > epsilon) {
-	
-					//Use Cramer's rule to calculate u
-					mat3 Au(-dir, b, e2);
-					float u = glm::determinant(Au) / detA;
-	
-					//Only continue if u meets the inequality conditions
-					if( u > -epsilon && u <= 1 + epsilon) {
-	
-						//Use Cramer's rule to calculate v
-						mat3 Av(-dir, e1, b);
-						float v = glm::determinant(Av) / detA;
-	
-						//If ray intersects triangle
-						if(v > -epsilon && u + v <= 1 + epsilon) {
-
-							//Increment the variable containing the total number of triangle ray intersections
-							numRayTrianglesIntersections++;
-	
-							//if this triangle is closer than the current closest intersection
-							if(t < radius + epsilon) {
-								//set intersection flag to true
-								return true;
-							}
-						}
-					}
-				}
-			}
+		if(heatmap && !WriteHeatmap(filename)) {
+			return 1;
+		}
+		if(statisticsEnabled) {
+			PrintStatistics();
 		}
+		frameStatistics = Statistics();
 	}
-
-	//return flag indicating whether ray intersects with any triangles
-	return false;
-}
-
-
-void updateRotationMatrix() {
-	//Calcuate new columns for the camera's rotation matrix
-	cameraRot[0] = vec3(cos(yaw), 0, -sin(yaw));
-	cameraRot[2] = vec3(sin(yaw), 0, cos(yaw));
-}
-
-//Calculate the Euclidean distance between the two given vectors
-float distanceBetweenPoints(vec3 a, vec3 b) {
-	return sqrt(pow(a.x - b.x, 2) + pow(a.y - b.y, 2) + pow(a.z - b.z, 2));
-}
-
-//Caluclate the dot product between the two given vectors
-float dotProduct(vec3 a, vec3 b) {
-	return a.x * b.x + a.y * b.y + a.z * b.z;
-}
-
-//Calculate the normalised direction vector from the given vector to the lightsource
-vec3 unitVectorToLightSource(vec3 a) {
-	vec3 v(lightPos.x - a.x, lightPos.y - a.y, lightPos.z - a.z);
-	return normalize(v);
-}
-
-vector<vec3> CalculateLightPoints() {
-	vector<vec3> points;
-	points.push_back(lightPos + vec3(lightRadius,0,0));
-	points.push_back(lightPos + vec3(-lightRadius,0,0));
-	points.push_back(lightPos + vec3(0,lightRadius,0));
-	points.push_back(lightPos + vec3(0,-lightRadius,0));
-	points.push_back(lightPos + vec3(0,0,lightRadius));
-	points.push_back(lightPos + vec3(0,0,-lightRadius));
-	return points;
+	return 0;
 }
 
-//Output the illumination of the point in the intersection
-vec3 DirectLight(const Intersection& i) {
+int main(int argc, char* argv[]) {
 
-	vec3 D(0,0,0);
+	bool reprojectionSet = false;
+	for(int i = 1; i < argc; i++) {
+		if(strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+			numThreads = atoi(argv[++i]);
+		}
+		else if(strcmp(argv[i], "--packet") == 0 && i + 1 < argc) {
+			//never use wider packets than the CPU supports
+			packetWidth = min(atoi(argv[++i]), packetWidth);
+		}
+		else if(strcmp(argv[i], "--width") == 0 && i + 1 < argc) {
+			screenWidth = atoi(argv[++i]);
+		}
+		else if(strcmp(argv[i], "--height") == 0 && i + 1 < argc) {
+			screenHeight = atoi(argv[++i]);
+		}
+		else if(strcmp(argv[i], "--samples") == 0 && i + 1 < argc) {
+			antiAliasingCells = atoi(argv[++i]);
+		}
+		else if(strcmp(argv[i], "--shadows") == 0 && i + 1 < argc) {
+			softShadows = strcmp(argv[++i], "hard") != 0;
+		}
+		else if(strcmp(argv[i], "--wavefront") == 0) {
+			wavefront = true;
+		}
+		else if(strcmp(argv[i], "--adaptive") == 0 && i + 1 < argc) {
+			adaptiveThreshold = atof(argv[++i]);
+		}
+		else if(strcmp(argv[i], "--reprojection") == 0 && i + 1 < argc) {
+			reprojectionPeriod = atoi(argv[++i]);
+			reprojectionSet = true;
+		}
+		else if(strcmp(argv[i], "--irradiance") == 0 && i + 1 < argc) {
+			irradianceError = atof(argv[++i]);
+		}
+		else if(strcmp(argv[i], "--budget") == 0 && i + 1 < argc) {
+			frameBudget = atof(argv[++i]);
+		}
+		else if(strcmp(argv[i], "--camera") == 0 && i + 4 < argc) {
+			cameraPos = vec3(atof(argv[i+1]), atof(argv[i+2]), atof(argv[i+3]));
+			yaw = atof(argv[i+4]);
+			i += 4;
+		}
+		else if(strcmp(argv[i], "--light") == 0 && i + 3 < argc) {
+			lightPos = vec3(atof(argv[i+1]), atof(argv[i+2]), atof(argv[i+3]));
+			i += 3;
+		}
+		else if(strcmp(argv[i], "--scene") == 0 && i + 1 < argc) {
+			sceneName = argv[++i];
+		}
+		else if(strcmp(argv[i], "--cache") == 0 && i + 1 < argc) {
+			sceneCacheFile = argv[++i];
+		}
+		else if(strcmp(argv[i], "--compact") == 0) {
+			compactMeshes = true;
+		}
+		else if(strcmp(argv[i], "--resident") == 0 && i + 1 < argc) {
+			geometryBudget = (size_t) (atof(argv[++i]) * 1048576);
+		}
+		else if(strcmp(argv[i], "--progressive") == 0) {
+			progressive = true;
+		}
+		else if(strcmp(argv[i], "--exposure") == 0 && i + 1 < argc) {
+			toneMapping.exposure = atof(argv[++i]);
+		}
+		else if(strcmp(argv[i], "--tonemap") == 0 && i + 1 < argc && ParseToneMapOperator(argv[i+1], toneMapping.op)) {
+			i++;
+		}
+		else if(strcmp(argv[i], "--srgb") == 0) {
+			toneMapping.srgb = true;
+		}
+		else if(strcmp(argv[i], "--headless") == 0) {
+			headless = true;
+		}
+		else if(strcmp(argv[i], "--frames") == 0 && i + 1 < argc) {
+			numFrames = atoi(argv[++i]);
+		}
+		else if(strcmp(argv[i], "--output") == 0 && i + 1 < argc) {
+			outputFile = argv[++i];
+		}
+		else if(strcmp(argv[i], "--heatmap") == 0) {
+			heatmap = true;
+		}
+		else {
+			PrintUsage(argv[0]);
+			return 1;
+		}
+	}
 
-	if(softShadows) {
+	int rowLength = sqrt(antiAliasingCells);
+	if(screenWidth < 1 || screenHeight < 1 || numFrames < 1 || antiAliasingCells < 1 || rowLength * rowLength != antiAliasingCells) {
+		PrintUsage(argv[0]);
+		return 1;
+	}
 
-		//the positions of all the light sources
-		vector<vec3> lightPoints = CalculateLightPoints();
-	
-		float fraction = 1.0f / (float) lightPoints.size();
+	string extension = outputFile.substr(outputFile.find_last_of('.') + 1);
+	if(extension != "ppm" && extension != "png" && extension != "exr") {
+		cout << "Unsupported output format: " << outputFile << endl;
+		return 1;
+	}
 
-		for(unsigned int j = 0; j < lightPoints.size(); j++) {
+	//frames that give every pixel all samples have no centre samples to reproject, unless the budget
+	//drops them to one sample
+	bool centreSamples = (adaptiveThreshold > 0 && antiAliasingCells > 1) || antiAliasingCells == 1 || frameBudget > 0;
+	if(reprojectionSet && reprojectionPeriod > 0 && (progressive || !centreSamples)) {
+		cout << "Warning: --reprojection does nothing with " << (progressive ? "--progressive" : "--adaptive 0 and several samples") << "." << endl;
+	}
 
-			//distance from intersection point to light source
-			float radius = length(i.position - lightPoints[j]);
+	if(heatmap && !(statisticsEnabled && headless)) {
+		cout << "--heatmap needs --headless and the statistics enabled, build with make STATS=1" << endl;
+		return 1;
+	}
 
-			//r is the unit vector describing direction from surface point to light source
-			vec3 v(lightPoints[j].x - i.position.x, lightPoints[j].y - i.position.y, lightPoints[j].z - i.position.z);
-			vec3 r = normalize(v);
+	if(numThreads < 1) {
+		numThreads = 1;
+	}
 
-			//trace ray from intersection point to lightsource, if intersection distance is less than distance to light
-			//source then give give this point no direct illumination. This creates shadow effect
-			if(!PointInShadow(i.position, r, objects, radius)) {
-				//The power per area at this point
-				vec3 B = lightColor / (4 * PI * (float) pow(radius,3));
+	ThreadPool pool(numThreads);
+	InitializeRenderer(pool);
 
-				//unit vector describing normal of surface
-				vec3 n = objects[i.objectIndex].triangles[i.triangleIndex].normal;
+	chrono::steady_clock::time_point start = chrono::steady_clock::now();
+	string error;
+	if(!LoadScene(sceneName, error)) {
+		cout << error << endl;
+		return 1;
+	}
+	float dt = chrono::duration<float, milli>(chrono::steady_clock::now() - start).count();
+	printf("Scene loaded in %.0f ms, meshes take %.1f MB.\n", dt, SceneMemoryUsage() / 1048576.0);
 
-				//fraction of the power per area depending on surface's angle from light source
-				D += fraction * B * max(dot(r,n),0.0f);
-			}
-		}
+	if(headless) {
+		return RenderHeadless();
 	}
-	else {
 
-		//distance from intersection point to light source
-		float radius = length(i.position - lightPos);
+	screen = InitializeSDL( screenWidth, screenHeight );
+	view = {cameraPos, yaw, lightPos};
+	pendingView = view;
+	windowWidth = screenWidth;
+	windowHeight = screenHeight;
+	backBuffer.resize(windowWidth * windowHeight);
+	frontBuffer.resize(windowWidth * windowHeight);
+	thread renderThread(RenderLoop);
+
+	bool shown = false;
+	int t = SDL_GetTicks();
+	while( NoQuitMessageSDL() )
+	{
+		int t2 = SDL_GetTicks();
+		Update(float(t2 - t) / 1000);
+		t = t2;
+		shown = Present(inputPeriod) || shown;
+	}
 
-		//r is the unit vector describing direction from surface point to light source
-		vec3 v(lightPos.x - i.position.x, lightPos.y - i.position.y, lightPos.z - i.position.z);
-		vec3 r = normalize(v);
+	//the frame being rendered is finished if none has been shown yet, so that the screenshot
+	//is never empty
+	{
+		lock_guard<mutex> lock(frameMutex);
+		quitRendering = true;
+		cancelFrame = shown;
+	}
+	viewChanged.notify_one();
+	renderThread.join();
+	Present(0);
 
-		//trace ray from intersection point to lightsource, if intersection distance is less than distance to light
-		//source then give give this point no direct illumination. This creates shadow effect
-		if(!PointInShadow(i.position, r, objects, radius)) {
-			//The power per area at this point
-			vec3 B = lightColor / (4 * PI * (float) pow(radius,3));
-				
-			//unit vector describing normal of surface
-			vec3 n = objects[i.objectIndex].triangles[i.triangleIndex].normal;				
+	SDL_SaveBMP( screen, "screenshot.bmp" );	
 
-			//fraction of the power per area depending on surface's angle from light source
-			D = B * max(dot(r,n),0.0f);
-		}
-	}	
-	return D;
+	return 0;
 }
 
-
-void Update()
+//Move the camera and the light by the keys held for dt seconds, and publish the new view to
+//the render thread if it changed
+void Update(float dt)
 {
-	// Compute frame time:
-	int t2 = SDL_GetTicks();
-	float dt = float(t2-t);
-	t = t2;
-	printf("Render time: %.0f ms.\n", dt);
-	/*
-	printf("Total number of triangles:                     %d\n", (int) (objects[0].triangles.size() + objects[1].triangles.size() + objects[2].triangles.size()));
-	printf("Total number of primary rays:                  %d\n", numPrimaryRays);
-	printf("Total number of bounding box tests:            %d\n", numRayBoxTests);
-	printf("Total number of ray-triangles tests:           %d\n", numRayTrianglesTests);
-	printf("Total number of ray-triangles intersections:   %d\n", numRayTrianglesIntersections);
-	printf("\n");
-	*/
-
-	numPrimaryRays = 0;
-	numRayBoxTests = 0;
-	numRayTrianglesTests = 0;
-	numRayTrianglesIntersections = 0;
-
+	View previous = view;
 
 	//get key presses and update camera position
 	Uint8* keystate = SDL_GetKeyState(0);
+	vec3 forward(sin(view.yaw), 0, cos(view.yaw));
 	if(keystate[SDLK_UP])
 	{
-		//calculate the z-axis vector and move camera in the positive direction
-		vec3 forward(cameraRot[2][0], cameraRot[2][1], cameraRot[2][2]);
-		cameraPos += posDelta * forward;
+		//move the camera along its z-axis in the positive direction
+		view.cameraPos += posSpeed * dt * forward;
 	}
 	if(keystate[SDLK_DOWN])
 	{	
-		//calculate the z-axis vector and move camera in the negative direction
-		vec3 forward(cameraRot[2][0], cameraRot[2][1], cameraRot[2][2]);
-		cameraPos -= posDelta * forward;
-		
+		//move the camera along its z-axis in the negative direction
+		view.cameraPos -= posSpeed * dt * forward;
 	}
 	if(keystate[SDLK_LEFT])
 	{
-		//decrease the rotation angle and update rotation matrix 
-		yaw -= rotDelta;
-		updateRotationMatrix();
+		//decrease the rotation angle
+		view.yaw -= rotSpeed * dt;
 	}
 	if(keystate[SDLK_RIGHT])
 	{
-		//increase the rotation angle and update the rotation matrix
-		yaw += rotDelta;
-		updateRotationMatrix();
+		//increase the rotation angle
+		view.yaw += rotSpeed * dt;
 	}
 
 	//Move light position depending on key press
 	if(keystate[SDLK_w])
 	{
-		lightPos.z += lightDelta;
+		view.lightPos.z += lightSpeed * dt;
 	}
 	if(keystate[SDLK_s])
 	{
-		lightPos.z -= lightDelta;
+		view.lightPos.z -= lightSpeed * dt;
 	}
 	if(keystate[SDLK_a])
 	{
-		lightPos.x -= lightDelta;
+		view.lightPos.x -= lightSpeed * dt;
 	}
 	if(keystate[SDLK_d])
 	{
-		lightPos.x += lightDelta;
+		view.lightPos.x += lightSpeed * dt;
 	}
 	if(keystate[SDLK_q])
 	{
-		lightPos.y -= lightDelta;
+		view.lightPos.y -= lightSpeed * dt;
 	}
 	if(keystate[SDLK_e])
 	{
-		lightPos.y += lightDelta;
+		view.lightPos.y += lightSpeed * dt;
+	}
+
+	if(view.cameraPos != previous.cameraPos || view.yaw != previous.yaw || view.lightPos != previous.lightPos) {
+		{
+			lock_guard<mutex> lock(frameMutex);
+			pendingView = view;
+			viewVersion++;
+			if(!lastFrameCancelled) {
+				cancelFrame = true;
+			}
+		}
+		viewChanged.notify_one();
 	}
 }
 
-void getArrayOfDirectionVectors(float x, float y, int n, vec3 dir[]) {
+//Row y of the window, interpolated bilinearly from the framebuffer when it was rendered at a
+//lower resolution
+const vec3* WindowRow(int y, vec3* row) {
+	if(screenWidth == windowWidth && screenHeight == windowHeight) {
+		return &framebuffer[y * screenWidth];
+	}
+
+	float sy = (y + 0.5f) * screenHeight / windowHeight - 0.5f;
+	int y0 = glm::clamp(int(floor(sy)), 0, screenHeight - 1);
+	int y1 = min(y0 + 1, screenHeight - 1);
+	float fy = glm::clamp(sy - y0, 0.f, 1.f);
+	const vec3* row0 = &framebuffer[y0 * screenWidth];
+	const vec3* row1 = &framebuffer[y1 * screenWidth];
+
+	for(int x = 0; x < windowWidth; x++) {
+		float sx = (x + 0.5f) * screenWidth / windowWidth - 0.5f;
+		int x0 = glm::clamp(int(floor(sx)), 0, screenWidth - 1);
+		int x1 = min(x0 + 1, screenWidth - 1);
+		float fx = glm::clamp(sx - x0, 0.f, 1.f);
+		row[x] = glm::mix(glm::mix(row0[x0], row0[x1], fx), glm::mix(row1[x0], row1[x1], fx), fy);
+	}
+	return row;
+}
 
-	int rowLength = sqrt(n);
+//Render frames on the render thread until quitRendering is set. A frame is rendered when the view
+//changed, a progressive image is still converging or the last frame was of lower quality,
+//otherwise the thread waits
+void RenderLoop() {
+	PackedFormat format = {screen->format->Rshift, screen->format->Gshift, screen->format->Bshift, screen->format->Amask};
+	int renderedVersion = -1;
+	const int fullSamples = antiAliasingCells;
+	FrameGovernor governor(frameBudget, fullSamples);
+	bool reduced = false;
+
+	while(true) {
+		bool moving;
+		{
+			unique_lock<mutex> lock(frameMutex);
+			viewChanged.wait(lock, [&] {
+				return quitRendering || viewVersion != renderedVersion || reduced || (progressive && numAccumulated < maxAccumulated);
+			});
+			if(quitRendering && renderedVersion >= 0) {
+				return;
+			}
+			moving = viewVersion != renderedVersion;
+			cameraPos = pendingView.cameraPos;
+			yaw = pendingView.yaw;
+			lightPos = pendingView.lightPos;
+			renderedVersion = viewVersion;
+			cancelFrame = false;
+		}
+		updateRotationMatrix();
 
-	float cellLength = 1/(float) rowLength;
-	int k = 0;
+		//the governor chooses the quality while the view moves, once it stands still the frame is
+		//rendered at full quality
+		bool governed = frameBudget > 0 && moving;
+		float scale = governed ? governor.Scale() : 1;
+		int width = max(int(windowWidth * scale + 0.5f), 1);
+		int height = max(int(windowHeight * scale + 0.5f), 1);
+		if(width != screenWidth || height != screenHeight) {
+			ResizeRenderer(width, height);
+		}
+		antiAliasingCells = governed ? governor.Samples() : fullSamples;
 
-	for(int i = 0; i < rowLength; i++) {
-		for(int j = 0; j < rowLength; j++) {
+		chrono::steady_clock::time_point start = chrono::steady_clock::now();
+		bool complete = raytracing();
+		float dt = chrono::duration<float, milli>(chrono::steady_clock::now() - start).count();
 
-			//For now not using any randomness
-			float newX = (x - ((i-1) * cellLength));
-			float newY = (y - ((j-1) * cellLength));
+		if(complete) {
+			if(governed) {
+				governor.FrameRendered(dt);
+			}
+			reduced = width != windowWidth || height != windowHeight || antiAliasingCells != fullSamples;
 
-			dir[k] = normalize(vec3(newX, newY, focalLength));
-			dir[k] = cameraRot * dir[k];
-			k++;
-		}
-	}
-}
+			printf("Render time: %.0f ms.\n", dt);
+			PrintPaging();
+			if(statisticsEnabled) {
+				PrintStatistics();
+			}
 
-void raytracing() {
-	//Iterate through all pixels in window
-	for(int y = 0; y < SCREEN_HEIGHT; y++) {
-		for(int x = 0; x < SCREEN_WIDTH; x++) {
-		
-			//Calculate relative x and y positions of the pixel to the camera position
-			float newX = (float) x - (float) SCREEN_WIDTH / 2;
-			float newY = (float) y - (float) SCREEN_HEIGHT / 2;
-
-			//array of direction vectors used for antialiasing
-			vec3 d[antiAliasingCells];
-			getArrayOfDirectionVectors(newX, newY, antiAliasingCells, d);
-
-			vec3 R(0,0,0);
-
-			float factor = 1.0f/(float) antiAliasingCells;
-			
-			//If the ray intersects a triangle then fill the pixel
-			//with the color of the closest intersecting triangle
-			for(int i = 0; i < antiAliasingCells; i++) {
-
-				//holds information about the closest intersection for this ray
-				Intersection closest = {vec3(0,0,0), std::numeric_limits<float>::max(), -1};
-
-				if(ClosestIntersection(cameraPos, d[i], objects, closest) == true) {
-					//row
-					vec3 color = objects[closest.objectIndex].triangles[closest.triangleIndex].color;
-					//D
-					vec3 light = DirectLight(closest);
-		
-					//Assuming diffuse surface, the light that gets reflected is the color vector * the light vector plus
-					//the indirect light vector where the * operator denotes element-wise multiplication between vectors.
-					R += color * (light + indirectLight) * factor;
+			//Tone map the rendered image into the back buffer, a few rows per task
+			const int rowsPerTask = 16;
+			threadPool->ParallelFor((windowHeight + rowsPerTask - 1) / rowsPerTask, [&](int task, int thread) {
+				arena.Reset();
+				vec3* row = arena.Allocate<vec3>(windowWidth);
+				for(int y = task * rowsPerTask; y < min((task + 1) * rowsPerTask, windowHeight); y++) {
+					ToneMapRow(WindowRow(y, row), windowWidth, &backBuffer[y * windowWidth], toneMapping, format);
 				}
+			});
+		}
+		frameStatistics = Statistics();
+
+		{
+			lock_guard<mutex> lock(frameMutex);
+			lastFrameCancelled = !complete;
+			if(complete) {
+				swap(backBuffer, frontBuffer);
+				newFrame = true;
 			}
-			PutPixelSDL(screen, x, y, R);
 		}
+		frameFinished.notify_one();
 	}
 }
 
-void Draw() {
-	SDL_FillRect(screen, 0, 0);
+//Show the last finished frame if it has not been shown yet, waiting up to timeout milliseconds for
+//one. Returns whether a frame was shown
+bool Present(int timeout) {
+	unique_lock<mutex> lock(frameMutex);
+	if(!frameFinished.wait_for(lock, chrono::milliseconds(timeout), [] { return newFrame; })) {
+		return false;
+	}
+	newFrame = false;
 
 	if(SDL_MUSTLOCK(screen)) {
 		SDL_LockSurface(screen);
 	}
 
-	raytracing();
+	//Copy the frame to the screen row by row, the rows of the screen may be padded
+	for(int y = 0; y < windowHeight; y++) {
+		memcpy((char*) screen->pixels + y * screen->pitch, &frontBuffer[y * windowWidth], windowWidth * sizeof(uint32_t));
+	}
 
 	if(SDL_MUSTLOCK(screen)) {
 		SDL_UnlockSurface(screen);
 	}
+	lock.unlock();
 
 	SDL_UpdateRect(screen, 0, 0, 0, 0);
-
+	return true;
 }